@@ -6,9 +6,15 @@
 #include "AgentMessage.h"
 #include "AgentMessageTypes.h"
 #include "Debug.h"
+#include "ShaHash.h"
 
+#include <algorithm>
 #include <cassert>
+#include <climits>
+#include <cerrno>
+#include <deque>
 #include <fcntl.h>
+#include <poll.h>
 #include <stdexcept>
 #include <sys/socket.h>
 #include <sys/types.h>
@@ -17,11 +23,60 @@
 
 namespace SshCrypt
 {
-AgentComm::AgentComm( std::string socketName )
+namespace
+{
+using Clock = AgentComm::Clock;
+
+Clock::time_point deadlineAfter( std::chrono::milliseconds timeout )
+{
+  return timeout.count() > 0 ? Clock::now() + timeout : Clock::time_point::max();
+}
+
+//! poll() timeout until \a deadline, -1 for none
+int milliseconds( Clock::time_point deadline )
+{
+  if( deadline == Clock::time_point::max() )
+    return -1;
+  const auto left = std::chrono::ceil<std::chrono::milliseconds>( deadline - Clock::now() );
+  return static_cast<int>( std::clamp<long long>( left.count(), 0, INT_MAX ) );
+}
+
+//! a callback for the asynchronous requests, that fulfills the returned future
+template <typename T>
+std::pair<std::function<void( T, std::exception_ptr )>, std::future<T>> promised()
+{
+  auto promise = std::make_shared<std::promise<T>>();
+  auto future = promise->get_future();
+  return { [ promise ]( T value, std::exception_ptr error ) {
+            if( error )
+              promise->set_exception( error );
+            else
+              promise->set_value( std::move( value ) );
+          },
+           std::move( future ) };
+}
+} // namespace
+
+AgentComm::AgentComm( std::string socketName ) :
+    sock{ connectSocket( std::move( socketName ) ) }
+{
+  LOG_DEBUG( "socket is open" );
+}
+
+AgentComm::~AgentComm()
+{
+  if( sock != -1 )
+  {
+    close( sock );
+  }
+}
+
+int AgentComm::connectSocket( std::string socketName ) // static
 {
   if( socketName.empty() )
   {
-    socketName = getenv( "SSH_AUTH_SOCK" );
+    const char* authSock = getenv( "SSH_AUTH_SOCK" );
+    socketName = authSock ? authSock : "";
   }
 
   if( socketName.empty() )
@@ -35,7 +90,7 @@ AgentComm::AgentComm( std::string socketName )
     throw std::runtime_error{ "unix domain socket path to long" };
   }
 
-  sock = socket( PF_UNIX, SOCK_STREAM, 0 );
+  const int sock = socket( PF_UNIX, SOCK_STREAM, 0 );
 
   if( sock == -1 )
   {
@@ -45,113 +100,637 @@ AgentComm::AgentComm( std::string socketName )
   struct sockaddr_un addr;
   memset( &addr, 0, sizeof addr );
   addr.sun_family = AF_UNIX;
-  strncpy( addr.sun_path, socketName.c_str(), maxNameLength );
+  strncpy( addr.sun_path, socketName.c_str(), maxNameLength - 1 );
   if( connect( sock, reinterpret_cast<struct sockaddr*>( &addr ), sizeof addr ) == -1 )
   {
-    // const int saveError = errno;
     close( sock );
-    sock = -1;
     throw std::runtime_error{ "can't connect unix-domain socket" };
   }
-
-  LOG_DEBUG( "socket is open" );
+  return sock;
 }
 
-AgentComm::~AgentComm()
+//! blocks until \a events are possible, throws when \a deadline passes
+void AgentComm::waitFor( short events, Clock::time_point deadline )
 {
-  if( sock != -1 )
+  for( ;; )
   {
-    close( sock );
+    pollfd fds{ sock, events, 0 };
+    const int rc = poll( &fds, 1, milliseconds( deadline ) );
+    if( rc < 0 && errno == EINTR )
+      continue;
+    if( rc < 0 )
+    {
+      throw std::runtime_error{ "poll failed" };
+    }
+    if( rc == 0 )
+    {
+      throw std::runtime_error{ "agent timed out" };
+    }
+    return;
   }
 }
 
 AgentMessage AgentComm::sendReceive( const AgentMessage& request )
+{
+  sendRequest( request );
+  return receiveResponse();
+}
+
+void AgentComm::sendRequest( const AgentMessage& request )
 {
   assert( request.getMessageSize() + 4 == request.getData().size() );
 
   LOG_DEBUG( "sending " << toHex( request.getData() ) );
 
-  ssize_t w1 = send( sock, request.getData().data(), request.getData().size(), 0 );
-  if( w1 == -1 )
+  const auto deadline = deadlineAfter( timeout );
+  const Byte* pos = request.getData().data();
+  Size left = request.getData().size();
+  while( left > 0 )
   {
-    throw std::runtime_error{ "failed to send message" };
-  }
-
-  bool haveSize = false;
-  Size recvLength = 0;
-  AgentMessage response;
-  do
-  {
-    Byte buffer[ 4096 ];
-    ssize_t rl = recv( sock, buffer, sizeof buffer, 0 );
-
-    if( rl < 0 )
+    ssize_t w1 = send( sock, pos, left, MSG_NOSIGNAL | MSG_DONTWAIT );
+    if( w1 == -1 && errno == EINTR )
+      continue;
+    if( w1 == -1 && ( errno == EAGAIN || errno == EWOULDBLOCK ) )
     {
-      throw std::runtime_error{ "recv failed" };
+      waitFor( POLLOUT, deadline );
+      continue;
     }
-
-    if( rl == 0 )
+    if( w1 == -1 )
     {
-      throw std::runtime_error{ "recv returned 0" };
+      throw std::runtime_error{ "failed to send message" };
     }
+    pos += w1;
+    left -= static_cast<Size>( w1 );
+  }
+}
 
-    LOG_DEBUG( "received " << rl << " bytes" );
-
-    response.append( buffer, static_cast<int>( rl ) );
-
-    if( !haveSize && response.getData().size() >= 4 )
+//! reads exactly one message, the next response of a pipeline stays in the socket
+AgentMessage AgentComm::receiveResponse()
+{
+  const auto deadline = deadlineAfter( timeout );
+  const auto receiveAll = [ this, deadline ]( Byte* buffer, Size size ) {
+    while( size > 0 )
     {
-      recvLength = response.getMessageSize();
-      haveSize = true;
-      LOG_DEBUG( "received size: " << recvLength );
+      ssize_t rl = recv( sock, buffer, size, MSG_DONTWAIT );
+      if( rl < 0 && errno == EINTR )
+        continue;
+      if( rl < 0 && ( errno == EAGAIN || errno == EWOULDBLOCK ) )
+      {
+        waitFor( POLLIN, deadline );
+        continue;
+      }
+
+      if( rl < 0 )
+      {
+        throw std::runtime_error{ "recv failed" };
+      }
+
+      if( rl == 0 )
+      {
+        throw std::runtime_error{ "recv returned 0" };
+      }
+
+      LOG_DEBUG( "received " << rl << " bytes" );
+      buffer += rl;
+      size -= static_cast<Size>( rl );
     }
-  } while( !haveSize || response.getData().size() < ( 4 + recvLength ) );
+  };
+
+  Byte sizeBuffer[ 4 ];
+  receiveAll( sizeBuffer, sizeof sizeBuffer );
+  const Size recvLength = Decoder::net2int( sizeBuffer );
+  LOG_DEBUG( "received size: " << recvLength );
+  if( recvLength == 0 || recvLength > maxResponseSize )
+  {
+    throw std::runtime_error{ "bad response size" };
+  }
+
+  Data data( 4 + recvLength );
+  std::copy( sizeBuffer, sizeBuffer + 4, data.begin() );
+  receiveAll( data.data() + 4, recvLength );
 
+  AgentMessage response = AgentMessage::fromData( std::move( data ) );
   LOG_DEBUG( "received " << toHex( response.getData() ) );
   return response;
 }
 
 std::vector<AgentComm::Identity> AgentComm::requestIdentities()
 {
-  std::vector<AgentComm::Identity> idList;
-  AgentMessage response = sendReceive( AgentMessage{ SSH_AGENTC_REQUEST_IDENTITIES } );
+  return identities( sendReceive( AgentMessage{ SSH_AGENTC_REQUEST_IDENTITIES } ) );
+}
 
+//! the identities point into \a response, nothing is copied
+std::vector<AgentComm::Identity> AgentComm::identities( AgentMessage response ) // static
+{
   if( response.type() != SSH_AGENT_IDENTITIES_ANSWER )
   {
     throw std::runtime_error{ "bad answer, expected identities-answer" };
   }
 
-  Decoder idDecode = response.decoder();
+  const auto shared = std::make_shared<const AgentMessage>( std::move( response ) );
+  Decoder idDecode = shared->decoder();
   Size numKeys = idDecode.getInt();
 
+  // every identity takes at least two sizes, a bogus count can't reserve much
+  std::vector<AgentComm::Identity> idList;
+  idList.reserve( std::min( numKeys, idDecode.bytesLeft() / 8 ) );
   for( Size i = 0; i < numKeys; ++i )
   {
-    const Data keyData = idDecode.getBlobData();
-    const Data keyComment = idDecode.getBlobData();
+    const DataView keyData = idDecode.getBlob();
+    const DataView keyComment = idDecode.getBlob();
 
-    idList.push_back( Identity{ keyData, keyComment } );
+    idList.push_back( Identity{ keyData, keyComment, shared } );
   }
 
   return idList;
 }
 
-Data AgentComm::requestSignature( const Data& pubkey, const Data& data )
+Data AgentComm::requestSignature( DataView pubkey, DataView data )
 {
-  AgentMessage signRequest{ SSH_AGENTC_SIGN_REQUEST, 5 + pubkey.size() + data.size() + 4 };
-  signRequest.addBlob( pubkey );
-  signRequest.addBlob( data );
-  signRequest.addInt( SSH_AGENT_RSA_SHA2_256 );
-  signRequest.adjustMessageSize();
+  return signature( sendReceive( signRequest( pubkey, data ) ) );
+}
 
-  AgentMessage response = sendReceive( signRequest );
+std::vector<Data> AgentComm::requestSignatures( DataView pubkey, const std::vector<Data>& data )
+{
+  std::vector<Data> result;
+  result.reserve( data.size() );
+  Size sent = 0;
+  while( result.size() < data.size() )
+  {
+    for( ; sent < data.size() && sent - result.size() < window; ++sent )
+    {
+      sendRequest( signRequest( pubkey, data[ sent ] ) );
+    }
+    result.push_back( signature( receiveResponse() ) );
+  }
+  return result;
+}
+
+AgentMessage AgentComm::signRequest( DataView pubkey, DataView data ) // static
+{
+  AgentMessage request{ SSH_AGENTC_SIGN_REQUEST, 5 + 4 + pubkey.size() + 4 + data.size() + 4 };
+  request.addBlob( pubkey );
+  request.addBlob( data );
+  request.addInt( SSH_AGENT_RSA_SHA2_256 );
+  request.adjustMessageSize();
+  return request;
+}
 
+Data AgentComm::signature( const AgentMessage& response ) // static
+{
   if( response.type() != SSH_AGENT_SIGN_RESPONSE )
   {
     throw std::runtime_error{ "bad answer, expected sign-response" };
   }
 
-  Data signature = response.decoder().getBlobData();
-  return signature;
+  return response.decoder().getBlobData();
+}
+
+//! ask sshcrypt-agent for the session key of identity \a id (empty for the first one)
+Data AgentComm::requestDerivedKey( const std::string& id,
+                                   const Data& salt,
+                                   std::string* fingerprint )
+{
+  constexpr Size nameSize = sizeof SSHCRYPT_EXTENSION_DERIVE_KEY - 1;
+  AgentMessage request{ SSH_AGENTC_EXTENSION,
+                        5 + 4 + nameSize + 4 + id.size() + 4 + salt.size() };
+  request.addBlob( reinterpret_cast<const Byte*>( SSHCRYPT_EXTENSION_DERIVE_KEY ), nameSize );
+  request.addBlob( reinterpret_cast<const Byte*>( id.data() ), id.size() );
+  request.addBlob( salt );
+  request.adjustMessageSize();
+
+  AgentMessage response = sendReceive( request );
+
+  if( response.type() != SSH_AGENT_SUCCESS )
+  {
+    throw std::runtime_error{ "bad answer, expected success" };
+  }
+
+  Decoder decoder = response.decoder();
+  Data sessionKey = decoder.getBlobData();
+  // older versions answer with the session key alone
+  if( fingerprint && decoder.bytesLeft() > 0 )
+    *fingerprint = toString( decoder.getBlob() );
+  return sessionKey;
+}
+
+IdentityTable::IdentityTable( std::vector<AgentComm::Identity> identities,
+                              const IdentityTable* previous )
+{
+  // the agent sends the same answer until a key is added or removed
+  const bool unchanged = previous && !identities.empty()
+                         && previous->table.size() == identities.size()
+                         && previous->table.front().identity.response->getData()
+                                == identities.front().response->getData();
+
+  table.reserve( identities.size() );
+  for( Size i = 0; i < identities.size(); ++i )
+  {
+    Entry entry;
+    entry.identity = std::move( identities[ i ] );
+    if( unchanged )
+    {
+      entry.fingerprint = previous->table[ i ].fingerprint;
+      entry.keyType = previous->table[ i ].keyType;
+    }
+    else
+    {
+      entry.fingerprint = toBase64( ShaHash::check( entry.identity.pubkey ), false );
+      try
+      {
+        Decoder keyDecoder{ entry.identity.pubkey.data(), entry.identity.pubkey.size() };
+        entry.keyType = toString( keyDecoder.getBlob() );
+      }
+      catch( const std::exception& )
+      {
+        LOG_DEBUG( "public key without type" );
+      }
+    }
+    LOG_DEBUG( entry.fingerprint << " " << toString( entry.identity.comment ) );
+
+    fingerprints.emplace( entry.fingerprint, i );
+    comments.emplace( toString( entry.identity.comment ), i );
+    keyTypes.emplace( entry.keyType, i );
+    table.push_back( std::move( entry ) );
+  }
+}
+
+const IdentityTable::Entry* IdentityTable::find( const char* id ) const
+{
+  if( table.empty() )
+    return nullptr;
+  if( !id )
+    return &table.front();
+
+  const auto found = fingerprints.find( id );
+  return found == fingerprints.end() ? nullptr : &table[ found->second ];
+}
+
+const IdentityTable::Entry& IdentityTable::get( const char* id ) const
+{
+  if( table.empty() )
+  {
+    throw std::runtime_error{ "no identities found" };
+  }
+  const Entry* entry = find( id );
+  if( !entry )
+  {
+    throw std::runtime_error{ "identity not found" };
+  }
+  LOG_DEBUG( "using identity " << entry->fingerprint );
+  return *entry;
+}
+
+std::vector<const IdentityTable::Entry*> IdentityTable::byComment(
+    const std::string& comment ) const
+{
+  return entries( comments, comment );
+}
+
+std::vector<const IdentityTable::Entry*> IdentityTable::byKeyType(
+    const std::string& keyType ) const
+{
+  return entries( keyTypes, keyType );
+}
+
+//! in the order of the agent
+std::vector<const IdentityTable::Entry*> IdentityTable::entries(
+    const std::unordered_multimap<std::string, Size>& index, const std::string& key ) const
+{
+  std::vector<Size> found;
+  const auto range = index.equal_range( key );
+  for( auto iter = range.first; iter != range.second; ++iter )
+  {
+    found.push_back( iter->second );
+  }
+  std::sort( found.begin(), found.end() );
+
+  std::vector<const Entry*> result;
+  for( Size i : found )
+  {
+    result.push_back( &table[ i ] );
+  }
+  return result;
+}
+
+AsyncAgentComm::AsyncAgentComm( std::string theSocketName ) :
+    socketName{ std::move( theSocketName ) }, sock{ AgentComm::connectSocket( socketName ) }
+{
+}
+
+AsyncAgentComm::~AsyncAgentComm()
+{
+  if( sock != -1 )
+  {
+    close( sock );
+  }
+}
+
+void AsyncAgentComm::request( const AgentMessage& message, Callback callback )
+{
+  assert( message.getMessageSize() + 4 == message.getData().size() );
+
+  if( sock == -1 )
+  {
+    sock = AgentComm::connectSocket( socketName );
+  }
+
+  LOG_DEBUG( "queueing " << toHex( message.getData() ) );
+  output.insert( output.end(), message.getData().begin(), message.getData().end() );
+  pending.push_back( Pending{ deadlineAfter( timeout ), std::move( callback ) } );
+  flushOutput();
+}
+
+std::future<AgentMessage> AsyncAgentComm::request( const AgentMessage& message )
+{
+  auto callback = promised<AgentMessage>();
+  request( message, std::move( callback.first ) );
+  return std::move( callback.second );
+}
+
+void AsyncAgentComm::requestIdentities( IdentitiesCallback callback )
+{
+  request( AgentMessage{ SSH_AGENTC_REQUEST_IDENTITIES },
+           [ callback ]( AgentMessage response, std::exception_ptr error ) {
+             std::vector<AgentComm::Identity> identities;
+             if( !error )
+             {
+               try
+               {
+                 identities = AgentComm::identities( std::move( response ) );
+               }
+               catch( const std::exception& )
+               {
+                 error = std::current_exception();
+               }
+             }
+             callback( std::move( identities ), error );
+           } );
+}
+
+std::future<std::vector<AgentComm::Identity>> AsyncAgentComm::requestIdentities()
+{
+  auto callback = promised<std::vector<AgentComm::Identity>>();
+  requestIdentities( std::move( callback.first ) );
+  return std::move( callback.second );
+}
+
+void AsyncAgentComm::requestSignature( DataView pubkey,
+                                       DataView data,
+                                       SignatureCallback callback )
+{
+  request( AgentComm::signRequest( pubkey, data ),
+           [ callback ]( AgentMessage response, std::exception_ptr error ) {
+             Data signature;
+             if( !error )
+             {
+               try
+               {
+                 signature = AgentComm::signature( response );
+               }
+               catch( const std::exception& )
+               {
+                 error = std::current_exception();
+               }
+             }
+             callback( std::move( signature ), error );
+           } );
+}
+
+std::future<Data> AsyncAgentComm::requestSignature( DataView pubkey, DataView data )
+{
+  auto callback = promised<Data>();
+  requestSignature( pubkey, data, std::move( callback.first ) );
+  return std::move( callback.second );
+}
+
+short AsyncAgentComm::events() const
+{
+  short result = 0;
+  if( !pending.empty() )
+    result |= POLLIN;
+  if( outputPos < output.size() )
+    result |= POLLOUT;
+  return result;
+}
+
+int AsyncAgentComm::pollTimeout() const
+{
+  auto deadline = Clock::time_point::max();
+  for( const auto& request : pending )
+  {
+    deadline = std::min( deadline, request.deadline );
+  }
+  return milliseconds( deadline );
+}
+
+void AsyncAgentComm::handleEvents( short revents )
+{
+  if( sock != -1 && outputPos < output.size() )
+  {
+    flushOutput();
+  }
+  if( sock != -1 && ( revents & ( POLLIN | POLLHUP | POLLERR ) ) )
+  {
+    readInput();
+  }
+
+  const auto now = Clock::now();
+  for( const auto& request : pending )
+  {
+    if( request.deadline <= now )
+    {
+      fail( std::make_exception_ptr( std::runtime_error{ "agent timed out" } ) );
+      break;
+    }
+  }
+}
+
+void AsyncAgentComm::run()
+{
+  while( busy() )
+  {
+    pollfd fds{ sock, events(), 0 };
+    if( poll( &fds, 1, pollTimeout() ) < 0 )
+    {
+      if( errno == EINTR )
+        continue;
+      throw std::runtime_error{ "poll failed" };
+    }
+    handleEvents( fds.revents );
+  }
+}
+
+void AsyncAgentComm::flushOutput()
+{
+  while( outputPos < output.size() )
+  {
+    const ssize_t w1
+        = send( sock, output.data() + outputPos, output.size() - outputPos,
+                MSG_NOSIGNAL | MSG_DONTWAIT );
+    if( w1 == -1 && errno == EINTR )
+      continue;
+    if( w1 == -1 && ( errno == EAGAIN || errno == EWOULDBLOCK ) )
+      return;
+    if( w1 == -1 )
+    {
+      fail( std::make_exception_ptr( std::runtime_error{ "failed to send message" } ) );
+      return;
+    }
+    outputPos += static_cast<Size>( w1 );
+  }
+  output.clear();
+  outputPos = 0;
+}
+
+//! reads what is there and completes the requests, whose responses are complete
+void AsyncAgentComm::readInput()
+{
+  for( ;; )
+  {
+    const Size room = input.prepare( 16 * 1024 );
+    const ssize_t rl = recv( sock, input.tail(), room, MSG_DONTWAIT );
+    if( rl < 0 && errno == EINTR )
+      continue;
+    if( rl < 0 && ( errno == EAGAIN || errno == EWOULDBLOCK ) )
+      break;
+    if( rl <= 0 )
+    {
+      fail( std::make_exception_ptr(
+          std::runtime_error{ rl == 0 ? "agent closed the connection" : "recv failed" } ) );
+      return;
+    }
+    LOG_DEBUG( "received " << rl << " bytes" );
+    input.commit( static_cast<Size>( rl ) );
+  }
+
+  // a callback may send further requests or fail the connection, which clears input
+  for( ;; )
+  {
+    AgentMessage response;
+    try
+    {
+      if( !input.next( response ) )
+        break;
+      if( pending.empty() )
+        throw std::runtime_error{ "unexpected response" };
+    }
+    catch( const std::exception& )
+    {
+      fail( std::current_exception() );
+      return;
+    }
+    LOG_DEBUG( "received " << toHex( response.getData() ) );
+
+    Callback callback = std::move( pending.front().callback );
+    pending.pop_front();
+    callback( std::move( response ), nullptr );
+  }
+}
+
+//! closes the connection, all requests in flight get \a error
+void AsyncAgentComm::fail( const std::exception_ptr& error )
+{
+  if( sock != -1 )
+  {
+    close( sock );
+    sock = -1;
+  }
+  output.clear();
+  outputPos = 0;
+  input.clear();
+
+  auto failed = std::move( pending );
+  pending.clear();
+  for( auto& request : failed )
+  {
+    request.callback( AgentMessage{}, error );
+  }
+}
+
+AgentPool::AgentPool( unsigned connections, const std::string& socketName )
+{
+  for( unsigned i = 0; i < std::max( connections, 1u ); ++i )
+  {
+    agents.push_back( std::make_unique<AsyncAgentComm>( socketName ) );
+  }
+}
+
+void AgentPool::setTimeout( std::chrono::milliseconds timeout )
+{
+  for( auto& agent : agents )
+  {
+    agent->setTimeout( timeout );
+  }
+}
+
+std::vector<AgentComm::Identity> AgentPool::requestIdentities()
+{
+  auto identities = agents.front()->requestIdentities();
+  run();
+  return identities.get();
+}
+
+//! the requests are dealt out to the connections in turn, a few requests don't queue on
+//! one connection and each connection reads its responses while it still sends
+std::vector<Data> AgentPool::requestSignatures( DataView pubkey, const std::vector<Data>& data )
+{
+  std::vector<Data> result( data.size() );
+  std::exception_ptr firstError;
+  for( Size i = 0; i < data.size(); ++i )
+  {
+    const auto done = [ &result, &firstError, i ]( Data signature, std::exception_ptr error ) {
+      if( error && !firstError )
+        firstError = error;
+      result[ i ] = std::move( signature );
+    };
+    agents[ i % agents.size() ]->requestSignature( pubkey, data[ i ], done );
+  }
+  run();
+
+  if( firstError )
+  {
+    std::rethrow_exception( firstError );
+  }
+  return result;
+}
+
+//! polls all connections until every request is finished
+void AgentPool::run()
+{
+  std::vector<pollfd> fds;
+  std::vector<AsyncAgentComm*> busy;
+  for( ;; )
+  {
+    fds.clear();
+    busy.clear();
+    int timeout = -1;
+    for( auto& agent : agents )
+    {
+      if( agent->busy() )
+      {
+        fds.push_back( pollfd{ agent->fd(), agent->events(), 0 } );
+        busy.push_back( agent.get() );
+        const int agentTimeout = agent->pollTimeout();
+        if( agentTimeout >= 0 && ( timeout < 0 || agentTimeout < timeout ) )
+          timeout = agentTimeout;
+      }
+    }
+    if( busy.empty() )
+      return;
+
+    if( poll( fds.data(), fds.size(), timeout ) < 0 )
+    {
+      if( errno == EINTR )
+        continue;
+      throw std::runtime_error{ "poll failed" };
+    }
+
+    for( Size i = 0; i < busy.size(); ++i )
+    {
+      busy[ i ]->handleEvents( fds[ i ].revents );
+    }
+  }
 }
 
 } // namespace SshCrypt
@@ -3,7 +3,14 @@
 
 #include "AgentMessage.h"
 
+#include <chrono>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <future>
+#include <memory>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 namespace SshCrypt
@@ -11,20 +18,183 @@ namespace SshCrypt
 class AgentComm
 {
 public:
+  using Clock = std::chrono::steady_clock;
+
+  //! the blobs point into the identities answer, which all identities of one list share
   struct Identity
   {
-    Data pubkey;
-    Data comment;
+    DataView pubkey;
+    DataView comment;
+    std::shared_ptr<const AgentMessage> response;
   };
 
   AgentComm( std::string socketName = std::string{} );
   ~AgentComm();
+  AgentComm( const AgentComm& ) = delete;
+  AgentComm& operator=( const AgentComm& ) = delete;
+
+  //! every send and receive fails with "agent timed out" after \a timeout, 0 waits forever,
+  //! the connection is unusable after a timeout
+  void setTimeout( std::chrono::milliseconds theTimeout ) { timeout = theTimeout; }
+
   AgentMessage sendReceive( const AgentMessage& request );
+  // the agent answers the requests of one connection in order, so several requests
+  // may be sent before the responses are read
+  void sendRequest( const AgentMessage& request );
+  AgentMessage receiveResponse();
+  int fd() const { return sock; }
 
   std::vector<Identity> requestIdentities();
-  Data requestSignature( const Data& pubkey, const Data& data );
+  Data requestSignature( DataView pubkey, DataView data );
+  //! one signature for every entry of \a data, with up to AgentComm::window requests in
+  //! flight
+  std::vector<Data> requestSignatures( DataView pubkey, const std::vector<Data>& data );
+  //! \a fingerprint is set to the key, that signed, if sshcrypt-agent tells it
+  Data requestDerivedKey( const std::string& id,
+                          const Data& salt,
+                          std::string* fingerprint = nullptr );
+
+  static AgentMessage signRequest( DataView pubkey, DataView data );
+  static Data signature( const AgentMessage& response );
+  static std::vector<Identity> identities( AgentMessage response );
+  //! connected socket, throws if the agent is not there
+  static int connectSocket( std::string socketName );
+
+  //! the requests requestSignatures() sends ahead of the responses
+  static constexpr Size window = 16;
+  static constexpr Size maxResponseSize = 256 * 1024;
 
 private:
   int sock = -1;
+  std::chrono::milliseconds timeout{ 0 };
+
+  void waitFor( short events, Clock::time_point deadline );
+};
+
+/*! \class IdentityTable
+ *
+ * the identities of an agent, indexed by fingerprint (base64 of the sha256 of the public
+ * key, the id sshcrypt uses), comment and key type. Every key is hashed once, a table
+ * built from an unchanged answer takes the fingerprints of the previous one.
+ */
+class IdentityTable
+{
+public:
+  struct Entry
+  {
+    AgentComm::Identity identity;
+    std::string fingerprint;
+    std::string keyType; // e.g. ssh-ed25519
+  };
+
+  IdentityTable() = default;
+  explicit IdentityTable( std::vector<AgentComm::Identity> identities,
+                          const IdentityTable* previous = nullptr );
+
+  const std::vector<Entry>& entries() const { return table; }
+  bool empty() const { return table.empty(); }
+
+  //! the entry for fingerprint \a id, the first one without an id, nullptr if not there
+  const Entry* find( const char* id ) const;
+  //! like find(), but throws if it is not there
+  const Entry& get( const char* id ) const;
+  std::vector<const Entry*> byComment( const std::string& comment ) const;
+  std::vector<const Entry*> byKeyType( const std::string& keyType ) const;
+
+private:
+  std::vector<Entry> table;
+  std::unordered_map<std::string, Size> fingerprints;
+  std::unordered_multimap<std::string, Size> comments;
+  std::unordered_multimap<std::string, Size> keyTypes;
+
+  std::vector<const Entry*> entries( const std::unordered_multimap<std::string, Size>& index,
+                                     const std::string& key ) const;
+};
+
+/*! \class AsyncAgentComm
+ *
+ * non-blocking connection to an agent for an event loop. The owner polls fd() for
+ * events() and calls handleEvents() with the result, also after a poll timeout of
+ * pollTimeout(), so deadlines expire. The callbacks run inside handleEvents(), they may
+ * send new requests. A request, that misses its deadline, fails together with the
+ * others in flight, because the late answer can't be told apart, the next request
+ * connects again.
+ */
+class AsyncAgentComm
+{
+public:
+  using Clock = AgentComm::Clock;
+  //! \a error is set if the request failed, \a response is empty then
+  using Callback = std::function<void( AgentMessage response, std::exception_ptr error )>;
+  using IdentitiesCallback
+      = std::function<void( std::vector<AgentComm::Identity>, std::exception_ptr )>;
+  using SignatureCallback = std::function<void( Data, std::exception_ptr )>;
+
+  explicit AsyncAgentComm( std::string theSocketName = std::string{} );
+  ~AsyncAgentComm();
+  AsyncAgentComm( const AsyncAgentComm& ) = delete;
+  AsyncAgentComm& operator=( const AsyncAgentComm& ) = delete;
+
+  //! deadline of the requests sent from now on, 0 waits forever
+  void setTimeout( std::chrono::milliseconds theTimeout ) { timeout = theTimeout; }
+
+  void request( const AgentMessage& message, Callback callback );
+  std::future<AgentMessage> request( const AgentMessage& message );
+
+  void requestIdentities( IdentitiesCallback callback );
+  std::future<std::vector<AgentComm::Identity>> requestIdentities();
+  void requestSignature( DataView pubkey, DataView data, SignatureCallback callback );
+  std::future<Data> requestSignature( DataView pubkey, DataView data );
+
+  //! -1 while not connected
+  int fd() const { return sock; }
+  //! POLLIN while requests are in flight, POLLOUT while there is unsent data
+  short events() const;
+  //! milliseconds until the next deadline, -1 without one
+  int pollTimeout() const;
+  //! \a revents as returned by poll(), 0 if it timed out
+  void handleEvents( short revents );
+  bool busy() const { return !pending.empty(); }
+  //! polls until every request is finished, for callers without an event loop
+  void run();
+
+private:
+  struct Pending
+  {
+    Clock::time_point deadline;
+    Callback callback;
+  };
+
+  const std::string socketName;
+  int sock = -1;
+  std::chrono::milliseconds timeout{ 0 };
+  Data output;
+  Size outputPos = 0;
+  MessageReader input{ AgentComm::maxResponseSize };
+  std::deque<Pending> pending;
+
+  void flushOutput();
+  void readInput();
+  void fail( const std::exception_ptr& error );
+};
+
+//! several connections to one agent, requests are spread over them and pipelined on each,
+//! so an agent that signs concurrently answers many requests in about one round trip
+class AgentPool
+{
+public:
+  explicit AgentPool( unsigned connections = defaultConnections,
+                      const std::string& socketName = std::string{} );
+
+  static constexpr unsigned defaultConnections = 4;
+
+  void setTimeout( std::chrono::milliseconds timeout );
+  std::vector<AgentComm::Identity> requestIdentities();
+  std::vector<Data> requestSignatures( DataView pubkey, const std::vector<Data>& data );
+
+private:
+  std::vector<std::unique_ptr<AsyncAgentComm>> agents;
+
+  void run();
 };
 } // namespace SshCrypt
@@ -4,20 +4,26 @@
 
 #include "AgentMessage.h"
 
+#include <cstring>
 #include <stdexcept>
 
 namespace SshCrypt
 {
 Data Decoder::int2net( Size value ) // static
 {
-  Data data;
-  data.push_back( static_cast<Byte>( ( value >> 24 ) & 0xff ) );
-  data.push_back( static_cast<Byte>( ( value >> 16 ) & 0xff ) );
-  data.push_back( static_cast<Byte>( ( value >> 8 ) & 0xff ) );
-  data.push_back( static_cast<Byte>( value & 0xff ) );
+  Data data( 4 );
+  int2net( value, data.data() );
   return data;
 }
 
+void Decoder::int2net( Size value, Byte* buffer ) // static
+{
+  buffer[ 0 ] = static_cast<Byte>( ( value >> 24 ) & 0xff );
+  buffer[ 1 ] = static_cast<Byte>( ( value >> 16 ) & 0xff );
+  buffer[ 2 ] = static_cast<Byte>( ( value >> 8 ) & 0xff );
+  buffer[ 3 ] = static_cast<Byte>( value & 0xff );
+}
+
 Size Decoder::net2int( const Byte* buffer ) // static
 {
   Size value;
@@ -37,17 +43,15 @@ Size Decoder::getInt()
   return value;
 }
 
-//! return the next blob as data
-Data Decoder::getBlobData()
+DataView Decoder::getBlob()
 {
   Size length = getInt();
   if( length > bytesLeft() )
     throw std::runtime_error{ "truncated message: blob size greater than blob" };
 
   const Byte* b = data + pos;
-  const Byte* e = data + pos + length;
   pos += length;
-  return Data{ b, e };
+  return DataView{ b, length };
 }
 
 //! return the next blob as a new decoder
@@ -80,6 +84,14 @@ AgentMessage::AgentMessage( Byte type, Size reserveBytes )
   data[ 4 ] = type;
   adjustMessageSize();
 }
+
+AgentMessage AgentMessage::fromData( Data data ) // static
+{
+  AgentMessage message;
+  message.data = std::move( data );
+  return message;
+}
+
 Byte AgentMessage::type() const
 {
   if( data.size() >= 5 )
@@ -90,38 +102,77 @@ Byte AgentMessage::type() const
 //! must be called after last addInt() or addBlob()
 void AgentMessage::adjustMessageSize()
 {
-  Data sizeData = Decoder::int2net( data.size() - 4 );
-  data[ 0 ] = sizeData[ 0 ];
-  data[ 1 ] = sizeData[ 1 ];
-  data[ 2 ] = sizeData[ 2 ];
-  data[ 3 ] = sizeData[ 3 ];
+  Decoder::int2net( data.size() - 4, data.data() );
 }
 
+// the fields are written in place, a message built with the right reserveBytes
+// allocates once
+
 void AgentMessage::addInt( Size value )
 {
-  append( Decoder::int2net( value ) );
+  const Size pos = data.size();
+  data.resize( pos + 4 );
+  Decoder::int2net( value, data.data() + pos );
 }
 
-void AgentMessage::addBlob( const Data& blob )
+void AgentMessage::addBlob( DataView blob )
 {
-  append( Decoder::int2net( blob.size() ) );
-  append( blob );
+  const Size pos = data.size();
+  data.resize( pos + 4 + blob.size() );
+  Decoder::int2net( blob.size(), data.data() + pos );
+  if( !blob.empty() )
+    memcpy( data.data() + pos + 4, blob.data(), blob.size() );
 }
 
-//! append bytes for new messages
-void AgentMessage::append( const Data& bytes )
+//! append bytes received from socket
+void AgentMessage::append( const Byte* values, int size )
 {
-  data.insert( std::end( data ), std::begin( bytes ), std::end( bytes ) );
+  data.insert( data.end(), values, values + size );
 }
 
-//! append bytes received from socket
-void AgentMessage::append( const Byte* values, int size )
+Size MessageReader::prepare( Size size )
 {
-  data.reserve( static_cast<Size>( size ) );
-  while( size-- > 0 )
+  if( begin == end )
   {
-    data.push_back( *values++ );
+    begin = end = 0;
   }
+  if( end - begin >= 4 )
+  {
+    const Size messageSize = 4 + Decoder::net2int( buffer.data() + begin );
+    if( messageSize <= maxSize + 4 && begin + messageSize > end + size )
+      size = begin + messageSize - end;
+  }
+  if( buffer.size() - end < size && begin > 0 )
+  {
+    // move the partial message to the front instead of growing
+    memmove( buffer.data(), buffer.data() + begin, end - begin );
+    end -= begin;
+    begin = 0;
+  }
+  if( buffer.size() - end < size )
+  {
+    buffer.resize( end + size );
+  }
+  return buffer.size() - end;
+}
+
+bool MessageReader::next( AgentMessage& message )
+{
+  if( end - begin < 4 )
+    return false;
+
+  const Size size = Decoder::net2int( buffer.data() + begin );
+  if( size == 0 || size > maxSize )
+  {
+    throw std::runtime_error{ "bad message size" };
+  }
+  if( end - begin < 4 + size )
+    return false;
+
+  const Byte* first = buffer.data() + begin;
+  message = AgentMessage::fromData( Data( first, first + 4 + size ) );
+  begin += 4 + size;
+  return true;
 }
 
 } /* namespace SshCrypt */
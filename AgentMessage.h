@@ -11,6 +11,8 @@ class Decoder
 public:
   static Size net2int( const Byte* buffer );
   static Data int2net( Size value );
+  //! writes the 4 bytes of \a value to \a buffer
+  static void int2net( Size value, Byte* buffer );
 
   Decoder() = default;
   Decoder( const Decoder& ) = default;
@@ -22,7 +24,9 @@ public:
   Decoder( const Data& theData ) : data{ theData.data() }, size{ theData.size() } {}
   Size bytesLeft() const { return size - pos; }
   Size getInt();
-  Data getBlobData();
+  //! the next blob, it points into the message
+  DataView getBlob();
+  Data getBlobData() { return getBlob().toData(); }
   Decoder getDataDecoder();
 
 private:
@@ -36,6 +40,8 @@ class AgentMessage
 public:
   AgentMessage() = default;
   AgentMessage( Byte type, Size reserveBytes = 0 );
+  //! takes a complete received message, including its size
+  static AgentMessage fromData( Data data );
 
   Byte type() const;
   const Data& getData() const { return data; }
@@ -47,12 +53,41 @@ public:
 
   // building
   void addInt( Size );
-  void addBlob( const Data& );
+  void addBlob( DataView );
+  void addBlob( const Byte* blob, Size size ) { addBlob( DataView{ blob, size } ); }
   void adjustMessageSize();
 
 private:
   Data data;
-  void append( const Data& );
+};
+
+/*! \class MessageReader
+ *
+ * splits a byte stream, e.g. from a non-blocking socket, into messages. The bytes are
+ * received directly into its buffer, which is reused for the next messages.
+ */
+class MessageReader
+{
+public:
+  explicit MessageReader( Size theMaxSize ) : maxSize{ theMaxSize } {}
+
+  //! makes room for \a size bytes, or for the rest of the current message if that is
+  //! larger, returns the room at tail()
+  Size prepare( Size size );
+  Byte* tail() { return buffer.data() + end; }
+  //! \a size bytes were written to tail()
+  void commit( Size size ) { end += size; }
+
+  //! the next complete message, false if there is none yet, throws if the size is bad
+  bool next( AgentMessage& message );
+  bool empty() const { return begin == end; }
+  void clear() { begin = end = 0; }
+
+private:
+  Size maxSize;
+  Data buffer;
+  Size begin = 0;
+  Size end = 0;
 };
 
 } /* namespace SshCrypt */
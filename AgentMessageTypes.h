@@ -2,8 +2,8 @@
 // see https://datatracker.ietf.org/doc/html/draft-miller-ssh-agent
 #pragma once
 
-// #define SSH_AGENT_FAILURE 5
-// #define SSH_AGENT_SUCCESS 6
+#define SSH_AGENT_FAILURE 5
+#define SSH_AGENT_SUCCESS 6
 #define SSH_AGENTC_REQUEST_IDENTITIES 11
 #define SSH_AGENT_IDENTITIES_ANSWER 12
 #define SSH_AGENTC_SIGN_REQUEST 13
@@ -17,8 +17,13 @@
 // #define SSH_AGENTC_LOCK 22
 // #define SSH_AGENTC_UNLOCK 23
 // #define SSH_AGENTC_ADD_SMARTCARD_KEY_CONSTRAINED 26
-// #define SSH_AGENTC_EXTENSION 27
-// #define SSH_AGENT_EXTENSION_FAILURE 28
+#define SSH_AGENTC_EXTENSION 27
+#define SSH_AGENT_EXTENSION_FAILURE 28
 
 #define SSH_AGENT_RSA_SHA2_256 2
 #define SSH_AGENT_RSA_SHA2_512 4
+
+// extension served by sshcrypt-agent: string name, string identity, string salt,
+// answered by SSH_AGENT_SUCCESS with the session key and the fingerprint of the key, that
+// signed, as strings
+#define SSHCRYPT_EXTENSION_DERIVE_KEY "derive-key@sshcrypt"
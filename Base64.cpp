@@ -0,0 +1,540 @@
+// SPDX-License-Identifier: MIT
+
+#include "Base64.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+#if defined( __x86_64__ ) || defined( __i386__ )
+#include <immintrin.h>
+#define SSHCRYPT_BASE64_X86
+#endif
+
+/* Base 64 from wikipedia:
+ *
+ * Use A-Z, a-z, 0-9, '+' and '/' as digits, fill with '='.
+ *
+ * |    Byte 1     |    Byte 2     |    Byte 3     |
+ * |7|6|5|4|3|2|1|0|7|6|5|4|3|2|1|0|7|6|5|4|3|2|1|0|
+ *
+ * |5|4|3|2|1|0|5|4|3|2|1|0|5|4|3|2|1|0|5|4|3|2|1|0|
+ * |  Char 1   |  Char 2   |  Char 3   |  Char 3   |
+ *
+ * The vector kernels follow Wojciech Muła's pshufb/multiply-add approach: bytes are
+ * shuffled into 32 bit lanes, split into 6 bit digits with multiplies and translated
+ * to ascii with range offsets, decoding runs the same steps backwards.
+ */
+
+namespace SshCrypt
+{
+namespace
+{
+const char base64digit[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+                           "abcdefghijklmnopqrstuvwxyz"
+                           "0123456789+/";
+static_assert( sizeof base64digit == 65, "64 base64 digits" );
+
+// digit value, SK for characters that are skipped, XX for illegal ones
+constexpr Byte XX = 64;
+constexpr Byte SK = 65;
+const Byte asciiTable[ 256 ]
+    = { XX, XX, XX, XX, XX, XX, XX, XX, XX, SK, SK, SK, SK, SK, XX, XX,   // 0x00-0x0f
+        XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,   // 0x10-0x1f
+        SK, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, 62, XX, XX, XX, 63,   // 0x20-0x2f
+        52, 53, 54, 55, 56, 57, 58, 59, 60, 61, XX, XX, XX, SK, XX, XX,   // 0x30-0x3f
+        XX, 0,  1,  2,  3,  4,  5,  6,  7,  8,  9,  10, 11, 12, 13, 14,   // 0x40-0x4f
+        15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, XX, XX, XX, XX, XX,   // 0x50-0x5f
+        XX, 26, 27, 28, 29, 30, 31, 32, 33, 34, 35, 36, 37, 38, 39, 40,   // 0x60-0x6f
+        41, 42, 43, 44, 45, 46, 47, 48, 49, 50, 51, XX, XX, XX, XX, XX,   // 0x70-0x7f
+        XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,   // 0x80-0x8f
+        XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,   // 0x90-0x9f
+        XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,   // 0xa0-0xaf
+        XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,   // 0xb0-0xbf
+        XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,   // 0xc0-0xcf
+        XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,   // 0xd0-0xdf
+        XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,   // 0xe0-0xef
+        XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX }; // 0xf0-0xff
+
+void encodeTriple( const Byte* in, char* out )
+{
+  out[ 0 ] = base64digit[ in[ 0 ] >> 2 ];
+  out[ 1 ] = base64digit[ ( ( in[ 0 ] & 0x03u ) << 4 ) | ( in[ 1 ] >> 4 ) ];
+  out[ 2 ] = base64digit[ ( ( in[ 1 ] & 0x0fu ) << 2 ) | ( in[ 2 ] >> 6 ) ];
+  out[ 3 ] = base64digit[ in[ 2 ] & 0x3fu ];
+}
+
+#if defined( SSHCRYPT_BASE64_X86 )
+
+// 12 bytes in the low bytes of every 128 bit lane to 16 digit values
+__attribute__( ( target( "ssse3" ) ) ) __m128i splitSsse3( __m128i in )
+{
+  in = _mm_shuffle_epi8( in,
+                         _mm_set_epi8( 10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1 ) );
+  const __m128i t0 = _mm_and_si128( in, _mm_set1_epi32( 0x0fc0fc00 ) );
+  const __m128i t1 = _mm_mulhi_epu16( t0, _mm_set1_epi32( 0x04000040 ) );
+  const __m128i t2 = _mm_and_si128( in, _mm_set1_epi32( 0x003f03f0 ) );
+  const __m128i t3 = _mm_mullo_epi16( t2, _mm_set1_epi32( 0x01000010 ) );
+  return _mm_or_si128( t1, t3 );
+}
+
+__attribute__( ( target( "ssse3" ) ) ) __m128i toAsciiSsse3( __m128i values )
+{
+  // 0..25 -> 13, 26..51 -> 0, 52..61 -> 1..10, 62 -> 11, 63 -> 12, then add the offset
+  const __m128i offsets = _mm_setr_epi8( 'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                                         '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                                         '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0 );
+  __m128i index = _mm_subs_epu8( values, _mm_set1_epi8( 51 ) );
+  const __m128i less = _mm_cmpgt_epi8( _mm_set1_epi8( 26 ), values );
+  index = _mm_or_si128( index, _mm_and_si128( less, _mm_set1_epi8( 13 ) ) );
+  return _mm_add_epi8( _mm_shuffle_epi8( offsets, index ), values );
+}
+
+//! returns the number of bytes consumed, a multiple of 12
+__attribute__( ( target( "ssse3" ) ) ) Size encodeSsse3( const Byte* in, Size size, char* out )
+{
+  Size done = 0;
+  for( ; size - done >= 16; done += 12, out += 16 )
+  {
+    const __m128i block = _mm_loadu_si128( reinterpret_cast<const __m128i*>( in + done ) );
+    _mm_storeu_si128( reinterpret_cast<__m128i*>( out ), toAsciiSsse3( splitSsse3( block ) ) );
+  }
+  return done;
+}
+
+__attribute__( ( target( "avx2" ) ) ) Size encodeAvx2( const Byte* in, Size size, char* out )
+{
+  const __m256i offsets = _mm256_setr_epi8(
+      'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+      '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0, 'a' - 26, '0' - 52, '0' - 52, '0' - 52,
+      '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63,
+      'A', 0, 0 );
+  const __m256i shuffle = _mm256_set_epi8( 10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1,
+                                           10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1 );
+  Size done = 0;
+  for( ; size - done >= 28; done += 24, out += 32 )
+  {
+    const __m128i low = _mm_loadu_si128( reinterpret_cast<const __m128i*>( in + done ) );
+    const __m128i high = _mm_loadu_si128( reinterpret_cast<const __m128i*>( in + done + 12 ) );
+    __m256i block = _mm256_inserti128_si256( _mm256_castsi128_si256( low ), high, 1 );
+
+    block = _mm256_shuffle_epi8( block, shuffle );
+    const __m256i t0 = _mm256_and_si256( block, _mm256_set1_epi32( 0x0fc0fc00 ) );
+    const __m256i t1 = _mm256_mulhi_epu16( t0, _mm256_set1_epi32( 0x04000040 ) );
+    const __m256i t2 = _mm256_and_si256( block, _mm256_set1_epi32( 0x003f03f0 ) );
+    const __m256i t3 = _mm256_mullo_epi16( t2, _mm256_set1_epi32( 0x01000010 ) );
+    const __m256i values = _mm256_or_si256( t1, t3 );
+
+    __m256i index = _mm256_subs_epu8( values, _mm256_set1_epi8( 51 ) );
+    const __m256i less = _mm256_cmpgt_epi8( _mm256_set1_epi8( 26 ), values );
+    index = _mm256_or_si256( index, _mm256_and_si256( less, _mm256_set1_epi8( 13 ) ) );
+    const __m256i ascii = _mm256_add_epi8( _mm256_shuffle_epi8( offsets, index ), values );
+    _mm256_storeu_si256( reinterpret_cast<__m256i*>( out ), ascii );
+  }
+  return done;
+}
+
+// lanes of \a in between \a first and \a last, bytes above 0x7f are negative and never match
+__attribute__( ( target( "ssse3" ) ) ) __m128i rangeSsse3( __m128i in, char first, char last )
+{
+  return _mm_and_si128( _mm_cmpgt_epi8( in, _mm_set1_epi8( static_cast<char>( first - 1 ) ) ),
+                        _mm_cmpgt_epi8( _mm_set1_epi8( static_cast<char>( last + 1 ) ), in ) );
+}
+
+__attribute__( ( target( "avx2" ) ) ) __m256i rangeAvx2( __m256i in, char first, char last )
+{
+  return _mm256_and_si256(
+      _mm256_cmpgt_epi8( in, _mm256_set1_epi8( static_cast<char>( first - 1 ) ) ),
+      _mm256_cmpgt_epi8( _mm256_set1_epi8( static_cast<char>( last + 1 ) ), in ) );
+}
+
+// digit values for A-Z, a-z, 0-9, + and /, mask of the lanes holding one of them
+__attribute__( ( target( "ssse3" ) ) ) __m128i fromAsciiSsse3( __m128i in, int& validMask )
+{
+  const __m128i upper = rangeSsse3( in, 'A', 'Z' );
+  const __m128i lower = rangeSsse3( in, 'a', 'z' );
+  const __m128i digit = rangeSsse3( in, '0', '9' );
+  const __m128i plus = _mm_cmpeq_epi8( in, _mm_set1_epi8( '+' ) );
+  const __m128i slash = _mm_cmpeq_epi8( in, _mm_set1_epi8( '/' ) );
+
+  const __m128i valid = _mm_or_si128( _mm_or_si128( upper, lower ),
+                                      _mm_or_si128( digit, _mm_or_si128( plus, slash ) ) );
+  validMask = _mm_movemask_epi8( valid );
+
+  __m128i shift = _mm_and_si128( upper, _mm_set1_epi8( -'A' ) );
+  shift = _mm_or_si128( shift, _mm_and_si128( lower, _mm_set1_epi8( 26 - 'a' ) ) );
+  shift = _mm_or_si128( shift, _mm_and_si128( digit, _mm_set1_epi8( 52 - '0' ) ) );
+  shift = _mm_or_si128( shift, _mm_and_si128( plus, _mm_set1_epi8( 62 - '+' ) ) );
+  shift = _mm_or_si128( shift, _mm_and_si128( slash, _mm_set1_epi8( 63 - '/' ) ) );
+  return _mm_add_epi8( in, shift );
+}
+
+// 16 digit values to 12 bytes in the low bytes of the lane
+__attribute__( ( target( "ssse3" ) ) ) __m128i packSsse3( __m128i values )
+{
+  const __m128i pairs = _mm_maddubs_epi16( values, _mm_set1_epi32( 0x01400140 ) );
+  const __m128i words = _mm_madd_epi16( pairs, _mm_set1_epi32( 0x00011000 ) );
+  return _mm_shuffle_epi8(
+      words, _mm_setr_epi8( 2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1 ) );
+}
+
+//! returns the number of characters consumed, stops at the first block with a character
+//! that is no digit and sets \a validPrefix to the digits in front of it
+__attribute__( ( target( "ssse3" ) ) ) Size decodeSsse3( const char* in,
+                                                          Size size,
+                                                          Byte* out,
+                                                          Size& validPrefix )
+{
+  Size done = 0;
+  for( ; size - done >= 16; done += 16, out += 12 )
+  {
+    int validMask;
+    const __m128i values = fromAsciiSsse3(
+        _mm_loadu_si128( reinterpret_cast<const __m128i*>( in + done ) ), validMask );
+    if( validMask != 0xffff )
+    {
+      validPrefix = static_cast<Size>( __builtin_ctz( ~static_cast<unsigned>( validMask ) ) );
+      break;
+    }
+    _mm_storeu_si128( reinterpret_cast<__m128i*>( out ), packSsse3( values ) );
+  }
+  return done;
+}
+
+__attribute__( ( target( "avx2" ) ) ) Size decodeAvx2( const char* in,
+                                                        Size size,
+                                                        Byte* out,
+                                                        Size& validPrefix )
+{
+  const __m256i pack
+      = _mm256_setr_epi8( 2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1, //
+                          2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1 );
+  Size done = 0;
+  for( ; size - done >= 32; done += 32, out += 24 )
+  {
+    const __m256i block = _mm256_loadu_si256( reinterpret_cast<const __m256i*>( in + done ) );
+    const __m256i upper = rangeAvx2( block, 'A', 'Z' );
+    const __m256i lower = rangeAvx2( block, 'a', 'z' );
+    const __m256i digit = rangeAvx2( block, '0', '9' );
+    const __m256i plus = _mm256_cmpeq_epi8( block, _mm256_set1_epi8( '+' ) );
+    const __m256i slash = _mm256_cmpeq_epi8( block, _mm256_set1_epi8( '/' ) );
+
+    const __m256i letter = _mm256_or_si256( upper, lower );
+    const __m256i other = _mm256_or_si256( digit, _mm256_or_si256( plus, slash ) );
+    const __m256i valid = _mm256_or_si256( letter, other );
+    const unsigned validMask = static_cast<unsigned>( _mm256_movemask_epi8( valid ) );
+    if( validMask != 0xffffffffu )
+    {
+      validPrefix = static_cast<Size>( __builtin_ctz( ~validMask ) );
+      break;
+    }
+
+    __m256i shift = _mm256_and_si256( upper, _mm256_set1_epi8( -'A' ) );
+    shift = _mm256_or_si256( shift, _mm256_and_si256( lower, _mm256_set1_epi8( 26 - 'a' ) ) );
+    shift = _mm256_or_si256( shift, _mm256_and_si256( digit, _mm256_set1_epi8( 52 - '0' ) ) );
+    shift = _mm256_or_si256( shift, _mm256_and_si256( plus, _mm256_set1_epi8( 62 - '+' ) ) );
+    shift = _mm256_or_si256( shift, _mm256_and_si256( slash, _mm256_set1_epi8( 63 - '/' ) ) );
+    const __m256i values = _mm256_add_epi8( block, shift );
+
+    const __m256i pairs = _mm256_maddubs_epi16( values, _mm256_set1_epi32( 0x01400140 ) );
+    const __m256i words = _mm256_madd_epi16( pairs, _mm256_set1_epi32( 0x00011000 ) );
+    const __m256i bytes = _mm256_shuffle_epi8( words, pack );
+    _mm_storeu_si128( reinterpret_cast<__m128i*>( out ), _mm256_castsi256_si128( bytes ) );
+    _mm_storeu_si128( reinterpret_cast<__m128i*>( out + 12 ),
+                      _mm256_extracti128_si256( bytes, 1 ) );
+  }
+  return done;
+}
+
+#endif
+
+//! whole triples only, returns the number of bytes consumed
+Size encodeBlocks( Base64::Kernel kernel, const Byte* in, Size size, char* out )
+{
+  Size done = 0;
+#if defined( SSHCRYPT_BASE64_X86 )
+  if( kernel == Base64::Kernel::Avx2 )
+    done = encodeAvx2( in, size, out );
+  else if( kernel == Base64::Kernel::Ssse3 )
+    done = encodeSsse3( in, size, out );
+#else
+  (void)kernel;
+#endif
+  for( ; size - done >= 3; done += 3 )
+  {
+    encodeTriple( in + done, out + done / 3 * 4 );
+  }
+  return done;
+}
+
+Size decodeBlocks(
+    Base64::Kernel kernel, const char* in, Size size, Byte* out, Size& validPrefix )
+{
+  validPrefix = 0;
+#if defined( SSHCRYPT_BASE64_X86 )
+  if( kernel == Base64::Kernel::Avx2 )
+    return decodeAvx2( in, size, out, validPrefix );
+  if( kernel == Base64::Kernel::Ssse3 )
+    return decodeSsse3( in, size, out, validPrefix );
+#else
+  (void)kernel;
+  (void)in;
+  (void)size;
+  (void)out;
+#endif
+  return 0;
+}
+} // namespace
+
+Base64::Kernel Base64::bestKernel() // static
+{
+#if defined( SSHCRYPT_BASE64_X86 )
+  static const Kernel best = []() {
+    __builtin_cpu_init();
+    if( __builtin_cpu_supports( "avx2" ) )
+      return Kernel::Avx2;
+    if( __builtin_cpu_supports( "ssse3" ) )
+      return Kernel::Ssse3;
+    return Kernel::Scalar;
+  }();
+  return best;
+#else
+  return Kernel::Scalar;
+#endif
+}
+
+const char* Base64::kernelName( Kernel kernel ) // static
+{
+  switch( kernel )
+  {
+  case Kernel::Scalar: return "scalar";
+  case Kernel::Ssse3: return "ssse3";
+  case Kernel::Avx2: return "avx2";
+  }
+  return "unknown";
+}
+
+/*
+ * Ori Pad NoPad
+ * 0   0   0
+ * 1   4   2
+ * 2   4   3
+ * 3   4   4
+ * 4   8   6
+ * 5   8   8
+ */
+Size Base64::encodedSize( Size size, bool padding ) // static
+{
+  if( padding )
+  {
+    return ( size + 2 ) / 3 * 4;
+  }
+  switch( size % 3 )
+  {
+  case 1: return size / 3 * 4 + 2;
+  case 2: return size / 3 * 4 + 3;
+  }
+  return size / 3 * 4;
+}
+
+Size Base64::maxDecodedSize( Size size ) // static
+{
+  // the vector kernels store a few bytes behind the decoded ones
+  return size / 4 * 3 + 3 + 16;
+}
+
+Base64::Encoder::Encoder( Kernel theKernel ) : kernel{ theKernel } {}
+
+Size Base64::Encoder::update( const Byte* data, Size size, char* out )
+{
+  char* const begin = out;
+  if( pendingSize > 0 )
+  {
+    while( pendingSize < 3 && size > 0 )
+    {
+      pending[ pendingSize++ ] = *data++;
+      --size;
+    }
+    if( pendingSize < 3 )
+      return 0;
+
+    encodeTriple( pending, out );
+    out += 4;
+    pendingSize = 0;
+  }
+
+  const Size done = encodeBlocks( kernel, data, size, out );
+  out += done / 3 * 4;
+  for( ; done + pendingSize < size; ++pendingSize )
+  {
+    pending[ pendingSize ] = data[ done + pendingSize ];
+  }
+  return static_cast<Size>( out - begin );
+}
+
+Size Base64::Encoder::finish( char* out, bool padding )
+{
+  if( pendingSize == 0 )
+    return 0;
+
+  // without padding there is no room for all four characters
+  Byte last[ 3 ] = {};
+  std::copy( pending, pending + pendingSize, last );
+  char quad[ 4 ];
+  encodeTriple( last, quad );
+  const Size length = pendingSize + 1;
+  pendingSize = 0;
+  std::fill( quad + length, quad + 4, '=' );
+  std::copy( quad, quad + ( padding ? 4 : length ), out );
+  return padding ? 4 : length;
+}
+
+Base64::Decoder::Decoder( Kernel theKernel ) : kernel{ theKernel } {}
+
+Size Base64::Decoder::update( const char* text, Size size, Byte* out )
+{
+  Byte* const begin = out;
+  const char* const end = text + size;
+
+  const auto decodeChar = [ this, &out ]( char c ) {
+    const Byte value = asciiTable[ static_cast<Byte>( c ) ];
+    if( value == SK )
+      return;
+    if( value == XX )
+      throw std::invalid_argument{ "illegal character" };
+
+    accu = ( accu << 6 ) | value;
+    bits += 6;
+    if( bits >= 8 )
+    {
+      bits -= 8;
+      *out++ = static_cast<Byte>( accu >> bits );
+    }
+  };
+
+  while( text != end )
+  {
+    // the kernels decode groups of four digits, so only from a byte boundary on
+    Size scalarCount = 1;
+    if( bits == 0 )
+    {
+      Size validPrefix;
+      const Size done = decodeBlocks( kernel, text, static_cast<Size>( end - text ), out,
+                                      validPrefix );
+      text += done;
+      out += done / 4 * 3;
+      scalarCount = validPrefix + 1;
+    }
+
+    for( ; text != end && ( scalarCount > 0 || bits != 0 ); ++text )
+    {
+      decodeChar( *text );
+      if( scalarCount > 0 )
+        --scalarCount;
+    }
+  }
+  return static_cast<Size>( out - begin );
+}
+
+ArmorWriter::ArmorWriter( std::ostream& theSink ) : sink{ theSink }, input( inputSize )
+{
+  encoded.resize( Base64::encodedSize( inputSize ) );
+  lines.reserve( flushSize + inputSize * 2 );
+  setp( input.data(), input.data() + input.size() );
+}
+
+void ArmorWriter::finish()
+{
+  encodeInput();
+  char last[ 4 ];
+  wrap( last, encoder.finish( last ) );
+  if( column > 0 )
+  {
+    lines.push_back( '\n' );
+    column = 0;
+  }
+  flushLines();
+  if( !sink )
+  {
+    throw std::runtime_error{ "can't write base64 output" };
+  }
+}
+
+ArmorWriter::int_type ArmorWriter::overflow( int_type c )
+{
+  encodeInput();
+  if( !traits_type::eq_int_type( c, traits_type::eof() ) )
+  {
+    *pptr() = traits_type::to_char_type( c );
+    pbump( 1 );
+  }
+  return traits_type::not_eof( c );
+}
+
+int ArmorWriter::sync()
+{
+  encodeInput();
+  flushLines();
+  return sink ? 0 : -1;
+}
+
+void ArmorWriter::encodeInput()
+{
+  const Size size = static_cast<Size>( pptr() - pbase() );
+  const Size length
+      = encoder.update( reinterpret_cast<const Byte*>( pbase() ), size, &encoded[ 0 ] );
+  setp( input.data(), input.data() + input.size() );
+  wrap( encoded.data(), length );
+  if( lines.size() >= flushSize )
+  {
+    flushLines();
+  }
+}
+
+void ArmorWriter::wrap( const char* chars, Size size )
+{
+  while( size > 0 )
+  {
+    const Size piece = std::min( size, lineLength - column );
+    lines.append( chars, piece );
+    chars += piece;
+    size -= piece;
+    column += piece;
+    if( column == lineLength )
+    {
+      lines.push_back( '\n' );
+      column = 0;
+    }
+  }
+}
+
+void ArmorWriter::flushLines()
+{
+  sink.write( lines.data(), static_cast<std::streamsize>( lines.size() ) );
+  lines.clear();
+}
+
+ArmorReader::ArmorReader( std::streambuf* theSource ) :
+    source{ theSource }, text( chunkSize ), decoded( Base64::maxDecodedSize( chunkSize ) )
+{
+}
+
+ArmorReader::int_type ArmorReader::underflow()
+{
+  for( ;; )
+  {
+    const std::streamsize length
+        = source->sgetn( text.data(), static_cast<std::streamsize>( text.size() ) );
+    if( length <= 0 )
+      return traits_type::eof();
+
+    const Size size
+        = decoder.update( text.data(), static_cast<Size>( length ), decoded.data() );
+    if( size > 0 )
+    {
+      char* begin = reinterpret_cast<char*>( decoded.data() );
+      setg( begin, begin, begin + size );
+      return traits_type::to_int_type( *begin );
+    }
+  }
+}
+} // namespace SshCrypt
@@ -0,0 +1,122 @@
+// SPDX-License-Identifier: MIT
+
+#pragma once
+
+#include "Data.h"
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+namespace SshCrypt
+{
+/*! \class Base64
+ *
+ * base64 en- and decoding with vectorized kernels, the best one the cpu supports is
+ * chosen at runtime. Encoder and Decoder keep their state between calls, so the
+ * data may be passed in pieces of any size.
+ */
+class Base64
+{
+public:
+  Base64() = delete;
+
+  enum class Kernel
+  {
+    Scalar,
+    Ssse3,
+    Avx2
+  };
+
+  //! the fastest kernel this cpu supports
+  static Kernel bestKernel();
+  static const char* kernelName( Kernel );
+
+  static Size encodedSize( Size size, bool padding = true );
+  //! the buffer size \a Decoder::update needs for \a size characters
+  static Size maxDecodedSize( Size size );
+
+  class Encoder
+  {
+  public:
+    explicit Encoder( Kernel theKernel = bestKernel() );
+
+    //! writes the characters for \a size bytes to \a out, returns their number
+    Size update( const Byte* data, Size size, char* out );
+    //! writes the last, up to four characters
+    Size finish( char* out, bool padding = true );
+
+  private:
+    Kernel kernel;
+    Byte pending[ 3 ] = {};
+    Size pendingSize = 0;
+  };
+
+  //! skips whitespace and '=' like it always did, throws std::invalid_argument otherwise
+  class Decoder
+  {
+  public:
+    explicit Decoder( Kernel theKernel = bestKernel() );
+
+    //! writes the decoded bytes to \a out, at least maxDecodedSize( size ) large
+    Size update( const char* text, Size size, Byte* out );
+
+  private:
+    Kernel kernel;
+    int bits = 0;
+    unsigned int accu = 0;
+  };
+};
+
+//! stream buffer, that base64 encodes everything put into it to \a sink, wrapped after
+//! 72 characters, the lines are collected and written in large blocks
+class ArmorWriter : public std::streambuf
+{
+public:
+  static constexpr Size lineLength = 72;
+
+  explicit ArmorWriter( std::ostream& theSink );
+
+  //! encodes what is left, appends the padding and ends the last line
+  void finish();
+
+protected:
+  int_type overflow( int_type c ) override;
+  int sync() override;
+
+private:
+  // 54 bytes make a full line
+  static constexpr Size inputSize = 54 * 1024;
+  static constexpr Size flushSize = 1024 * 1024;
+
+  std::ostream& sink;
+  Base64::Encoder encoder;
+  std::vector<char> input;
+  std::string encoded;
+  std::string lines;
+  Size column = 0;
+
+  void encodeInput();
+  void wrap( const char* chars, Size size );
+  void flushLines();
+};
+
+//! stream buffer, that returns the decoded base64 text read from \a source,
+//! an illegal character throws std::invalid_argument
+class ArmorReader : public std::streambuf
+{
+public:
+  explicit ArmorReader( std::streambuf* theSource );
+
+protected:
+  int_type underflow() override;
+
+private:
+  static constexpr Size chunkSize = 64 * 1024;
+
+  std::streambuf* source;
+  Base64::Decoder decoder;
+  std::vector<char> text;
+  Data decoded;
+};
+} // namespace SshCrypt
@@ -0,0 +1,475 @@
+// SPDX-License-Identifier: MIT
+
+// benchsshcrypt measures the throughput of the building blocks and of the whole pipeline
+// and prints the results as json, so runs of different builds can be compared
+
+#include "AgentComm.h"
+#include "AgentMessage.h"
+#include "Base64.h"
+#include "Container.h"
+#include "Cryptor.h"
+#include "Hex.h"
+#include "MockAgent.h"
+#include "ShaHash.h"
+#include "SymCrypt.h"
+#include "ThreadPool.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <exception>
+#include <functional>
+#include <getopt.h>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace
+{
+using SshCrypt::Byte;
+using SshCrypt::Data;
+using SshCrypt::Size;
+using Clock = std::chrono::steady_clock;
+
+struct Settings
+{
+  Size maxSize = 1024 * 1024 * 1024;
+  double minTime = 0.2;                   // seconds per measurement
+  std::string filter;
+  bool realAgent = false;                 // SSH_AUTH_SOCK instead of the mock agent
+  std::chrono::milliseconds latency{ 0 }; // of the mock agent
+};
+
+struct Result
+{
+  std::string name;
+  Size size;
+  Size iterations;
+  double seconds;
+};
+
+class Bench
+{
+public:
+  explicit Bench( const Settings& theSettings ) : settings{ theSettings } {}
+
+  bool wanted( const std::string& name ) const
+  {
+    return settings.filter.empty() || name.find( settings.filter ) != std::string::npos;
+  }
+
+  //! false if the filter excludes every benchmark starting with \a prefix, to skip the setup
+  bool group( const std::string& prefix ) const
+  {
+    return wanted( prefix ) || settings.filter.compare( 0, prefix.size(), prefix ) == 0;
+  }
+
+  //! runs \a function until minTime is over, \a size is the number of bytes per call
+  void run( const std::string& name, Size size, const std::function<void()>& function )
+  {
+    if( !wanted( name ) )
+      return;
+
+    std::cerr << name << " " << size << std::endl;
+    Size iterations = 0;
+    const auto start = Clock::now();
+    double seconds = 0;
+    do
+    {
+      function();
+      ++iterations;
+      seconds = std::chrono::duration<double>( Clock::now() - start ).count();
+    } while( seconds < settings.minTime );
+    results.push_back( Result{ name, size, iterations, seconds } );
+  }
+
+  //! 64 bytes up to maxSize, every step 16 times larger
+  std::vector<Size> sizes( Size limit = ~Size{ 0 } ) const
+  {
+    std::vector<Size> result;
+    for( Size size = 64; size <= std::min( settings.maxSize, limit ); size *= 16 )
+    {
+      result.push_back( size );
+    }
+    return result;
+  }
+
+  void print( std::ostream& out ) const
+  {
+    out << "{\n  \"context\": {\n";
+    out << "    \"base64_kernel\": \""
+        << SshCrypt::Base64::kernelName( SshCrypt::Base64::bestKernel() ) << "\",\n";
+    out << "    \"hex_kernel\": \""
+        << SshCrypt::Hex::kernelName( SshCrypt::Hex::bestKernel() ) << "\",\n";
+    out << "    \"threads\": " << SshCrypt::ThreadPool::defaultThreads() << ",\n";
+#if defined( __OPTIMIZE__ )
+    out << "    \"optimized\": true,\n";
+#else
+    out << "    \"optimized\": false,\n";
+#endif
+    out << "    \"min_time\": " << settings.minTime << "\n  },\n";
+    out << "  \"benchmarks\": [";
+    bool first = true;
+    for( const auto& result : results )
+    {
+      const double perOp = result.seconds / static_cast<double>( result.iterations );
+      out << ( first ? "\n" : ",\n" );
+      out << "    { \"name\": \"" << result.name << "\", \"size\": " << result.size
+          << ", \"iterations\": " << result.iterations
+          << ", \"ns_per_op\": " << static_cast<Size>( perOp * 1e9 )
+          << ", \"mb_per_s\": " << static_cast<double>( result.size ) / perOp / 1e6 << " }";
+      first = false;
+    }
+    out << "\n  ]\n}" << std::endl;
+  }
+
+private:
+  const Settings& settings;
+  std::vector<Result> results;
+};
+
+//! random looking data without spending the time of makeRandom on a gigabyte
+Data makeData( Size size )
+{
+  static const Data block = SshCrypt::makeRandom( 1024 * 1024 );
+  Data data( size );
+  for( Size pos = 0; pos < size; pos += block.size() )
+  {
+    std::copy_n( block.begin(), std::min( block.size(), size - pos ), data.begin() + pos );
+  }
+  return data;
+}
+
+void benchData( Bench& bench )
+{
+  for( Size size : bench.sizes() )
+  {
+    if( !bench.wanted( "toBase64" ) && !bench.wanted( "fromBase64" ) )
+      break;
+    const Data data = makeData( size );
+    const std::string base64 = SshCrypt::toBase64( data );
+    bench.run( "toBase64", size, [ & ]() { SshCrypt::toBase64( data ); } );
+    bench.run( "fromBase64", size, [ & ]() { SshCrypt::fromBase64( base64 ); } );
+  }
+
+  // hex is used for fingerprints, larger sizes only take time
+  for( Size size : bench.sizes( 64 * 1024 * 1024 ) )
+  {
+    if( !bench.wanted( "toHex" ) && !bench.wanted( "fromHex" ) )
+      break;
+    const Data data = makeData( size );
+    const std::string hex = SshCrypt::toHex( data );
+    bench.run( "toHex", size, [ & ]() { SshCrypt::toHex( data ); } );
+    bench.run( "fromHex", size, [ & ]() { SshCrypt::fromHex( hex ); } );
+  }
+
+  // salts and nonces are what makeRandom is asked for
+  for( Size size : { Size{ 12 }, Size{ 32 }, Size{ 4096 } } )
+  {
+    if( !bench.wanted( "makeRandom" ) )
+      break;
+    bench.run( "makeRandom", size, [ & ]() { SshCrypt::makeRandom( size ); } );
+  }
+
+  // a key, a chunk and a segment, filled and freed like the buffers of a pipeline
+  for( Size size : { Size{ 32 }, Size{ 64 * 1024 }, Size{ 1024 * 1024 } } )
+  {
+    if( bench.wanted( "Data::allocate" ) )
+      bench.run( "Data::allocate", size, [ & ]() { Data( size, 1 ); } );
+    if( bench.wanted( "SecureData::allocate" ) )
+      bench.run( "SecureData::allocate", size, [ & ]() { SshCrypt::SecureData( size, 1 ); } );
+  }
+}
+
+void benchSymCrypt( Bench& bench )
+{
+  const Data key = SshCrypt::makeRandom( 32 );
+  for( auto method : { SshCrypt::SymCrypt::AES256CBC, SshCrypt::SymCrypt::AES256GCM,
+                       SshCrypt::SymCrypt::CHACHA20POLY1305 } )
+  {
+    const std::string name = SshCrypt::SymCrypt::methodName( method );
+    if( !bench.wanted( "SymCrypt::encrypt/" + name )
+        && !bench.wanted( "SymCrypt::decrypt/" + name ) )
+      continue;
+
+    const Data iv = SshCrypt::makeRandom( SshCrypt::SymCrypt::ivSize( method ) );
+    SshCrypt::SymCrypt symCrypt{ key, iv, method };
+    for( Size size : bench.sizes() )
+    {
+      const Data plain = makeData( size );
+      const Data encrypted = symCrypt.encrypt( plain );
+      bench.run( "SymCrypt::encrypt/" + name, size, [ & ]() { symCrypt.encrypt( plain ); } );
+      bench.run( "SymCrypt::decrypt/" + name, size,
+                 [ & ]() { symCrypt.decrypt( encrypted ); } );
+    }
+  }
+}
+
+void benchShaHash( Bench& bench )
+{
+  for( Size size : bench.sizes() )
+  {
+    if( !bench.wanted( "ShaHash::check" ) )
+      break;
+    const Data data = makeData( size );
+    bench.run( "ShaHash::check", size, [ & ]() { SshCrypt::ShaHash::check( data ); } );
+  }
+
+  // a file streaming past in 64 KiB pieces
+  SshCrypt::ShaHash hash;
+  for( Size size : bench.sizes() )
+  {
+    if( !bench.wanted( "ShaHash::update" ) || size < 64 * 1024 )
+      continue;
+    const Data data = makeData( size );
+    bench.run( "ShaHash::update", size, [ & ]() {
+      for( Size pos = 0; pos < size; pos += 64 * 1024 )
+      {
+        hash.update( SshCrypt::DataView{ data.data() + pos, 64 * 1024 } );
+      }
+      hash.final();
+    } );
+  }
+}
+
+void benchAgentMessage( Bench& bench )
+{
+  // a sign request like the one for the session key
+  const Data publicKey = SshCrypt::makeRandom( 51 );
+  const Data salt = SshCrypt::makeRandom( 32 );
+  const Data wire = SshCrypt::AgentComm::signRequest( publicKey, salt ).getData();
+
+  bench.run( "AgentMessage::build", wire.size(), [ & ]() {
+    SshCrypt::AgentComm::signRequest( publicKey, salt );
+  } );
+  SshCrypt::MessageReader reader{ SshCrypt::AgentComm::maxResponseSize };
+  bench.run( "AgentMessage::parse", wire.size(), [ & ]() {
+    reader.prepare( wire.size() );
+    std::copy( wire.begin(), wire.end(), reader.tail() );
+    reader.commit( wire.size() );
+    SshCrypt::AgentMessage message;
+    reader.next( message );
+    SshCrypt::Decoder decoder = message.decoder();
+    decoder.getBlob();
+    decoder.getBlob();
+    decoder.getInt();
+  } );
+}
+
+//! the file format with a fixed session key, the agent is left out
+void benchContainer( Bench& bench )
+{
+  const Data sessionKey = SshCrypt::makeRandom( 64 );
+  for( auto method : { SshCrypt::SymCrypt::AES256CBC, SshCrypt::SymCrypt::AES256GCM,
+                       SshCrypt::SymCrypt::CHACHA20POLY1305 } )
+  {
+    const std::string name = SshCrypt::SymCrypt::methodName( method );
+    if( !bench.wanted( "Container::encrypt/" + name )
+        && !bench.wanted( "Container::decrypt/" + name )
+        && !bench.wanted( "Container::decryptRange/" + name ) )
+      continue;
+
+    const auto header = SshCrypt::Container::makeHeader(
+        2, SshCrypt::Container::defaultSegmentSize, method );
+    for( Size size : bench.sizes() )
+    {
+      const std::string plain = SshCrypt::toString( makeData( size ) );
+      std::istringstream plainIn{ plain };
+      std::ostringstream encrypted;
+      SshCrypt::Container::encrypt( plainIn, encrypted, header, sessionKey );
+      const std::string cipherText = encrypted.str();
+
+      bench.run( "Container::encrypt/" + name, size, [ & ]() {
+        std::istringstream in{ plain };
+        std::ostringstream out;
+        SshCrypt::Container::encrypt( in, out, header, sessionKey );
+      } );
+      bench.run( "Container::decrypt/" + name, size, [ & ]() {
+        std::istringstream in{ cipherText };
+        std::ostringstream out;
+        const auto readHeader = SshCrypt::Container::readHeader( in );
+        SshCrypt::Container::decrypt( in, out, readHeader, sessionKey );
+      } );
+      // 64 KiB from the middle, the time doesn't grow with the size of the file
+      std::istringstream rangeIn{ cipherText };
+      bench.run( "Container::decryptRange/" + name, size, [ & ]() {
+        rangeIn.clear();
+        rangeIn.seekg( 0 );
+        std::ostringstream out;
+        const auto readHeader = SshCrypt::Container::readHeader( rangeIn );
+        SshCrypt::Container::decryptRange( rangeIn, out, readHeader, sessionKey, size / 2,
+                                           64 * 1024 );
+      } );
+    }
+  }
+  // log lines compress well, the cipher sees a fraction of them
+  using Compression = SshCrypt::Container::Compression;
+  for( auto compression : { Compression::None, Compression::Zlib } )
+  {
+    const std::string name = compression == Compression::None ? "text" : "text+zlib";
+    if( !bench.wanted( "Container::encrypt/" + name )
+        && !bench.wanted( "Container::decrypt/" + name ) )
+      continue;
+
+    const auto header = SshCrypt::Container::makeHeader(
+        2, SshCrypt::Container::defaultSegmentSize, SshCrypt::SymCrypt::AES256GCM,
+        compression );
+    for( Size size : bench.sizes() )
+    {
+      std::string plain;
+      plain.reserve( size + 100 );
+      for( Size line = 0; plain.size() < size; ++line )
+      {
+        plain += "2024-05-01T12:00:" + std::to_string( line % 60 ) + " worker["
+                 + std::to_string( line % 7 ) + "] request " + std::to_string( line )
+                 + " done\n";
+      }
+      plain.resize( size );
+      std::istringstream plainIn{ plain };
+      std::ostringstream encrypted;
+      SshCrypt::Container::encrypt( plainIn, encrypted, header, sessionKey );
+      const std::string cipherText = encrypted.str();
+
+      bench.run( "Container::encrypt/" + name, size, [ & ]() {
+        std::istringstream in{ plain };
+        std::ostringstream out;
+        SshCrypt::Container::encrypt( in, out, header, sessionKey );
+      } );
+      bench.run( "Container::decrypt/" + name, size, [ & ]() {
+        std::istringstream in{ cipherText };
+        std::ostringstream out;
+        const auto readHeader = SshCrypt::Container::readHeader( in );
+        SshCrypt::Container::decrypt( in, out, readHeader, sessionKey );
+      } );
+    }
+  }
+}
+
+//! everything sshcrypt does for a file, including the session key from the agent
+void benchCryptor( Bench& bench, const Settings& settings )
+{
+  if( !bench.group( "Cryptor::" ) )
+    return;
+
+  SshCrypt::MockAgent::Options mockOptions;
+  mockOptions.latency = settings.latency;
+  std::unique_ptr<SshCrypt::MockAgent> mock;
+  if( !settings.realAgent )
+  {
+    mock = std::make_unique<SshCrypt::MockAgent>( mockOptions );
+    mock->exportSocket();
+  }
+
+  // every call asks the agent
+  SshCrypt::Cryptor::setCacheTimeout( std::chrono::seconds{ 0 } );
+  for( Size size : bench.sizes( 64 * 1024 * 1024 ) )
+  {
+    const std::string plain = SshCrypt::toString( makeData( size ) );
+    std::istringstream plainIn{ plain };
+    std::ostringstream encrypted;
+    SshCrypt::Cryptor::encrypt( plainIn, encrypted );
+    const std::string cipherText = encrypted.str();
+
+    bench.run( "Cryptor::encrypt", size, [ & ]() {
+      std::istringstream in{ plain };
+      std::ostringstream out;
+      SshCrypt::Cryptor::encrypt( in, out );
+    } );
+    bench.run( "Cryptor::decrypt", size, [ & ]() {
+      std::istringstream in{ cipherText };
+      std::ostringstream out;
+      SshCrypt::Cryptor::decrypt( in, out );
+    } );
+  }
+
+  // key derivation alone: a fresh salt, the same salt from the cache and eight threads
+  // asking for one salt at the same time
+  const Data salt = SshCrypt::makeRandom( SshCrypt::Container::saltSize );
+  bench.run( "Cryptor::getSessionKey/uncached", salt.size(), [ & ]() {
+    SshCrypt::Cryptor::getSessionKey( SshCrypt::makeRandom( salt.size() ), nullptr );
+  } );
+  SshCrypt::Cryptor::setCacheTimeout( std::chrono::seconds{ 3600 } );
+  bench.run( "Cryptor::getSessionKey/cached", salt.size(),
+             [ & ]() { SshCrypt::Cryptor::getSessionKey( salt, nullptr ); } );
+  bench.run( "Cryptor::getSessionKey/concurrent", salt.size(), [ & ]() {
+    SshCrypt::Cryptor::clearCache();
+    const Data sharedSalt = SshCrypt::makeRandom( salt.size() );
+    std::vector<std::thread> threads;
+    for( int i = 0; i < 8; ++i )
+    {
+      threads.emplace_back(
+          [ & ]() { SshCrypt::Cryptor::getSessionKey( sharedSalt, nullptr ); } );
+    }
+    for( auto& thread : threads )
+    {
+      thread.join();
+    }
+  } );
+  SshCrypt::Cryptor::setCacheTimeout( std::chrono::seconds{ 0 } );
+  SshCrypt::Cryptor::clearCache();
+}
+
+void usage( const char* programName )
+{
+  std::cout << "usage: " << programName
+            << " [-m bytes] [-t seconds] [-f filter] [-a | -l milliseconds]\n"
+            << "  -m,  --max-size=N  largest buffer in bytes (default 1073741824)\n"
+            << "  -t,  --min-time=S  run every measurement at least S seconds (default 0.2)\n"
+            << "  -f,  --filter=F    only benchmarks with F in their name\n"
+            << "  -a,  --agent       use the agent from SSH_AUTH_SOCK instead of the mock\n"
+            << "  -l,  --latency=MS  the mock agent answers after MS milliseconds\n"
+            << "\n"
+            << "Writes json to stdout, progress to stderr. Build with\n"
+            << "-DCMAKE_BUILD_TYPE=Release for meaningful numbers.\n"
+            << std::endl;
+}
+} // namespace
+
+int main( int argc, char** argv )
+{
+  try
+  {
+    Settings settings;
+
+    static struct option benchOptions[] = { { "max-size", required_argument, nullptr, 'm' },
+                                            { "min-time", required_argument, nullptr, 't' },
+                                            { "filter", required_argument, nullptr, 'f' },
+                                            { "agent", no_argument, nullptr, 'a' },
+                                            { "latency", required_argument, nullptr, 'l' },
+                                            { "help", no_argument, nullptr, 'h' },
+                                            { nullptr, 0, nullptr, 0 } };
+    int optionIndex = 0;
+
+    int opt;
+    while( ( opt = getopt_long( argc, argv, "af:hl:m:t:", benchOptions, &optionIndex ) ) != -1 )
+    {
+      switch( opt )
+      {
+      case 'm': settings.maxSize = std::stoull( optarg ); break;
+      case 't': settings.minTime = std::stod( optarg ); break;
+      case 'f': settings.filter = optarg; break;
+      case 'a': settings.realAgent = true; break;
+      case 'l': settings.latency = std::chrono::milliseconds{ std::stol( optarg ) }; break;
+      case 'h': usage( argv[ 0 ] ); exit( 0 );
+      default: usage( argv[ 0 ] ); exit( 2 );
+      }
+    }
+
+    Bench bench{ settings };
+    benchData( bench );
+    benchSymCrypt( bench );
+    benchShaHash( bench );
+    benchAgentMessage( bench );
+    benchContainer( bench );
+    benchCryptor( bench, settings );
+    bench.print( std::cout );
+  }
+  catch( const std::exception& ex )
+  {
+    std::cerr << "exception: " << ex.what() << std::endl;
+    return 1;
+  }
+}
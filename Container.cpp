@@ -0,0 +1,1004 @@
+// SPDX-License-Identifier: MIT
+
+#include "Container.h"
+
+#include "AgentMessage.h"
+#include "Debug.h"
+#include "ShaHash.h"
+#include "ThreadPool.h"
+
+#include <algorithm>
+#include <cassert>
+#include <deque>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <zlib.h>
+
+namespace SshCrypt
+{
+namespace
+{
+const Data fileMagic{ 's', 's', 'h', 'c', 'r', 'y', 'p', 't' };
+// appended to the plain data, so we can check it on decrypt
+const Data magicWord{ 'S', 's', 'H', 'c', 'R', 'y', 'P', 't' };
+// ends the file, behind the size of the index
+const Data indexMagic{ 's', 's', 'h', 'c', 'i', 'n', 'd', 'x' };
+constexpr Size maxHeaderSize = 64 * 1024;
+constexpr Size maxIndexSize = 64 * 1024 * 1024;
+constexpr Size footerSize = 4 + 8;
+constexpr Size keySize = 32;
+constexpr Size ivSize = 16;
+const std::string wrapInfo = "sshcrypt v4 wrap";
+
+enum class Field
+{
+  Method = 1,
+  SegmentSize = 2,
+  Salt = 3,
+  Nonce = 4,
+  Fingerprint = 5,
+  Compression = 6,
+  Recipient = 7, // repeated, blobs of fingerprint, salt, nonce and wrapped key
+};
+
+// first byte of a segment of a compressed file
+constexpr Byte storedSegment = 0;
+constexpr Byte deflatedSegment = 1;
+
+enum class IndexField
+{
+  Offsets = 1,
+};
+
+Size readBytes( std::istream& in, Byte* buffer, Size size )
+{
+  in.read( reinterpret_cast<char*>( buffer ), static_cast<std::streamsize>( size ) );
+  if( in.bad() )
+  {
+    throw std::runtime_error{ "read failed" };
+  }
+  return static_cast<Size>( in.gcount() );
+}
+
+void writeBytes( std::ostream& out, const Byte* data, Size size )
+{
+  if( !out.write( reinterpret_cast<const char*>( data ),
+                  static_cast<std::streamsize>( size ) ) )
+  {
+    throw std::runtime_error{ "write failed" };
+  }
+}
+
+//! writes the plain data, but holds back the magic word at the end until finish()
+class MagicWordWriter
+{
+public:
+  MagicWordWriter( std::ostream& theOut, bool theCheck ) : out{ theOut }, check{ theCheck } {}
+
+  void write( DataView data )
+  {
+    if( !check )
+    {
+      writeBytes( out, data.data(), data.size() );
+      return;
+    }
+
+    pending.insert( pending.end(), data.begin(), data.end() );
+    if( pending.size() > magicWord.size() )
+    {
+      const Size ready = pending.size() - magicWord.size();
+      writeBytes( out, pending.data(), ready );
+      pending.erase( pending.begin(), pending.begin() + static_cast<std::ptrdiff_t>( ready ) );
+    }
+  }
+
+  void finish()
+  {
+    if( check && pending != magicWord )
+    {
+      throw std::runtime_error{ "invalid input (bad magic)" };
+    }
+    out.flush();
+  }
+
+private:
+  std::ostream& out;
+  const bool check;
+  SecureData pending;
+};
+
+//! runs segment jobs on a thread pool, results are passed to the sink in order
+template <class Result>
+class Pipeline
+{
+public:
+  using Job = std::function<Result()>;
+  using Sink = std::function<void( const Result& )>;
+
+  Pipeline( unsigned threads, Sink theSink ) : sink{ std::move( theSink ) }
+  {
+    if( threads == 0 )
+      threads = ThreadPool::defaultThreads();
+    threads = std::min( threads, ThreadPool::maxThreads() );
+    if( threads > 1 )
+      pool = std::make_unique<ThreadPool>( threads );
+    window = 2 * threads;
+  }
+
+  void push( Job job )
+  {
+    if( !pool )
+    {
+      sink( job() );
+      return;
+    }
+
+    if( inFlight.size() >= window )
+    {
+      pop();
+    }
+    inFlight.push_back( pool->submit( std::move( job ) ) );
+  }
+
+  void drain()
+  {
+    while( !inFlight.empty() )
+    {
+      pop();
+    }
+  }
+
+private:
+  std::unique_ptr<ThreadPool> pool; // joined after inFlight is gone
+  std::deque<std::future<Result>> inFlight;
+  Size window = 1;
+  Sink sink;
+
+  void pop()
+  {
+    Result result = inFlight.front().get();
+    inFlight.pop_front();
+    sink( result );
+  }
+};
+
+//! the largest segment a valid file has, what may follow the plain data included
+Size maxEncryptedSize( const Container::Header& header )
+{
+  return header.segmentSize + magicWord.size() + 1 + 2 * ivSize;
+}
+
+//! deflated with the fastest level, stored if that doesn't make it smaller
+SecureData compressSegment( const SecureData& plain )
+{
+  uLongf size = compressBound( static_cast<uLong>( plain.size() ) );
+  SecureData packed( 1 + size );
+  if( compress2( packed.data() + 1, &size, plain.data(), static_cast<uLong>( plain.size() ),
+                 Z_BEST_SPEED )
+          == Z_OK
+      && size < plain.size() )
+  {
+    packed[ 0 ] = deflatedSegment;
+    packed.resize( 1 + size );
+    return packed;
+  }
+  packed[ 0 ] = storedSegment;
+  std::copy( plain.begin(), plain.end(), packed.begin() + 1 );
+  packed.resize( 1 + plain.size() );
+  return packed;
+}
+
+//! never more than \a maxSize bytes, whatever the segment claims
+SecureData decompressSegment( const SecureData& packed, Size maxSize )
+{
+  if( !packed.empty() && packed[ 0 ] == storedSegment )
+  {
+    return SecureData( packed.begin() + 1, packed.end() );
+  }
+  SecureData plain( maxSize );
+  uLongf size = static_cast<uLongf>( maxSize );
+  if( packed.empty() || packed[ 0 ] != deflatedSegment
+      || uncompress( plain.data(), &size, packed.data() + 1,
+                     static_cast<uLong>( packed.size() - 1 ) )
+             != Z_OK )
+  {
+    throw std::runtime_error{ "invalid input (bad compressed segment)" };
+  }
+  plain.resize( size );
+  return plain;
+}
+
+//! xor the segment number into the end of the iv
+SecureData segmentIv( const SecureData& ivBase, Size index )
+{
+  SecureData iv{ ivBase };
+  for( Size pos = iv.size(); pos > iv.size() - 8; --pos )
+  {
+    iv[ pos - 1 ] ^= static_cast<Byte>( index & 0xff );
+    index >>= 8;
+  }
+  return iv;
+}
+
+//! the header with \a recipients instead of its own
+AgentMessage headerMessage( const Container::Header& header,
+                            const std::vector<Container::Recipient>& recipients )
+{
+  AgentMessage message{ static_cast<Byte>( header.version ) };
+  message.addInt( static_cast<Size>( Field::Method ) );
+  message.addBlob( Decoder::int2net( static_cast<Size>( header.method ) ) );
+  message.addInt( static_cast<Size>( Field::SegmentSize ) );
+  message.addBlob( Decoder::int2net( header.segmentSize ) );
+  if( !header.salt.empty() )
+  {
+    message.addInt( static_cast<Size>( Field::Salt ) );
+    message.addBlob( header.salt );
+  }
+  message.addInt( static_cast<Size>( Field::Nonce ) );
+  message.addBlob( header.nonce );
+  if( !header.fingerprint.empty() )
+  {
+    message.addInt( static_cast<Size>( Field::Fingerprint ) );
+    message.addBlob( fromString( header.fingerprint ) );
+  }
+  if( header.compression != Container::Compression::None )
+  {
+    message.addInt( static_cast<Size>( Field::Compression ) );
+    message.addBlob( Decoder::int2net( static_cast<Size>( header.compression ) ) );
+  }
+  for( const auto& recipient : recipients )
+  {
+    const Data fingerprint = fromString( recipient.fingerprint );
+    Data blob;
+    for( DataView field : { DataView{ fingerprint },
+                            DataView{ recipient.salt },
+                            DataView{ recipient.nonce },
+                            DataView{ recipient.wrappedKey } } )
+    {
+      const Data size = Decoder::int2net( field.size() );
+      blob.insert( blob.end(), size.begin(), size.end() );
+      blob.insert( blob.end(), field.begin(), field.end() );
+    }
+    message.addInt( static_cast<Size>( Field::Recipient ) );
+    message.addBlob( blob );
+  }
+  message.adjustMessageSize();
+  return message;
+}
+
+//! authenticated with every segment of an aead method: the hash of the header without
+//! recipients, which rewrap changes, the segment number and if it is the last one
+Data segmentAad( DataView headerHash, Size index, bool last )
+{
+  Data aad( headerHash.begin(), headerHash.end() );
+  const Data number = Decoder::int2net( index );
+  aad.insert( aad.end(), number.begin(), number.end() );
+  aad.push_back( last ? 1 : 0 );
+  return aad;
+}
+
+//! segment en- and decryption, the SymCrypt objects keep their key schedule and are
+//! reused by the jobs of the pipeline
+class SegmentCipher
+{
+public:
+  SegmentCipher( const Container::Header& header, DataView sessionKey ) :
+      method{ header.method },
+      compressed{ header.compression != Container::Compression::None },
+      maxPlainSize{ header.segmentSize + magicWord.size() },
+      headerHash{ ShaHash::check( headerMessage( header, {} ).getData() ) }
+  {
+    const SecureData material
+        = ShaHash::hkdf( sessionKey, header.nonce, "sshcrypt v2", keySize + ivSize );
+    key.assign( material.begin(), material.begin() + keySize );
+    ivBase.assign( material.begin() + keySize,
+                   material.begin() + keySize + SymCrypt::ivSize( method ) );
+  }
+
+  Data encrypt( Size index, bool last, const SecureData& plain )
+  {
+    auto crypt = acquire( index );
+    Data result = compressed ? crypt->encrypt( compressSegment( plain ), aad( index, last ) )
+                             : crypt->encrypt( plain, aad( index, last ) );
+    release( std::move( crypt ) );
+    return result;
+  }
+
+  SecureData decrypt( Size index, bool last, const Data& encrypted )
+  {
+    auto crypt = acquire( index );
+    SecureData result;
+    crypt->decrypt( encrypted, aad( index, last ), result );
+    release( std::move( crypt ) );
+    if( compressed )
+      return decompressSegment( result, maxPlainSize );
+    return result;
+  }
+
+private:
+  const SymCrypt::Method method;
+  const bool compressed;
+  const Size maxPlainSize;
+  const Data headerHash;
+  SecureData key;
+  SecureData ivBase;
+  std::mutex mutex;
+  std::vector<std::unique_ptr<SymCrypt>> idle;
+
+  Data aad( Size index, bool last ) const
+  {
+    return SymCrypt::isAead( method ) ? segmentAad( headerHash, index, last ) : Data{};
+  }
+
+  std::unique_ptr<SymCrypt> acquire( Size index )
+  {
+    std::unique_ptr<SymCrypt> crypt;
+    {
+      std::lock_guard<std::mutex> lock{ mutex };
+      if( !idle.empty() )
+      {
+        crypt = std::move( idle.back() );
+        idle.pop_back();
+      }
+    }
+    if( !crypt )
+      crypt = std::make_unique<SymCrypt>( key, ivBase, method );
+
+    crypt->setIv( segmentIv( ivBase, index ) );
+    return crypt;
+  }
+
+  void release( std::unique_ptr<SymCrypt> crypt )
+  {
+    std::lock_guard<std::mutex> lock{ mutex };
+    idle.push_back( std::move( crypt ) );
+  }
+};
+
+/*
+ * the session key (signature) begins with <4 size><x type><4size>
+ */
+void encryptVersion1( std::istream& in,
+                      std::ostream& out,
+                      const Data& salt,
+                      DataView sessionKey )
+{
+  assert( sessionKey.size() >= 64 ); // usually we get 276 bytes
+  const SecureData key{ sessionKey.begin() + 16, sessionKey.begin() + 48 };
+  const SecureData iv{ sessionKey.begin() + 48, sessionKey.begin() + 64 };
+  SymCrypt aes{ key, iv };
+  writeBytes( out, salt.data(), salt.size() );
+
+  SecureData input( Container::chunkSize );
+  Data output;
+  output.reserve( Container::chunkSize + aes.blockSize() );
+
+  aes.beginEncrypt();
+  while( Size length = readBytes( in, input.data(), input.size() ) )
+  {
+    output.clear();
+    aes.update( input.data(), length, output );
+    writeBytes( out, output.data(), output.size() );
+  }
+
+  output.clear();
+  aes.update( magicWord.data(), magicWord.size(), output );
+  aes.finish( output );
+  writeBytes( out, output.data(), output.size() );
+  out.flush();
+}
+
+void decryptVersion1( std::istream& in, std::ostream& out, DataView sessionKey )
+{
+  assert( sessionKey.size() >= 64 );
+  const SecureData key{ sessionKey.begin() + 16, sessionKey.begin() + 48 };
+  const SecureData iv{ sessionKey.begin() + 48, sessionKey.begin() + 64 };
+  SymCrypt aes{ key, iv };
+  MagicWordWriter writer{ out, true };
+
+  Data input( Container::chunkSize );
+  SecureData output;
+  output.reserve( Container::chunkSize + aes.blockSize() );
+
+  aes.beginDecrypt();
+  while( Size length = readBytes( in, input.data(), input.size() ) )
+  {
+    output.clear();
+    aes.update( input.data(), length, output );
+    writer.write( output );
+  }
+  output.clear();
+  aes.finish( output );
+  writer.write( output );
+  writer.finish();
+}
+
+//! offsets are 64 bit, files may be larger than 4 GiB
+void int64ToNet( Size value, Byte* buffer )
+{
+  for( Size pos = 8; pos > 0; --pos )
+  {
+    buffer[ pos - 1 ] = static_cast<Byte>( value & 0xff );
+    value >>= 8;
+  }
+}
+
+Size net2int64( const Byte* buffer )
+{
+  Size value = 0;
+  for( Size pos = 0; pos < 8; ++pos )
+  {
+    value = value << 8 | buffer[ pos ];
+  }
+  return value;
+}
+
+//! returns the number of bytes written
+Size writeHeader( std::ostream& out, const Container::Header& header )
+{
+  const AgentMessage message = headerMessage( header, header.recipients );
+  writeBytes( out, fileMagic.data(), fileMagic.size() );
+  writeBytes( out, message.getData().data(), message.getData().size() );
+  return fileMagic.size() + message.getData().size();
+}
+
+//! the file offsets of the segments behind the end mark, framed like the header, then
+//! its size and the index magic, so it is found from the end of the file
+void writeIndex( std::ostream& out,
+                 const Container::Header& header,
+                 const std::vector<Size>& offsets )
+{
+  Data blob( offsets.size() * 8 );
+  for( Size i = 0; i < offsets.size(); ++i )
+  {
+    int64ToNet( offsets[ i ], blob.data() + i * 8 );
+  }
+  AgentMessage message{ static_cast<Byte>( header.version ), 4 + 4 + blob.size() };
+  message.addInt( static_cast<Size>( IndexField::Offsets ) );
+  message.addBlob( blob );
+  message.adjustMessageSize();
+  writeBytes( out, message.getData().data(), message.getData().size() );
+
+  Byte footer[ footerSize ];
+  Decoder::int2net( message.getData().size(), footer );
+  std::copy( indexMagic.begin(), indexMagic.end(), footer + 4 );
+  writeBytes( out, footer, sizeof footer );
+}
+
+//! the offsets written by writeIndex(), empty if there is no valid index
+std::vector<Size> readIndex( std::istream& in, Size dataBegin, Size fileSize )
+{
+  if( fileSize < dataBegin + 4 + footerSize )
+    return {};
+
+  Byte footer[ footerSize ];
+  in.seekg( static_cast<std::streamoff>( fileSize - footerSize ) );
+  if( readBytes( in, footer, sizeof footer ) != sizeof footer
+      || !std::equal( indexMagic.begin(), indexMagic.end(), footer + 4 ) )
+    return {};
+
+  const Size indexSize = Decoder::net2int( footer );
+  if( indexSize < 5 || indexSize > maxIndexSize
+      || indexSize > fileSize - dataBegin - 4 - footerSize )
+    return {};
+  const Size indexBegin = fileSize - footerSize - indexSize;
+  Data data( indexSize );
+  in.seekg( static_cast<std::streamoff>( indexBegin ) );
+  if( readBytes( in, data.data(), data.size() ) != data.size() )
+    return {};
+
+  const auto message = AgentMessage::fromData( std::move( data ) );
+  if( message.getMessageSize() + 4 != indexSize )
+    return {};
+  std::vector<Size> offsets;
+  Decoder decoder = message.decoder();
+  while( decoder.bytesLeft() )
+  {
+    const Size field = decoder.getInt();
+    const DataView value = decoder.getBlob();
+    if( static_cast<IndexField>( field ) != IndexField::Offsets )
+      continue;
+    if( value.size() % 8 != 0 )
+      return {};
+    for( Size pos = 0; pos < value.size(); pos += 8 )
+    {
+      offsets.push_back( net2int64( value.data() + pos ) );
+    }
+  }
+
+  // ascending and in front of the index, the segments themselves are checked on decrypt
+  Size previous = dataBegin;
+  for( Size i = 0; i < offsets.size(); ++i )
+  {
+    if( offsets[ i ] < previous || offsets[ i ] + 4 > indexBegin )
+      return {};
+    previous = offsets[ i ] + 4;
+  }
+  return offsets;
+}
+
+//! the segment offsets of a file without an index, by skipping from size to size
+std::vector<Size>
+scanSegments( std::istream& in, const Container::Header& header, Size dataBegin )
+{
+  std::vector<Size> offsets;
+  Size position = dataBegin;
+  for( ;; )
+  {
+    Byte sizeBuffer[ 4 ];
+    in.seekg( static_cast<std::streamoff>( position ) );
+    if( readBytes( in, sizeBuffer, sizeof sizeBuffer ) != sizeof sizeBuffer )
+    {
+      throw std::runtime_error{ "invalid input (truncated)" };
+    }
+    const Size size = Decoder::net2int( sizeBuffer );
+    if( size == 0 )
+      return offsets;
+    if( size > maxEncryptedSize( header ) )
+    {
+      throw std::runtime_error{ "invalid input (bad segment size)" };
+    }
+    offsets.push_back( position );
+    position += 4 + size;
+  }
+}
+
+Size blobInt( DataView blob )
+{
+  if( blob.size() != 4 )
+    throw std::runtime_error{ "invalid header (bad int field)" };
+  return Decoder::net2int( blob.data() );
+}
+
+void parseHeader( const AgentMessage& message, Container::Header& header )
+{
+  header.version = message.type();
+  if( header.version < 2 || header.version > Container::envelopeVersion )
+  {
+    throw std::runtime_error{ "unsupported format version" };
+  }
+
+  header.salt.clear();
+  header.recipients.clear();
+  Decoder decoder = message.decoder();
+  while( decoder.bytesLeft() )
+  {
+    const Size field = decoder.getInt();
+    const DataView value = decoder.getBlob();
+    switch( static_cast<Field>( field ) )
+    {
+    case Field::Method:
+      header.method = static_cast<SymCrypt::Method>( blobInt( value ) );
+      break;
+    case Field::SegmentSize: header.segmentSize = blobInt( value ); break;
+    case Field::Salt: header.salt = value.toData(); break;
+    case Field::Nonce: header.nonce = value.toData(); break;
+    case Field::Fingerprint: header.fingerprint = toString( value ); break;
+    case Field::Compression:
+      header.compression = static_cast<Container::Compression>( blobInt( value ) );
+      break;
+    case Field::Recipient:
+    {
+      Decoder fields{ value.data(), value.size() };
+      Container::Recipient recipient;
+      recipient.fingerprint = toString( fields.getBlob() );
+      recipient.salt = fields.getBlobData();
+      recipient.nonce = fields.getBlobData();
+      recipient.wrappedKey = fields.getBlobData();
+      header.recipients.push_back( std::move( recipient ) );
+    }
+    break;
+    default: LOG_DEBUG( "ignoring header field " << field ); break;
+    }
+  }
+
+  if( header.method != SymCrypt::Method::AES256CBC && !SymCrypt::isAead( header.method ) )
+    throw std::runtime_error{ "invalid header (unknown method)" };
+  if( header.segmentSize == 0 || header.segmentSize > Container::maxSegmentSize )
+    throw std::runtime_error{ "invalid header (bad segment size)" };
+  const bool envelope = header.version == Container::envelopeVersion;
+  if( ( !envelope && header.salt.size() != Container::saltSize ) || header.nonce.empty() )
+    throw std::runtime_error{ "invalid header (missing salt or nonce)" };
+  if( envelope == header.recipients.empty() )
+    throw std::runtime_error{ "invalid header (recipients don't match the version)" };
+  for( const auto& recipient : header.recipients )
+  {
+    if( recipient.salt.size() != Container::saltSize || recipient.nonce.empty() )
+      throw std::runtime_error{ "invalid header (bad recipient)" };
+  }
+  if( header.compression != Container::Compression::None
+      && header.compression != Container::Compression::Zlib )
+    throw std::runtime_error{ "invalid header (unknown compression)" };
+  if( !envelope
+      && ( header.version == 3 ) != ( header.compression != Container::Compression::None ) )
+    throw std::runtime_error{ "invalid header (compression doesn't match the version)" };
+}
+
+void encryptVersion2( std::istream& in,
+                      std::ostream& out,
+                      const Container::Header& header,
+                      DataView sessionKey,
+                      unsigned threads )
+{
+  Size position = writeHeader( out, header );
+  std::vector<Size> offsets;
+
+  const auto method = header.method;
+  SegmentCipher cipher{ header, sessionKey };
+  Pipeline<Data> pipeline{ threads, [ &out, &position, &offsets ]( const Data& segment ) {
+                      Byte size[ 4 ];
+                      Decoder::int2net( segment.size(), size );
+                      writeBytes( out, size, sizeof size );
+                      writeBytes( out, segment.data(), segment.size() );
+                      offsets.push_back( position );
+                      position += sizeof size + segment.size();
+                    } };
+
+  bool last = false;
+  for( Size index = 0; !last; ++index )
+  {
+    SecureData segment( header.segmentSize );
+    segment.resize( readBytes( in, segment.data(), segment.size() ) );
+    if( segment.size() < header.segmentSize )
+    {
+      last = true;
+      if( !SymCrypt::isAead( method ) )
+        segment.insert( segment.end(), magicWord.begin(), magicWord.end() );
+    }
+
+    pipeline.push( [ &cipher, index, last, segment = std::move( segment ) ]() {
+      return cipher.encrypt( index, last, segment );
+    } );
+  }
+  pipeline.drain();
+
+  const Byte endMark[ 4 ] = {};
+  writeBytes( out, endMark, sizeof endMark );
+  writeIndex( out, header, offsets );
+  out.flush();
+}
+
+void decryptVersion2( std::istream& in,
+                      std::ostream& out,
+                      const Container::Header& header,
+                      DataView sessionKey,
+                      unsigned threads )
+{
+  const auto method = header.method;
+  SegmentCipher cipher{ header, sessionKey };
+  MagicWordWriter writer{ out, !SymCrypt::isAead( method ) };
+  Pipeline<SecureData> pipeline{ threads, [ &writer ]( const SecureData& plain ) {
+                                  writer.write( plain );
+                                } };
+
+  auto readSize = [ &in ]() {
+    Byte sizeBuffer[ 4 ];
+    if( readBytes( in, sizeBuffer, sizeof sizeBuffer ) != sizeof sizeBuffer )
+    {
+      throw std::runtime_error{ "invalid input (truncated)" };
+    }
+    return Decoder::net2int( sizeBuffer );
+  };
+
+  // the size of the next segment tells, if this is the last one. Even empty plain data has
+  // a segment, the one flagged last, so a file cut behind the header isn't taken as empty.
+  Size size = readSize();
+  if( size == 0 )
+  {
+    throw std::runtime_error{ "invalid input (truncated)" };
+  }
+  for( Size index = 0; size != 0; ++index )
+  {
+    if( size > maxEncryptedSize( header ) )
+    {
+      throw std::runtime_error{ "invalid input (bad segment size)" };
+    }
+
+    Data segment( size );
+    if( readBytes( in, segment.data(), size ) != size )
+    {
+      throw std::runtime_error{ "invalid input (truncated)" };
+    }
+    size = readSize();
+
+    pipeline.push( [ &cipher, index, last = size == 0, segment = std::move( segment ) ]() {
+      return cipher.decrypt( index, last, segment );
+    } );
+  }
+  pipeline.drain();
+  writer.finish();
+}
+
+void decryptRangeVersion2( std::istream& in,
+                           std::ostream& out,
+                           const Container::Header& header,
+                           DataView sessionKey,
+                           Size offset,
+                           Size length,
+                           unsigned threads )
+{
+  const std::streamoff dataBegin = in.tellg();
+  in.seekg( 0, std::ios::end );
+  const std::streamoff fileSize = in.tellg();
+  if( dataBegin < 0 || fileSize < dataBegin )
+  {
+    throw std::runtime_error{ "random access needs a seekable input" };
+  }
+
+  auto offsets
+      = readIndex( in, static_cast<Size>( dataBegin ), static_cast<Size>( fileSize ) );
+  if( offsets.empty() )
+  {
+    LOG_DEBUG( "no segment index, scanning" );
+    in.clear();
+    offsets = scanSegments( in, header, static_cast<Size>( dataBegin ) );
+  }
+  if( offsets.empty() )
+  {
+    throw std::runtime_error{ "invalid input (truncated)" };
+  }
+
+  const Size end = std::min( offset, std::numeric_limits<Size>::max() - length ) + length;
+  const Size first = offset / header.segmentSize;
+  if( length == 0 || first >= offsets.size() )
+    return;
+  const Size last = std::min( ( end - 1 ) / header.segmentSize, offsets.size() - 1 );
+
+  const auto method = header.method;
+  SegmentCipher cipher{ header, sessionKey };
+  Size skip = offset - first * header.segmentSize;
+  Size left = end - offset;
+  Pipeline<SecureData> pipeline{ threads, [ &out, &skip, &left ]( const SecureData& plain ) {
+                      const Size begin = std::min( skip, plain.size() );
+                      const Size size = std::min( left, plain.size() - begin );
+                      writeBytes( out, plain.data() + begin, size );
+                      skip -= begin;
+                      left -= size;
+                    } };
+
+  for( Size index = first; index <= last; ++index )
+  {
+    Byte sizeBuffer[ 4 ];
+    in.seekg( static_cast<std::streamoff>( offsets[ index ] ) );
+    if( readBytes( in, sizeBuffer, sizeof sizeBuffer ) != sizeof sizeBuffer )
+    {
+      throw std::runtime_error{ "invalid input (truncated)" };
+    }
+    const Size size = Decoder::net2int( sizeBuffer );
+    if( size > maxEncryptedSize( header ) )
+    {
+      throw std::runtime_error{ "invalid input (bad segment size)" };
+    }
+    Data segment( size );
+    if( readBytes( in, segment.data(), size ) != size )
+    {
+      throw std::runtime_error{ "invalid input (truncated)" };
+    }
+
+    const bool isLast = index == offsets.size() - 1;
+    pipeline.push( [ &cipher, method, index, isLast, segment = std::move( segment ) ]() {
+      SecureData plain = cipher.decrypt( index, isLast, segment );
+      if( isLast && !SymCrypt::isAead( method ) )
+      {
+        if( plain.size() < magicWord.size()
+            || !std::equal( magicWord.rbegin(), magicWord.rend(), plain.rbegin() ) )
+        {
+          throw std::runtime_error{ "invalid input (bad magic)" };
+        }
+        plain.resize( plain.size() - magicWord.size() );
+      }
+      return plain;
+    } );
+  }
+  pipeline.drain();
+  out.flush();
+}
+
+//! the segments are copied as they are, only their offsets change with the header
+void replaceHeaderVersion2( std::istream& in,
+                            std::ostream& out,
+                            const Container::Header& header )
+{
+  Size position = writeHeader( out, header );
+  std::vector<Size> offsets;
+  Data segment;
+  for( ;; )
+  {
+    Byte sizeBuffer[ 4 ];
+    if( readBytes( in, sizeBuffer, sizeof sizeBuffer ) != sizeof sizeBuffer )
+    {
+      throw std::runtime_error{ "invalid input (truncated)" };
+    }
+    const Size size = Decoder::net2int( sizeBuffer );
+    writeBytes( out, sizeBuffer, sizeof sizeBuffer );
+    if( size == 0 )
+      break;
+    if( size > maxEncryptedSize( header ) )
+    {
+      throw std::runtime_error{ "invalid input (bad segment size)" };
+    }
+
+    segment.resize( size );
+    if( readBytes( in, segment.data(), size ) != size )
+    {
+      throw std::runtime_error{ "invalid input (truncated)" };
+    }
+    writeBytes( out, segment.data(), size );
+    offsets.push_back( position );
+    position += sizeof sizeBuffer + size;
+  }
+  writeIndex( out, header, offsets );
+  out.flush();
+}
+
+//! en- and decrypts the data key of a recipient
+std::unique_ptr<SymCrypt> wrapCipher( const Container::Recipient& recipient,
+                                      DataView sessionKey )
+{
+  const auto method = SymCrypt::Method::AES256GCM;
+  const SecureData material = ShaHash::hkdf( sessionKey, recipient.nonce, wrapInfo,
+                                       keySize + SymCrypt::ivSize( method ) );
+  // views into the secure memory, key and iv aren't copied on their way to SymCrypt
+  return std::make_unique<SymCrypt>( DataView{ material.data(), keySize },
+                                     DataView{ material.data() + keySize,
+                                               material.size() - keySize },
+                                     method );
+}
+} // namespace
+
+Container::Header
+Container::makeHeader( int version,
+                       Size segmentSize,
+                       SymCrypt::Method method,
+                       Compression compression ) // static
+{
+  if( version != 1 && version != 2 && version != envelopeVersion )
+    throw std::runtime_error{ "unsupported format version" };
+  if( segmentSize == 0 || segmentSize > maxSegmentSize )
+    throw std::runtime_error{ "bad segment size" };
+  if( version == 1 && compression != Compression::None )
+    throw std::runtime_error{ "compression needs format version 2" };
+
+  Header header;
+  header.version = version == 2 && compression != Compression::None ? 3 : version;
+  header.compression = compression;
+  header.segmentSize = segmentSize;
+  header.method = version > 1 ? method : SymCrypt::Method::AES256CBC;
+  if( version != envelopeVersion ) // every recipient has its own
+    header.salt = makeRandom( saltSize );
+  if( version > 1 )
+    header.nonce = makeRandom( nonceSize );
+  return header;
+}
+
+//! read the header of any version, for version 1 this is the salt only
+Container::Header Container::readHeader( std::istream& in ) // static
+{
+  Header header;
+  header.salt.resize( saltSize );
+  if( readBytes( in, header.salt.data(), saltSize ) != saltSize )
+  {
+    throw std::runtime_error{ "invalid input (too short)" };
+  }
+
+  if( !std::equal( fileMagic.begin(), fileMagic.end(), header.salt.begin() ) )
+  {
+    header.version = 1;
+    header.method = SymCrypt::Method::AES256CBC;
+    return header;
+  }
+
+  // the rest of the salt is the beginning of the header message
+  AgentMessage message;
+  message.append( header.salt.data() + fileMagic.size(),
+                  static_cast<int>( saltSize - fileMagic.size() ) );
+  const Size messageSize = 4 + message.getMessageSize();
+  if( messageSize < message.getData().size() || messageSize > maxHeaderSize )
+  {
+    throw std::runtime_error{ "invalid header (bad size)" };
+  }
+
+  Data rest( messageSize - message.getData().size() );
+  if( readBytes( in, rest.data(), rest.size() ) != rest.size() )
+  {
+    throw std::runtime_error{ "invalid input (too short)" };
+  }
+  message.append( rest.data(), static_cast<int>( rest.size() ) );
+
+  parseHeader( message, header );
+  return header;
+}
+
+void Container::encrypt( std::istream& in,
+                         std::ostream& out,
+                         const Header& header,
+                         DataView sessionKey,
+                         unsigned threads ) // static
+{
+  if( header.version == 1 )
+    encryptVersion1( in, out, header.salt, sessionKey );
+  else
+    encryptVersion2( in, out, header, sessionKey, threads );
+}
+
+void Container::decrypt( std::istream& in,
+                         std::ostream& out,
+                         const Header& header,
+                         DataView sessionKey,
+                         unsigned threads ) // static
+{
+  if( header.version == 1 )
+    decryptVersion1( in, out, sessionKey );
+  else
+    decryptVersion2( in, out, header, sessionKey, threads );
+}
+
+void Container::checkRandomAccess( std::istream& in, const Header& header ) // static
+{
+  if( header.version == 1 )
+  {
+    throw std::runtime_error{ "random access needs a binary file of format version 2" };
+  }
+  const std::streamoff dataBegin = in.tellg();
+  in.seekg( 0, std::ios::end );
+  const std::streamoff fileSize = in.tellg();
+  in.seekg( dataBegin );
+  if( dataBegin < 0 || fileSize < dataBegin || !in )
+  {
+    throw std::runtime_error{ "random access needs a seekable input" };
+  }
+}
+
+void Container::decryptRange( std::istream& in,
+                              std::ostream& out,
+                              const Header& header,
+                              DataView sessionKey,
+                              Size offset,
+                              Size length,
+                              unsigned threads ) // static
+{
+  checkRandomAccess( in, header );
+  decryptRangeVersion2( in, out, header, sessionKey, offset, length, threads );
+}
+
+Container::Recipient Container::wrapKey( DataView dataKey,
+                                         const std::string& fingerprint,
+                                         const Data& salt,
+                                         DataView sessionKey ) // static
+{
+  Recipient recipient;
+  recipient.fingerprint = fingerprint;
+  recipient.salt = salt;
+  recipient.nonce = makeRandom( nonceSize );
+  // bound to the fingerprint, a recipient moved to another key doesn't decrypt
+  recipient.wrappedKey
+      = wrapCipher( recipient, sessionKey )->encrypt( dataKey, fromString( fingerprint ) );
+  return recipient;
+}
+
+SecureData Container::unwrapKey( const Recipient& recipient, DataView sessionKey ) // static
+{
+  SecureData dataKey;
+  wrapCipher( recipient, sessionKey )
+      ->decrypt( recipient.wrappedKey, fromString( recipient.fingerprint ), dataKey );
+  if( dataKey.size() != dataKeySize )
+  {
+    throw std::runtime_error{ "invalid header (bad data key)" };
+  }
+  return dataKey;
+}
+
+void Container::replaceHeader( std::istream& in,
+                               std::ostream& out,
+                               const Header& header ) // static
+{
+  if( header.version == 1 )
+  {
+    throw std::runtime_error{ "version 1 has no header to replace" };
+  }
+  replaceHeaderVersion2( in, out, header );
+}
+} // namespace SshCrypt
@@ -0,0 +1,137 @@
+// SPDX-License-Identifier: MIT
+
+#pragma once
+
+#include "Data.h"
+#include "SymCrypt.h"
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+namespace SshCrypt
+{
+/*! \class Container
+ *
+ * version 1:
+ *   32 bytes salt, followed by the plain data and the magic word encrypted with
+ *   aes-256-cbc, key and iv are taken from the session key
+ *
+ * version 2:
+ *   "sshcrypt", header framed like an agent message (size, version as type, fields),
+ *   followed by segments. The plain data is split into segments of segmentSize,
+ *   which are encrypted independently, so they can be processed in parallel.
+ *   Key and iv are derived from the session key and the nonce with hkdf, the
+ *   segment number is xor'ed into the iv. Every segment is stored with its size,
+ *   a size of 0 marks the end.
+ *   With an aead method every segment carries its own tag, the sha256 of the header,
+ *   the segment number and a flag for the last segment are authenticated, so a changed
+ *   header and corrupted, reordered or truncated data are rejected at the segment.
+ *   Aes-256-cbc appends the magic word.
+ *   Behind the end mark follows an index with the file offset of every segment, framed
+ *   like the header, its size and "sshcindx", so a range of the plain data is decrypted
+ *   without reading the segments in front of it. Files without one are scanned.
+ *
+ * version 3:
+ *   version 2 with every segment compressed before it is encrypted, older versions
+ *   refuse it instead of returning the compressed data. A segment starts with a byte
+ *   telling if it is deflated or stored, because deflating didn't make it smaller.
+ *   Compression makes the size of the file depend on the content, who can see the
+ *   size of a file, whose content is partly known or chosen, learns about the rest.
+ *
+ * version 4:
+ *   envelope encryption, the segments are encrypted like version 2 or 3 (telling by the
+ *   compression field) with a random data key instead of a session key. The header holds
+ *   a recipient field per key with its fingerprint, a salt, a nonce and the data key
+ *   encrypted with aes-256-gcm, key and iv derived from the session key of the salt and the
+ *   nonce. The cost of the segments doesn't grow with the recipients, adding or removing
+ *   one writes a new header in front of the copied segments, so the recipient fields are
+ *   left out of the header hash, each wrapped key is authenticated on its own. A removed
+ *   recipient, who kept the data key, can still decrypt the file, only encrypting it again
+ *   changes the key.
+ */
+class Container
+{
+public:
+  Container() = delete;
+
+  static constexpr Size saltSize = 32;
+  static constexpr Size nonceSize = 16;
+  static constexpr Size chunkSize = 64 * 1024;
+  static constexpr Size defaultSegmentSize = 1024 * 1024;
+  static constexpr Size maxSegmentSize = 64 * 1024 * 1024;
+  static constexpr Size dataKeySize = 32;
+  static constexpr int envelopeVersion = 4;
+
+  enum class Compression
+  {
+    None = 0,
+    Zlib = 1,
+  };
+
+  //! a key of version 4, that can decrypt the data key
+  struct Recipient
+  {
+    std::string fingerprint;
+    Data salt;
+    Data nonce;
+    Data wrappedKey;
+  };
+
+  struct Header
+  {
+    int version = 2;
+    SymCrypt::Method method = SymCrypt::Method::AES256GCM;
+    Size segmentSize = defaultSegmentSize;
+    Data salt;
+    Data nonce;
+    std::string fingerprint; // of the key, empty if unknown (version 1 and older files)
+    Compression compression = Compression::None;
+    std::vector<Recipient> recipients; // version 4 only, salt is empty then
+  };
+
+  // version 1 is always aes-256-cbc, compression turns version 2 into 3, version 4 keeps
+  // its number
+  static Header makeHeader( int version = 2,
+                            Size segmentSize = defaultSegmentSize,
+                            SymCrypt::Method method = SymCrypt::Method::AES256GCM,
+                            Compression compression = Compression::None );
+  static Header readHeader( std::istream& in );
+
+  // \a threads is 0 means one thread per core
+  static void encrypt( std::istream& in,
+                       std::ostream& out,
+                       const Header& header,
+                       DataView sessionKey,
+                       unsigned threads = 0 );
+  static void decrypt( std::istream& in,
+                       std::ostream& out,
+                       const Header& header,
+                       DataView sessionKey,
+                       unsigned threads = 0 );
+  //! throws if decryptRange() can't read \a in, before a session key is asked for in vain
+  static void checkRandomAccess( std::istream& in, const Header& header );
+  //! decrypts the plain bytes [ offset, offset + length ) of a version 2 file, \a in must
+  //! be seekable and positioned behind the header, only the segments needed are read
+  static void decryptRange( std::istream& in,
+                            std::ostream& out,
+                            const Header& header,
+                            DataView sessionKey,
+                            Size offset,
+                            Size length,
+                            unsigned threads = 0 );
+
+  //! the data key encrypted for \a fingerprint with the session key of \a salt
+  static Recipient wrapKey( DataView dataKey,
+                            const std::string& fingerprint,
+                            const Data& salt,
+                            DataView sessionKey );
+  //! throws if \a sessionKey isn't the one of the recipient
+  static SecureData unwrapKey( const Recipient& recipient, DataView sessionKey );
+
+  //! copies the segments behind the header of \a in to \a out, behind \a header and
+  //! followed by a new index, nothing is decrypted. \a header must differ from the one
+  //! read in its recipients only.
+  static void replaceHeader( std::istream& in, std::ostream& out, const Header& header );
+};
+} // namespace SshCrypt
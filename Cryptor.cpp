@@ -3,74 +3,429 @@
 #include "Cryptor.h"
 
 #include "AgentComm.h"
+#include "Container.h"
 #include "Debug.h"
-#include "ShaHash.h"
 #include "SymCrypt.h"
 
+#include <algorithm>
 #include <cassert>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <openssl/crypto.h>
+#include <stdexcept>
 
 namespace SshCrypt
 {
-std::vector<Cryptor::Key> Cryptor::getAvailableKeys()
+namespace
 {
-  std::vector<Key> result;
-  SshCrypt::AgentComm agent;
+constexpr Size saltSize = Container::saltSize;
 
-  const auto identityList = agent.requestIdentities();
-  for( const auto& identity : identityList )
+//! session keys by fingerprint of the identity and salt
+struct SessionCache
+{
+  using Clock = std::chrono::steady_clock;
+  struct Entry
   {
-    result.push_back( Key{ toBase64( ShaHash::check( identity.pubkey ), false ),
-                           toString( identity.comment ) } );
+    std::shared_future<SecureData> sessionKey; // pending while the agent is asked
+    Clock::time_point expires;
+  };
+
+  std::mutex mutex;
+  std::chrono::seconds timeout{ 0 };
+  std::chrono::milliseconds agentTimeout{ 0 };
+  std::map<std::pair<std::string, Data>, Entry> entries; // empty fingerprint while pending
+  Data batchSalt; // entries with this salt do not expire while the batch exists
+
+  // the last identities of ssh-agent, an unchanged answer reuses their fingerprints
+  std::string identitiesSocket;
+  std::shared_ptr<const IdentityTable> identities;
+
+  std::mutex agentMutex;
+  std::unique_ptr<AgentComm> batchAgent; // one connection for the whole batch
+  std::shared_ptr<const IdentityTable> batchIdentities; // asked again for an unknown id
+
+  //! the fingerprint of \a id, without one the first key of the last identities of
+  //! ssh-agent, empty if they aren't known. Called with the mutex locked.
+  std::string fingerprintOf( const char* id ) const
+  {
+    if( id )
+      return id;
+    const char* authSock = getenv( "SSH_AUTH_SOCK" );
+    if( !identities || identities->empty()
+        || identitiesSocket != ( authSock ? authSock : "" ) )
+      return {};
+    return identities->find( nullptr )->fingerprint;
   }
-  return result;
+
+  void purge( Clock::time_point now )
+  {
+    for( auto iter = entries.begin(); iter != entries.end(); )
+    {
+      if( iter->first.second != batchSalt && iter->second.expires <= now )
+        iter = entries.erase( iter );
+      else
+        ++iter;
+    }
+  }
+};
+
+SessionCache& sessionCache()
+{
+  static SessionCache cache;
+  return cache;
 }
 
-Data Cryptor::getSessionKey( const Data& salt, const char* id )
+//! the identity table for the answer of ssh-agent, without hashing if it didn't change
+std::shared_ptr<const IdentityTable> identityTable(
+    std::vector<AgentComm::Identity> identities )
 {
-  SshCrypt::AgentComm agent;
+  auto& cache = sessionCache();
+  const char* authSock = getenv( "SSH_AUTH_SOCK" );
+  const std::string socket = authSock ? authSock : "";
+  std::shared_ptr<const IdentityTable> previous;
+  {
+    std::lock_guard<std::mutex> lock{ cache.mutex };
+    if( cache.identitiesSocket == socket )
+      previous = cache.identities;
+  }
 
-  const auto identityList = agent.requestIdentities();
+  auto table = std::make_shared<const IdentityTable>( std::move( identities ), previous.get() );
+  std::lock_guard<std::mutex> lock{ cache.mutex };
+  cache.identitiesSocket = socket;
+  cache.identities = table;
+  return table;
+}
 
-  if( identityList.empty() )
+//! moved to secure memory, the signatures in the agent's answer are wiped
+std::vector<SecureData> secured( std::vector<Data> sessionKeys )
+{
+  std::vector<SecureData> result;
+  result.reserve( sessionKeys.size() );
+  for( auto& sessionKey : sessionKeys )
   {
-    throw std::runtime_error{ "no identities found" };
+    result.emplace_back( sessionKey.begin(), sessionKey.end() );
+    OPENSSL_cleanse( sessionKey.data(), sessionKey.size() );
   }
+  return result;
+}
 
-  SshCrypt::AgentComm::Identity useIdentity;
+//! one session key per salt, the agent gets all sign requests at once. \a fingerprint is
+//! set to the key, that signed, it stays empty if it can't be told.
+std::vector<SecureData>
+requestSessionKeys( const std::vector<Data>& salts, const char* id, std::string& fingerprint )
+{
+  const char* daemonSocket = getenv( "SSHCRYPT_AGENT_SOCK" );
+  if( daemonSocket && *daemonSocket )
+  {
+    try
+    {
+      SshCrypt::AgentComm daemon{ daemonSocket };
+      daemon.setTimeout( Cryptor::agentTimeout() );
+      std::vector<Data> sessionKeys;
+      std::string signer;
+      for( const auto& salt : salts )
+      {
+        sessionKeys.push_back( daemon.requestDerivedKey( id ? id : "", salt, &signer ) );
+      }
+      fingerprint = signer.empty() && id ? id : signer;
+      return secured( std::move( sessionKeys ) );
+    }
+    catch( const std::exception& ex )
+    {
+      LOG_DEBUG( "sshcrypt-agent: " << ex.what() << ", asking ssh-agent" );
+    }
+  }
 
-  if( id )
+  auto& cache = sessionCache();
+  std::unique_lock<std::mutex> agentLock{ cache.agentMutex };
+  bool inBatch;
+  std::chrono::milliseconds timeout;
+  {
+    std::lock_guard<std::mutex> lock{ cache.mutex };
+    inBatch = !cache.batchSalt.empty();
+    timeout = cache.agentTimeout;
+  }
+  if( inBatch )
   {
-    for( const auto& identity : identityList )
+    if( !cache.batchAgent )
+    {
+      cache.batchAgent = std::make_unique<AgentComm>();
+    }
+    cache.batchAgent->setTimeout( timeout );
+    try
     {
-      auto sha256 = toBase64( ShaHash::check( identity.pubkey ), false );
-      LOG_DEBUG( sha256 << " " << SshCrypt::toString( identity.comment ) );
-      if( sha256 == id )
+      if( !cache.batchIdentities || !cache.batchIdentities->find( id ) )
       {
-        LOG_DEBUG( "identity " << id << " found" );
-        useIdentity = identity;
-        break;
+        cache.batchIdentities = identityTable( cache.batchAgent->requestIdentities() );
       }
+      const auto& entry = cache.batchIdentities->get( id );
+      fingerprint = entry.fingerprint;
+      return secured( cache.batchAgent->requestSignatures( entry.identity.pubkey, salts ) );
     }
+    catch( const std::exception& )
+    {
+      // the responses may be out of step now, or the key is gone
+      cache.batchAgent.reset();
+      cache.batchIdentities.reset();
+      throw;
+    }
+  }
+  agentLock.unlock();
+
+  const auto connections = static_cast<unsigned>(
+      std::min<Size>( salts.size(), AgentPool::defaultConnections ) );
+  AgentPool pool{ connections };
+  pool.setTimeout( timeout );
+  const auto identities = identityTable( pool.requestIdentities() );
+  const auto& entry = identities->get( id );
+  fingerprint = entry.fingerprint;
+  return secured( pool.requestSignatures( entry.identity.pubkey, salts ) );
+}
 
-    if( useIdentity.pubkey.empty() )
+//! the session keys of getSessionKeys(), \a fingerprint is set to the key, that signed,
+//! it stays empty if it can't be told
+std::vector<SecureData>
+cachedSessionKeys( const std::vector<Data>& salts, const char* id, std::string& fingerprint )
+{
+  if( id && !*id )
+    id = nullptr;
+
+  auto& cache = sessionCache();
+  std::vector<std::shared_future<SecureData>> sessionKeys( salts.size() );
+  std::vector<Size> missing;
+  std::vector<std::promise<SecureData>> promises;
+  {
+    std::lock_guard<std::mutex> lock{ cache.mutex };
+    const auto now = SessionCache::Clock::now();
+    cache.purge( now );
+    fingerprint = cache.fingerprintOf( id );
+    for( Size i = 0; i < salts.size(); ++i )
+    {
+      const bool cached = cache.timeout.count() != 0 || salts[ i ] == cache.batchSalt;
+      const auto cacheKey = std::make_pair( fingerprint, salts[ i ] );
+      auto found = cached ? cache.entries.find( cacheKey ) : cache.entries.end();
+      if( found != cache.entries.end() )
+      {
+        LOG_DEBUG( "session key from cache" );
+        sessionKeys[ i ] = found->second.sessionKey; // may still be pending
+        continue;
+      }
+
+      // other threads asking for the same key wait for this request
+      promises.emplace_back();
+      sessionKeys[ i ] = promises.back().get_future().share();
+      missing.push_back( i );
+      if( cached )
+        cache.entries[ cacheKey ] = { sessionKeys[ i ], now + cache.timeout };
+    }
+  }
+
+  if( !missing.empty() )
+  {
+    std::vector<Data> missingSalts;
+    for( Size i : missing )
     {
-      throw std::runtime_error{ "identity not found" };
+      missingSalts.push_back( salts[ i ] );
+    }
+    try
+    {
+      std::string signer;
+      const auto requested = requestSessionKeys( missingSalts, id, signer );
+      for( Size i = 0; i < promises.size(); ++i )
+      {
+        promises[ i ].set_value( requested[ i ] );
+      }
+      if( fingerprint.empty() )
+      {
+        // filed under the key, that signed, or dropped if it isn't known
+        std::lock_guard<std::mutex> lock{ cache.mutex };
+        for( const auto& salt : missingSalts )
+        {
+          auto pending = cache.entries.extract( std::make_pair( std::string{}, salt ) );
+          if( pending && !signer.empty() )
+          {
+            pending.key().first = signer;
+            cache.entries.insert( std::move( pending ) );
+          }
+        }
+        fingerprint = signer;
+      }
+    }
+    catch( ... )
+    {
+      std::lock_guard<std::mutex> lock{ cache.mutex };
+      for( Size i = 0; i < promises.size(); ++i )
+      {
+        promises[ i ].set_exception( std::current_exception() );
+        cache.entries.erase( std::make_pair( fingerprint, missingSalts[ i ] ) );
+      }
+      throw;
     }
   }
+
+  std::vector<SecureData> result;
+  result.reserve( salts.size() );
+  for( auto& sessionKey : sessionKeys )
+  {
+    result.push_back( sessionKey.get() ); // waits for requests of other threads
+  }
+  return result;
+}
+
+//! an explicit id wins over the key named in the header
+const char* keyId( const Container::Header& header, const char* id )
+{
+  if( !id && !header.fingerprint.empty() )
+    return header.fingerprint.c_str();
+  return id;
+}
+
+//! the batch salt, a new one outside of a batch
+Data newSalt()
+{
+  auto& cache = sessionCache();
+  std::lock_guard<std::mutex> lock{ cache.mutex };
+  return cache.batchSalt.empty() ? makeRandom( saltSize ) : cache.batchSalt;
+}
+
+//! the data key of version 4 from the recipient \a id, or the first one the agent has
+SecureData openEnvelope( const Container::Header& header, const char* id )
+{
+  std::vector<std::string> candidates;
+  if( id )
+  {
+    candidates.push_back( id );
+  }
   else
   {
-    useIdentity = identityList.front();
-    LOG_DEBUG( "using first identity "
-               << toBase64( ShaHash::check( useIdentity.pubkey ), false ) );
+    for( const auto& key : Cryptor::getAvailableKeys() )
+    {
+      candidates.push_back( key.sha256 );
+    }
   }
-  return agent.requestSignature( useIdentity.pubkey, salt );
+
+  for( const auto& recipient : header.recipients )
+  {
+    if( std::find( candidates.begin(), candidates.end(), recipient.fingerprint )
+        != candidates.end() )
+    {
+      const SecureData sessionKey
+          = Cryptor::getSessionKey( recipient.salt, recipient.fingerprint.c_str() );
+      return Container::unwrapKey( recipient, sessionKey );
+    }
+  }
+  throw std::runtime_error{ id ? "the key is no recipient of the file"
+                               : "no key of the agent is a recipient of the file" };
+}
+
+//! the key the segments are encrypted with
+SecureData fileKey( const Container::Header& header, const char* id )
+{
+  if( header.version == Container::envelopeVersion )
+    return openEnvelope( header, id );
+  return Cryptor::getSessionKey( header.salt, keyId( header, id ) );
+}
+
+//! adds \a fingerprint to the recipients of \a header, unless it is one already
+void addRecipient( Container::Header& header,
+                   DataView dataKey,
+                   const std::string& fingerprint )
+{
+  for( const auto& recipient : header.recipients )
+  {
+    if( recipient.fingerprint == fingerprint )
+      return;
+  }
+  const Data salt = newSalt();
+  header.recipients.push_back( Container::wrapKey(
+      dataKey, fingerprint, salt, Cryptor::getSessionKey( salt, fingerprint.c_str() ) ) );
+}
+} // namespace
+
+std::vector<Cryptor::Key> Cryptor::getAvailableKeys()
+{
+  std::vector<Key> result;
+  SshCrypt::AgentComm agent;
+  agent.setTimeout( agentTimeout() );
+
+  const auto identities = identityTable( agent.requestIdentities() );
+  for( const auto& entry : identities->entries() )
+  {
+    result.push_back( Key{ entry.fingerprint, toString( entry.identity.comment ) } );
+  }
+  return result;
+}
+
+SecureData Cryptor::getSessionKey( const Data& salt, const char* id )
+{
+  return getSessionKeys( { salt }, id ).front();
+}
+
+std::vector<SecureData> Cryptor::getSessionKeys( const std::vector<Data>& salts,
+                                                 const char* id )
+{
+  std::string fingerprint;
+  return cachedSessionKeys( salts, id, fingerprint );
+}
+
+void Cryptor::setCacheTimeout( std::chrono::seconds timeout ) // static
+{
+  auto& cache = sessionCache();
+  std::lock_guard<std::mutex> lock{ cache.mutex };
+  cache.timeout = timeout;
+}
+
+void Cryptor::setAgentTimeout( std::chrono::milliseconds timeout ) // static
+{
+  auto& cache = sessionCache();
+  std::lock_guard<std::mutex> lock{ cache.mutex };
+  cache.agentTimeout = timeout;
+}
+
+std::chrono::milliseconds Cryptor::agentTimeout() // static
+{
+  auto& cache = sessionCache();
+  std::lock_guard<std::mutex> lock{ cache.mutex };
+  return cache.agentTimeout;
+}
+
+void Cryptor::clearCache() // static
+{
+  auto& cache = sessionCache();
+  std::lock_guard<std::mutex> lock{ cache.mutex };
+  cache.entries.clear();
+}
+
+Cryptor::Batch::Batch()
+{
+  auto& cache = sessionCache();
+  std::lock_guard<std::mutex> lock{ cache.mutex };
+  if( !cache.batchSalt.empty() )
+  {
+    throw std::runtime_error{ "batch already active" };
+  }
+  cache.batchSalt = makeRandom( saltSize );
+}
+
+Cryptor::Batch::~Batch()
+{
+  auto& cache = sessionCache();
+  std::lock_guard<std::mutex> agentLock{ cache.agentMutex }; // always before cache.mutex
+  cache.batchAgent.reset();
+  cache.batchIdentities.reset();
+
+  std::lock_guard<std::mutex> lock{ cache.mutex };
+  cache.batchSalt.clear();
+  cache.purge( SessionCache::Clock::now() );
 }
 
 struct PrivateHelper
 {
-  Data keyiv;
-  Data key;
-  Data iv;
+  SecureData keyiv;
+  SecureData key;
+  SecureData iv;
   SymCrypt aes;
 
   /*
@@ -93,7 +448,7 @@ struct PrivateHelper
 
 Data Cryptor::encrypt( const Data& plainData, const char* id )
 {
-  Data salt = makeRandom( 32 );
+  Data salt = makeRandom( saltSize );
   PrivateHelper helper{ salt, id };
   Data crypedData = helper.aes.encrypt( plainData );
 
@@ -105,12 +460,138 @@ Data Cryptor::encrypt( const Data& plainData, const char* id )
 Data Cryptor::decrypt( const Data& cryptedData, const char* id )
 {
   // first 32 bytes of crypedData is the salt
-  assert( cryptedData.size() >= 32 );
-  Data salt{ cryptedData.begin(), cryptedData.begin() + 32 };
+  assert( cryptedData.size() >= saltSize );
+  Data salt{ cryptedData.begin(), cryptedData.begin() + saltSize };
   PrivateHelper helper{ salt, id };
   // const int magiclen = static_cast<int>( helper.magic.size() );
   // Data test{ cryptedData.end() - magiclen, cryptedData.end() };
   // if( test != helper.magic ) { throw std::runtime_error{ "crypted data corrupted" }; }
-  return helper.aes.decrypt( Data{ cryptedData.begin() + 32, cryptedData.end() } );
+  return helper.aes.decrypt( Data{ cryptedData.begin() + saltSize, cryptedData.end() } );
+}
+
+void Cryptor::encrypt( std::istream& in,
+                       std::ostream& out,
+                       const char* id,
+                       const Options& options )
+{
+  if( !options.recipients.empty() )
+  {
+    if( options.version == 1 )
+      throw std::runtime_error{ "recipients need format version 2" };
+    auto header = Container::makeHeader( Container::envelopeVersion, options.segmentSize,
+                                         options.method, options.compression );
+    SecureData dataKey( Container::dataKeySize );
+    fillRandom( dataKey.data(), dataKey.size() );
+    for( const auto& recipient : options.recipients )
+    {
+      addRecipient( header, dataKey, recipient );
+    }
+    Container::encrypt( in, out, header, dataKey, options.threads );
+    return;
+  }
+
+  auto header = Container::makeHeader(
+      options.version, options.segmentSize, options.method, options.compression );
+  if( header.version > 1 )
+  {
+    header.salt = newSalt();
+    // the key, that signed, is named in the header, so decrypt finds it without an id
+    const auto sessionKeys = cachedSessionKeys( { header.salt }, id, header.fingerprint );
+    Container::encrypt( in, out, header, sessionKeys.front(), options.threads );
+    return;
+  }
+  Container::encrypt( in, out, header, getSessionKey( header.salt, id ), options.threads );
+}
+
+void Cryptor::encrypt( std::istream& in,
+                       std::ostream& out,
+                       const Session& session,
+                       const char* id,
+                       const Options& options )
+{
+  // version 1 takes key and iv from the salt alone, it needs a new one
+  if( session.header.version < 2 )
+  {
+    return encrypt( in, out, id, options );
+  }
+  auto header = session.header;
+  header.nonce = makeRandom( Container::nonceSize );
+  Container::encrypt( in, out, header, session.sessionKey, options.threads );
+}
+
+void Cryptor::decrypt( std::istream& in,
+                       std::ostream& out,
+                       const char* id,
+                       const Options& options )
+{
+  Session session;
+  decrypt( in, out, session, id, options );
+}
+
+void Cryptor::decrypt( std::istream& in,
+                       std::ostream& out,
+                       Session& session,
+                       const char* id,
+                       const Options& options )
+{
+  session.header = Container::readHeader( in );
+  session.sessionKey = fileKey( session.header, id );
+  Container::decrypt( in, out, session.header, session.sessionKey, options.threads );
+}
+
+void Cryptor::decryptRange( std::istream& in,
+                            std::ostream& out,
+                            Size offset,
+                            Size length,
+                            const char* id,
+                            const Options& options )
+{
+  const auto header = Container::readHeader( in );
+  // the key may take a confirmation or a touch, it isn't asked for a file, that can't be read
+  Container::checkRandomAccess( in, header );
+  const SecureData sessionKey = fileKey( header, id );
+  Container::decryptRange( in, out, header, sessionKey, offset, length, options.threads );
+}
+
+void Cryptor::rewrap( std::istream& in,
+                      std::ostream& out,
+                      const std::vector<std::string>& add,
+                      const std::vector<std::string>& remove,
+                      const char* id )
+{
+  const auto original = Container::readHeader( in );
+  if( original.version != Container::envelopeVersion )
+  {
+    throw std::runtime_error{ "recipients need a file encrypted for recipients" };
+  }
+
+  auto header = original;
+  auto& recipients = header.recipients;
+  for( const auto& fingerprint : remove )
+  {
+    const auto found = std::find_if(
+        recipients.begin(), recipients.end(), [ &fingerprint ]( const auto& recipient ) {
+          return recipient.fingerprint == fingerprint;
+        } );
+    if( found == recipients.end() )
+    {
+      throw std::runtime_error{ "the key to remove is no recipient of the file" };
+    }
+    recipients.erase( found );
+  }
+  if( !add.empty() )
+  {
+    // the removed recipient may be the one of the agent
+    const SecureData dataKey = openEnvelope( original, id );
+    for( const auto& fingerprint : add )
+    {
+      addRecipient( header, dataKey, fingerprint );
+    }
+  }
+  if( recipients.empty() )
+  {
+    throw std::runtime_error{ "no recipient left" };
+  }
+  Container::replaceHeader( in, out, header );
 }
 } // namespace SshCrypt
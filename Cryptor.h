@@ -1,10 +1,27 @@
 // SPDX-License-Identifier: MIT
 
 #pragma once
+#include "Container.h"
 #include "Data.h"
+#include "SymCrypt.h"
+
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <vector>
 
 namespace SshCrypt
 {
+struct CryptOptions
+{
+  int version = 2;                                  // file format written by encrypt
+  unsigned threads = 0;                             // 0 is one thread per core
+  Size segmentSize = Container::defaultSegmentSize; // for version 2
+  SymCrypt::Method method = SymCrypt::Method::AES256GCM; // for version 2
+  Container::Compression compression = Container::Compression::None; // for version 2
+  std::vector<std::string> recipients; // fingerprints, envelope encryption if not empty
+};
+
 class Cryptor
 {
 public:
@@ -17,8 +34,84 @@ public:
   };
 
   static std::vector<Key> getAvailableKeys();
-  static Data getSessionKey( const Data& salt, const char* id );
+  static SecureData getSessionKey( const Data& salt, const char* id );
+  //! the session keys for many salts in about one agent round trip (see AgentPool)
+  static std::vector<SecureData> getSessionKeys( const std::vector<Data>& salts,
+                                                 const char* id );
   static Data encrypt( const Data&, const char* id = nullptr );
   static Data decrypt( const Data&, const char* id = nullptr );
+
+  // optional in-process cache of session keys by identity and salt, off by default
+  static void setCacheTimeout( std::chrono::seconds timeout ); // 0 disables
+  static void clearCache();
+
+  //! a request, that the agent doesn't answer within \a timeout, fails, 0 waits forever
+  static void setAgentTimeout( std::chrono::milliseconds timeout );
+  static std::chrono::milliseconds agentTimeout();
+
+  //! while a Batch exists, version 2 files are encrypted with one shared salt, so the whole
+  //! batch needs a single agent signature, the nonce of each file keeps the keys apart.
+  //! All requests of the batch share one agent connection.
+  class Batch
+  {
+  public:
+    Batch();
+    ~Batch();
+    Batch( const Batch& ) = delete;
+    Batch& operator=( const Batch& ) = delete;
+  };
+
+  using Options = CryptOptions;
+
+  // streaming en- and decryption of the complete file format (see Container),
+  // memory usage is bounded by the chunk or segment size. With options.recipients the
+  // file is encrypted for each of them (version 4) instead of for \a id, their keys must
+  // be in the agent.
+  static void encrypt( std::istream& in,
+                       std::ostream& out,
+                       const char* id = nullptr,
+                       const Options& options = Options{} );
+  static void decrypt( std::istream& in,
+                       std::ostream& out,
+                       const char* id = nullptr,
+                       const Options& options = Options{} );
+
+  //! header and session key of a decrypted file, encrypting with it again keeps the
+  //! salt, format and method, takes a new nonce and doesn't ask the agent
+  struct Session
+  {
+    Container::Header header;
+    SecureData sessionKey; // the data key of version 4
+  };
+
+  //! a version 1 session has no nonce, it is encrypted like without one
+  static void encrypt( std::istream& in,
+                       std::ostream& out,
+                       const Session& session,
+                       const char* id = nullptr,
+                       const Options& options = Options{} );
+  static void decrypt( std::istream& in,
+                       std::ostream& out,
+                       Session& session,
+                       const char* id = nullptr,
+                       const Options& options = Options{} );
+
+  //! decrypts the plain bytes [ offset, offset + length ) of a seekable version 2 file,
+  //! only the segments holding them are read (see Container::decryptRange)
+  static void decryptRange( std::istream& in,
+                            std::ostream& out,
+                            Size offset,
+                            Size length,
+                            const char* id = nullptr,
+                            const Options& options = Options{} );
+
+  //! writes a version 4 file with the recipients \a add added and \a remove removed, the
+  //! segments are copied. New recipients need their key in the agent, the data key is
+  //! decrypted with \a id or any key of the agent, that is a recipient.
+  static void rewrap( std::istream& in,
+                      std::ostream& out,
+                      const std::vector<std::string>& add,
+                      const std::vector<std::string>& remove,
+                      const char* id = nullptr );
 };
 } // namespace SshCrypt
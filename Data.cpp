@@ -1,20 +1,35 @@
 // SPDX-License-Identifier: MIT
 
 #include "Data.h"
+#include "Base64.h"
+#include "Hex.h"
 
+#include <algorithm>
 #include <cassert>
+#include <cctype>
+#include <cerrno>
 #include <chrono>
+#include <cstring>
+#include <fcntl.h>
 #include <fstream>
 #include <iostream>
-#include <random>
-#include <sstream>
+#include <openssl/crypto.h>
+#include <openssl/rand.h>
 #include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 namespace SshCrypt
 {
-std::string toString( const Data& bytes )
+bool operator==( DataView a, DataView b )
 {
-  return std::string( std::begin( bytes ), std::end( bytes ) );
+  return a.size() == b.size() && ( a.empty() || memcmp( a.data(), b.data(), a.size() ) == 0 );
+}
+
+std::string toString( DataView bytes )
+{
+  return std::string( bytes.begin(), bytes.end() );
 }
 
 Data fromString( const std::string& text )
@@ -22,146 +37,134 @@ Data fromString( const std::string& text )
   return Data( std::begin( text ), std::end( text ) );
 }
 
-std::string toHex( const Data& bytes, const char* separator )
+std::string toHex( DataView bytes, const char* separator )
 {
-  static const char hexdigit[] = "0123456789abcdef";
-  static_assert( sizeof hexdigit == 17, "16 hexdigits" );
+  const Size separatorLength = separator ? strlen( separator ) : 0;
+  std::string result( Hex::encodedSize( bytes.size(), separatorLength ), '\0' );
+  Hex::encode( bytes.data(), bytes.size(), separator, &result[ 0 ] );
+  return result;
+}
 
-  bool first = true;
-  std::stringstream str;
-  for( Byte val : bytes )
-  {
-    if( first )
-      first = false;
-    else if( separator )
-      str << separator;
+std::string toBase64( const Data& bytes, bool padding )
+{
+  std::string result( Base64::encodedSize( bytes.size(), padding ), '=' );
+  Base64::Encoder encoder;
+  Size length = encoder.update( bytes.data(), bytes.size(), &result[ 0 ] );
+  length += encoder.finish( &result[ length ], padding );
+  assert( length == result.size() );
+  return result;
+}
 
-    str << hexdigit[ ( val >> 4 ) & 0xf ];
-    str << hexdigit[ val & 0xf ];
-  }
-  return str.str();
+Data fromBase64( const std::string& ascii )
+{
+  Data result( Base64::maxDecodedSize( ascii.size() ) );
+  Base64::Decoder decoder;
+  result.resize( decoder.update( ascii.data(), ascii.size(), result.data() ) );
+  return result;
 }
 
-/* Base 64 from wikipedia:
- *
- * Use A-Z, a-z, 0-9, '+' and '/' as digits, fill with '='.
- *
- * |    Byte 1     |    Byte 2     |    Byte 3     |
- * |7|6|5|4|3|2|1|0|7|6|5|4|3|2|1|0|7|6|5|4|3|2|1|0|
- *
- * |5|4|3|2|1|0|5|4|3|2|1|0|5|4|3|2|1|0|5|4|3|2|1|0|
- * |  Char 1   |  Char 2   |  Char 3   |  Char 3   |
- */
+Data fromHex( const std::string& ascii )
+{
+  Data result( Hex::Decoder::maxDecodedSize( ascii.size() ) );
+  Hex::Decoder decoder;
+  result.resize( decoder.update( ascii.data(), ascii.size(), result.data() ) );
+  decoder.finish();
+  return result;
+}
 
-std::string toBase64( const Data& bytes, bool padding )
+namespace
 {
-  static const char base64digit[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
-                                    "abcdefghijklmnopqrstuvwxyz"
-                                    "0123456789+/";
-  static_assert( sizeof base64digit == 65, "64 base64 digits" );
-  constexpr unsigned int mask = 0x3fu;
-
-  /*
-   * Ori Pad NoPad
-   * 0   0   0
-   * 1   4   2
-   * 2   4   3
-   * 3   4   4
-   * 4   8   6
-   * 5   8   8
-   */
-  Size base64Length;
-  if( padding )
-  {
-    base64Length = ( ( ( ( bytes.size() + 2 ) ) / 3 ) * 4 );
-  }
-  else
-  {
-    base64Length = bytes.size() / 3 * 4;
-    switch( bytes.size() % 3 )
+//! bytes of the OpenSSL CSPRNG, fetched in blocks, so a salt or a nonce is mostly a copy.
+//! Every thread has its own block, a forked child throws the parent's block away, it
+//! would repeat its bytes otherwise.
+class RandomPool
+{
+public:
+  ~RandomPool() { OPENSSL_cleanse( block, sizeof block ); }
+
+  void fill( Byte* out, Size size )
+  {
+    if( owner != getpid() )
+    {
+      owner = getpid();
+      pos = blockSize;
+    }
+    if( size >= blockSize )
     {
-    case 0: break;
-    case 1: base64Length += 2; break;
-    case 2: base64Length += 3; break;
+      generate( out, size );
+      return;
+    }
+    while( size > 0 )
+    {
+      if( pos == blockSize )
+      {
+        generate( block, blockSize );
+        pos = 0;
+      }
+      const Size piece = std::min( size, blockSize - pos );
+      memcpy( out, block + pos, piece );
+      OPENSSL_cleanse( block + pos, piece ); // handed out once
+      pos += piece;
+      out += piece;
+      size -= piece;
     }
   }
-  std::string result( base64Length, '=' );
-  size_t pos = 0;
-  int bits = 0;
-  Size accu = 0;
 
-  for( auto b : bytes )
+private:
+  static constexpr Size blockSize = 4096;
+
+  Byte block[ blockSize ];
+  Size pos = blockSize;
+  pid_t owner = 0;
+
+  static void generate( Byte* out, Size size )
   {
-    accu = ( accu << 8 ) | ( b & 0xffu );
-    bits += 8;
-    while( bits >= 6 )
+    constexpr Size maxRequest = 1 << 30;
+    for( Size done = 0; done < size; done += maxRequest )
     {
-      bits -= 6;
-      result[ pos++ ] = base64digit[ ( accu >> bits ) & mask ];
+      const Size piece = std::min( maxRequest, size - done );
+      if( RAND_bytes( out + done, static_cast<int>( piece ) ) != 1 )
+      {
+        throw std::runtime_error{ "RAND_bytes failed" };
+      }
     }
   }
-  if( bits > 0 )
-  {
-    assert( bits < 6 );
-    accu <<= ( 6 - bits );
-    result[ pos++ ] = base64digit[ accu & mask ];
-  }
+};
 
-  return result;
-}
+thread_local RandomPool randomPool;
+} // namespace
 
-Data fromBase64( const std::string& ascii )
+void fillRandom( Byte* data, Size size )
 {
-#define XX 64
-  static const Byte asciiTable[ 128 ]
-      = { XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,   // 0x00-0x0f
-          XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,   // 0x10-0x1f
-          XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, 62, XX, XX, XX, 63,   // 0x20-0x2f
-          52, 53, 54, 55, 56, 57, 58, 59, 60, 61, XX, XX, XX, XX, XX, XX,   // 0x30-0x3f
-          XX, 0,  1,  2,  3,  4,  5,  6,  7,  8,  9,  10, 11, 12, 13, 14,   // 0x40-0x4f
-          15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, XX, XX, XX, XX, XX,   // 0x50-0x5f
-          XX, 26, 27, 28, 29, 30, 31, 32, 33, 34, 35, 36, 37, 38, 39, 40,   // 0x60-0x6f
-          41, 42, 43, 44, 45, 46, 47, 48, 49, 50, 51, XX, XX, XX, XX, XX }; // 0x70-0x7f
-
-  auto maximumLength = ascii.size() * 3 / 4 + 1;
-  Data result;
-  result.reserve( maximumLength );
-  int bits = 0;
-  Size accu = 0;
-
-  for( int c : ascii )
-  {
-    if( std::isspace( c ) || c == '=' )
-      continue;
-    if( c < 0x2b || c > 0x7a || asciiTable[ c ] > 63 )
-      throw std::invalid_argument{ "illegal character" };
-
-    accu = ( accu << 6 ) | asciiTable[ c ];
-    bits += 6;
-    if( bits >= 8 )
-    {
-      bits -= 8;
-      result.push_back( ( accu >> bits ) & 0xffu );
-    }
-  }
-  return result;
+  randomPool.fill( data, size );
 }
 
 Data makeRandom( Size size, Byte min, Byte max )
 {
-  Data data;
-  data.resize( size );
-
-  std::mt19937 randomEngine;
-  randomEngine.seed( static_cast<std::mt19937::result_type>(
-      std::chrono::system_clock::now().time_since_epoch().count() ) );
+  Data data( size );
+  fillRandom( data.data(), size );
+  if( min == 0 && max == 0xffu )
+  {
+    return data;
+  }
+  if( min > max )
+  {
+    throw std::invalid_argument{ "makeRandom: min greater than max" };
+  }
 
-  std::uniform_int_distribution<Byte> randomDistribution{ min, max };
+  // bytes beyond the largest multiple of the range are drawn again, a plain modulo
+  // would prefer the small values
+  const unsigned range = max - min + 1u;
+  const unsigned limit = 256u - 256u % range;
   for( Size pos = 0; pos < size; ++pos )
   {
-    data[ pos ] = randomDistribution( randomEngine );
+    Byte value = data[ pos ];
+    while( value >= limit )
+    {
+      fillRandom( &value, 1 );
+    }
+    data[ pos ] = static_cast<Byte>( min + value % range );
   }
-
   return data;
 }
 
@@ -171,22 +174,42 @@ Data loadFile( const char* filename, ReadMode readMode )
   {
     return readData( std::cin, readMode );
   }
-  std::ifstream file{ filename };
+  if( MappedFile::isRegular( filename ) )
+  {
+    MappedFile file{ filename };
+    std::istream in{ file.rdbuf() };
+    return readData( in, readMode );
+  }
+  std::ifstream file{ filename, std::ios::binary };
   return readData( file, readMode );
 }
 
 Data readData( std::istream& in, ReadMode readMode )
 {
-  std::istreambuf_iterator<char> iter( in.rdbuf() );
-  std::istreambuf_iterator<char> eos;
-  Data data{ iter, eos };
+  constexpr Size blockSize = 1024 * 1024;
+  Data data;
+  for( ;; )
+  {
+    const Size offset = data.size();
+    data.resize( offset + blockSize );
+    in.read( reinterpret_cast<char*>( data.data() + offset ), blockSize );
+    data.resize( offset + static_cast<Size>( in.gcount() ) );
+    if( !in )
+      break;
+  }
+
   switch( readMode )
   {
   case ReadMode::Raw: break;
   case ReadMode::Base64: data = fromBase64( toString( data ) ); break;
+  case ReadMode::Hex: data = fromHex( toString( data ) ); break;
   case ReadMode::Auto:
     try
     {
+      if( detectReadMode( data ) == ReadMode::Hex )
+      {
+        return fromHex( toString( data ) );
+      }
       return fromBase64( toString( data ) );
     }
     catch( const std::invalid_argument& )
@@ -204,6 +227,37 @@ void saveFile( const Data& data, const char* filename, WriteMode writeMode )
   {
     return writeData( data, std::cout, writeMode );
   }
+
+  if( writeMode == WriteMode::Raw )
+  {
+    // one large write instead of going through the stream buffer
+    int fd = open( filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666 );
+    if( fd == -1 )
+    {
+      throw std::runtime_error{ "can't open output file" };
+    }
+    const Byte* pos = data.data();
+    Size left = data.size();
+    while( left > 0 )
+    {
+      const ssize_t written = write( fd, pos, left );
+      if( written < 0 && errno == EINTR )
+        continue;
+      if( written <= 0 )
+      {
+        close( fd );
+        throw std::runtime_error{ "write failed" };
+      }
+      pos += written;
+      left -= static_cast<Size>( written );
+    }
+    if( close( fd ) != 0 )
+    {
+      throw std::runtime_error{ "write failed" };
+    }
+    return;
+  }
+
   std::ofstream file{ filename };
   writeData( data, file, writeMode );
 }
@@ -213,32 +267,147 @@ void writeData( const Data& data, std::ostream& out, WriteMode writeMode )
   switch( writeMode )
   {
   case WriteMode::Raw:
+    out.write( reinterpret_cast<const char*>( data.data() ),
+               static_cast<std::streamsize>( data.size() ) );
+    break;
+  case WriteMode::Base64:
   {
-    std::ostreambuf_iterator<char> outIter( out );
-    std::copy( data.begin(), data.end(), outIter );
+    ArmorWriter armor{ out };
+    armor.sputn( reinterpret_cast<const char*>( data.data() ),
+                 static_cast<std::streamsize>( data.size() ) );
+    armor.finish();
   }
   break;
-  case WriteMode::Base64:
+  case WriteMode::Hex:
   {
-    std::string base64 = toBase64( data );
-    int len = 0;
-    for( auto c : base64 )
-    {
-      out << c;
-      ++len;
-      if( len >= 72 )
-      {
-        out << std::endl;
-        len = 0;
-      }
-    }
-    if( len )
+    HexWriter hex{ out };
+    hex.sputn( reinterpret_cast<const char*>( data.data() ),
+               static_cast<std::streamsize>( data.size() ) );
+    hex.finish();
+  }
+  break;
+  }
+}
+
+MappedFile::MappedFile( const char* filename )
+{
+  int fd = open( filename, O_RDONLY | O_CLOEXEC );
+  if( fd == -1 )
+  {
+    throw std::runtime_error{ "can't open input file" };
+  }
+
+  struct stat fileStat;
+  if( fstat( fd, &fileStat ) != 0 || !S_ISREG( fileStat.st_mode ) )
+  {
+    close( fd );
+    throw std::runtime_error{ "not a regular file" };
+  }
+
+  length = static_cast<Size>( fileStat.st_size );
+  if( length > 0 )
+  {
+    void* address = mmap( nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0 );
+    if( address == MAP_FAILED )
     {
-      out << std::endl;
+      close( fd );
+      throw std::runtime_error{ "can't map input file" };
     }
+    mapped = static_cast<Byte*>( address );
+    madvise( address, length, MADV_SEQUENTIAL );
   }
-  break;
+  close( fd );
+
+  char* begin = reinterpret_cast<char*>( mapped );
+  buffer.set( begin, begin + length );
+}
+
+MappedFile::~MappedFile()
+{
+  if( mapped )
+  {
+    munmap( mapped, length );
+  }
+}
+
+MappedFile::Buffer::pos_type MappedFile::Buffer::seekoff( off_type offset,
+                                                         std::ios_base::seekdir dir,
+                                                         std::ios_base::openmode )
+{
+  const off_type size = egptr() - eback();
+  off_type position = offset;
+  if( dir == std::ios_base::cur )
+    position += gptr() - eback();
+  else if( dir == std::ios_base::end )
+    position += size;
+  if( position < 0 || position > size )
+    return pos_type( off_type( -1 ) );
+  setg( eback(), eback() + position, egptr() );
+  return pos_type( position );
+}
+
+MappedFile::Buffer::pos_type MappedFile::Buffer::seekpos( pos_type position,
+                                                         std::ios_base::openmode mode )
+{
+  return seekoff( off_type( position ), std::ios_base::beg, mode );
+}
+
+bool MappedFile::isRegular( const char* filename ) // static
+{
+  struct stat fileStat;
+  return stat( filename, &fileStat ) == 0 && S_ISREG( fileStat.st_mode );
+}
+
+//! guess if \a head is the beginning of hex, base64 or raw data, hex digits are base64
+//! digits as well, but base64 of anything but a few bytes has other ones, too
+ReadMode detectReadMode( const Data& head )
+{
+  if( head.empty() )
+    return ReadMode::Raw;
+
+  bool hex = true;
+  bool digits = false;
+  for( int c : head )
+  {
+    if( std::isxdigit( c ) )
+      digits = true;
+    else if( !std::isspace( c ) )
+      hex = false;
+    if( !std::isalnum( c ) && !std::isspace( c ) && c != '+' && c != '/' && c != '=' )
+      return ReadMode::Raw;
+  }
+  return hex && digits ? ReadMode::Hex : ReadMode::Base64;
+}
+
+ReplayBuffer::ReplayBuffer( Data theHead, std::streambuf* theSource ) :
+    head{ std::move( theHead ) }, source{ theSource }
+{
+  char* begin = reinterpret_cast<char*>( head.data() );
+  setg( begin, begin, begin + head.size() );
+}
+
+ReplayBuffer::int_type ReplayBuffer::underflow()
+{
+  // head is consumed, continue char by char from source
+  const int_type c = source->sbumpc();
+  if( traits_type::eq_int_type( c, traits_type::eof() ) )
+    return c;
+
+  current = traits_type::to_char_type( c );
+  setg( &current, &current, &current + 1 );
+  return c;
+}
+
+std::streamsize ReplayBuffer::xsgetn( char* buffer, std::streamsize count )
+{
+  std::streamsize done = std::min( count, static_cast<std::streamsize>( egptr() - gptr() ) );
+  std::copy( gptr(), gptr() + done, buffer );
+  gbump( static_cast<int>( done ) );
+  if( done < count )
+  {
+    done += source->sgetn( buffer + done, count - done );
   }
+  return done;
 }
 
 } /* namespace SshCrypt */
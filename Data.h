@@ -2,6 +2,8 @@
 
 #pragma once
 
+#include "SecureMemory.h"
+
 #include <iostream>
 #include <string>
 // #include <tuple>
@@ -13,6 +15,7 @@ enum class ReadMode
 {
   Raw,
   Base64,
+  Hex,
   Auto
 };
 
@@ -20,22 +23,109 @@ enum class WriteMode
 {
   Raw,
   Base64,
+  Hex,
 };
 
 using Byte = unsigned char;
 using Data = std::vector<Byte>;
 using Size = Data::size_type;
+//! for keys and plain data, locked into ram and wiped when freed (see SecureArena)
+using SecureData = std::vector<Byte, SecureAllocator<Byte>>;
 
-std::string toString( const Data& );
-std::string toHex( const Data&, const char* separator = nullptr );
+//! bytes owned by someone else, e.g. a blob inside a received message, like
+//! std::string_view it must not outlive them
+class DataView
+{
+public:
+  DataView() = default;
+  DataView( const Byte* theData, Size theSize ) : bytes{ theData }, length{ theSize } {}
+  template <class Allocator>
+  DataView( const std::vector<Byte, Allocator>& data ) :
+      bytes{ data.data() }, length{ data.size() }
+  {
+  }
+
+  const Byte* data() const { return bytes; }
+  Size size() const { return length; }
+  bool empty() const { return length == 0; }
+  const Byte* begin() const { return bytes; }
+  const Byte* end() const { return bytes + length; }
+  Byte operator[]( Size index ) const { return bytes[ index ]; }
+  Data toData() const { return Data( begin(), end() ); }
+
+private:
+  const Byte* bytes = nullptr;
+  Size length = 0;
+};
+
+bool operator==( DataView, DataView );
+inline bool operator!=( DataView a, DataView b )
+{
+  return !( a == b );
+}
+
+std::string toString( DataView );
+std::string toHex( DataView, const char* separator = nullptr );
 std::string toBase64( const Data&, bool padding = true );
+//! from the OpenSSL CSPRNG, uniform in [ min, max ]
 Data makeRandom( Size size, Byte min = 0, Byte max = 0xffu );
+void fillRandom( Byte* data, Size size );
 Data fromString( const std::string& );
 Data fromBase64( const std::string& );
+Data fromHex( const std::string& );
 Data loadFile( const char* filename, ReadMode mode = ReadMode::Auto );
 Data readData( std::istream&, ReadMode mode = ReadMode::Auto );
 void saveFile( const Data&, const char* filename, WriteMode mode = WriteMode::Raw );
 void writeData( const Data&, std::ostream&, WriteMode mode = WriteMode::Raw );
+ReadMode detectReadMode( const Data& head );
+
+//! read-only view of a whole regular file, mapped into memory
+class MappedFile
+{
+public:
+  explicit MappedFile( const char* filename );
+  ~MappedFile();
+  MappedFile( const MappedFile& ) = delete;
+  MappedFile& operator=( const MappedFile& ) = delete;
+
+  static bool isRegular( const char* filename );
+
+  const Byte* data() const { return mapped; }
+  Size size() const { return length; }
+  //! for an istream reading straight from the mapping
+  std::streambuf* rdbuf() { return &buffer; }
+
+private:
+  struct Buffer : std::streambuf
+  {
+    void set( char* begin, char* end ) { setg( begin, begin, end ); }
+
+  protected:
+    pos_type
+    seekoff( off_type offset, std::ios_base::seekdir dir, std::ios_base::openmode ) override;
+    pos_type seekpos( pos_type position, std::ios_base::openmode mode ) override;
+  };
+
+  Byte* mapped = nullptr;
+  Size length = 0;
+  Buffer buffer;
+};
+
+//! stream buffer, that returns \a head before continuing with \a source
+class ReplayBuffer : public std::streambuf
+{
+public:
+  ReplayBuffer( Data theHead, std::streambuf* theSource );
+
+protected:
+  int_type underflow() override;
+  std::streamsize xsgetn( char* buffer, std::streamsize count ) override;
+
+private:
+  Data head;
+  std::streambuf* source = nullptr;
+  char current = 0;
+};
 
 inline std::ostream& operator<<( std::ostream& out, const Data& bytes )
 {
@@ -0,0 +1,341 @@
+// SPDX-License-Identifier: MIT
+
+#include "Hex.h"
+
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <stdexcept>
+
+#if defined( __x86_64__ ) || defined( __i386__ )
+#include <immintrin.h>
+#define SSHCRYPT_HEX_X86
+#endif
+
+/* The vector kernels look up both nibbles of 16 bytes at once with pshufb and interleave
+ * them, decoding checks the digit ranges and joins the nibble pairs with a multiply-add.
+ */
+
+namespace SshCrypt
+{
+namespace
+{
+const char hexdigit[] = "0123456789abcdef";
+static_assert( sizeof hexdigit == 17, "16 hexdigits" );
+
+//! both digits of every byte
+const std::array<char, 512> hexPairs = []() {
+  std::array<char, 512> pairs{};
+  for( Size value = 0; value < 256; ++value )
+  {
+    pairs[ 2 * value ] = hexdigit[ value >> 4 ];
+    pairs[ 2 * value + 1 ] = hexdigit[ value & 0xf ];
+  }
+  return pairs;
+}();
+
+//! -1 for anything but a digit
+int digitValue( char c )
+{
+  if( c >= '0' && c <= '9' )
+    return c - '0';
+  const char lower = static_cast<char>( c | 0x20 );
+  if( lower >= 'a' && lower <= 'f' )
+    return lower - 'a' + 10;
+  return -1;
+}
+
+bool isSpace( char c )
+{
+  return c == ' ' || c == '\n' || c == '\r' || c == '\t' || c == '\v' || c == '\f';
+}
+
+#if defined( SSHCRYPT_HEX_X86 )
+
+//! returns the number of bytes consumed, a multiple of 16
+__attribute__( ( target( "ssse3" ) ) ) Size encodeSsse3( const Byte* in, Size size, char* out )
+{
+  const __m128i digits = _mm_loadu_si128( reinterpret_cast<const __m128i*>( hexdigit ) );
+  const __m128i nibble = _mm_set1_epi8( 0x0f );
+  Size done = 0;
+  for( ; size - done >= 16; done += 16, out += 32 )
+  {
+    const __m128i block = _mm_loadu_si128( reinterpret_cast<const __m128i*>( in + done ) );
+    const __m128i high
+        = _mm_shuffle_epi8( digits, _mm_and_si128( _mm_srli_epi16( block, 4 ), nibble ) );
+    const __m128i low = _mm_shuffle_epi8( digits, _mm_and_si128( block, nibble ) );
+    _mm_storeu_si128( reinterpret_cast<__m128i*>( out ), _mm_unpacklo_epi8( high, low ) );
+    _mm_storeu_si128( reinterpret_cast<__m128i*>( out + 16 ), _mm_unpackhi_epi8( high, low ) );
+  }
+  return done;
+}
+
+// lanes of \a in between \a first and \a last, bytes above 0x7f are negative and never match
+__attribute__( ( target( "ssse3" ) ) ) __m128i rangeSsse3( __m128i in, char first, char last )
+{
+  return _mm_and_si128( _mm_cmpgt_epi8( in, _mm_set1_epi8( static_cast<char>( first - 1 ) ) ),
+                        _mm_cmpgt_epi8( _mm_set1_epi8( static_cast<char>( last + 1 ) ), in ) );
+}
+
+//! returns the number of characters consumed, stops at the first block with a character
+//! that is no digit and sets \a validPrefix to the digits in front of it
+__attribute__( ( target( "ssse3" ) ) ) Size decodeSsse3( const char* in,
+                                                          Size size,
+                                                          Byte* out,
+                                                          Size& validPrefix )
+{
+  Size done = 0;
+  for( ; size - done >= 16; done += 16, out += 8 )
+  {
+    const __m128i block = _mm_loadu_si128( reinterpret_cast<const __m128i*>( in + done ) );
+    const __m128i folded = _mm_or_si128( block, _mm_set1_epi8( 0x20 ) );
+    const __m128i digit = rangeSsse3( block, '0', '9' );
+    const __m128i letter = rangeSsse3( folded, 'a', 'f' );
+    const int validMask = _mm_movemask_epi8( _mm_or_si128( digit, letter ) );
+    if( validMask != 0xffff )
+    {
+      validPrefix = static_cast<Size>( __builtin_ctz( ~static_cast<unsigned>( validMask ) ) );
+      break;
+    }
+
+    const __m128i values = _mm_or_si128(
+        _mm_and_si128( digit, _mm_sub_epi8( block, _mm_set1_epi8( '0' ) ) ),
+        _mm_and_si128( letter, _mm_sub_epi8( folded, _mm_set1_epi8( 'a' - 10 ) ) ) );
+    // high * 16 + low in every 16 bit lane
+    const __m128i words = _mm_maddubs_epi16( values, _mm_set1_epi16( 0x0110 ) );
+    _mm_storel_epi64( reinterpret_cast<__m128i*>( out ), _mm_packus_epi16( words, words ) );
+  }
+  return done;
+}
+
+#endif
+
+Size decodeBlocks( Hex::Kernel kernel, const char* in, Size size, Byte* out, Size& validPrefix )
+{
+  validPrefix = 0;
+#if defined( SSHCRYPT_HEX_X86 )
+  if( kernel == Hex::Kernel::Ssse3 )
+    return decodeSsse3( in, size, out, validPrefix );
+#else
+  (void)kernel;
+  (void)in;
+  (void)size;
+  (void)out;
+#endif
+  return 0;
+}
+} // namespace
+
+Hex::Kernel Hex::bestKernel() // static
+{
+#if defined( SSHCRYPT_HEX_X86 )
+  static const Kernel best = []() {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports( "ssse3" ) ? Kernel::Ssse3 : Kernel::Scalar;
+  }();
+  return best;
+#else
+  return Kernel::Scalar;
+#endif
+}
+
+const char* Hex::kernelName( Kernel kernel ) // static
+{
+  switch( kernel )
+  {
+  case Kernel::Scalar: return "scalar";
+  case Kernel::Ssse3: return "ssse3";
+  }
+  return "unknown";
+}
+
+Size Hex::encodedSize( Size size, Size separatorLength ) // static
+{
+  return size == 0 ? 0 : size * 2 + ( size - 1 ) * separatorLength;
+}
+
+void Hex::encode( const Byte* data, Size size, char* out, Kernel kernel ) // static
+{
+  Size done = 0;
+#if defined( SSHCRYPT_HEX_X86 )
+  if( kernel == Kernel::Ssse3 )
+    done = encodeSsse3( data, size, out );
+#else
+  (void)kernel;
+#endif
+  for( ; done < size; ++done )
+  {
+    memcpy( out + 2 * done, &hexPairs[ 2 * data[ done ] ], 2 );
+  }
+}
+
+void Hex::encode( const Byte* data, Size size, const char* separator, char* out ) // static
+{
+  const Size separatorLength = separator ? strlen( separator ) : 0;
+  if( separatorLength == 0 )
+  {
+    return encode( data, size, out );
+  }
+  for( Size pos = 0; pos < size; ++pos )
+  {
+    if( pos > 0 )
+    {
+      memcpy( out, separator, separatorLength );
+      out += separatorLength;
+    }
+    memcpy( out, &hexPairs[ 2 * data[ pos ] ], 2 );
+    out += 2;
+  }
+}
+
+Hex::Decoder::Decoder( Kernel theKernel ) : kernel{ theKernel } {}
+
+Size Hex::Decoder::update( const char* text, Size size, Byte* out )
+{
+  Byte* const begin = out;
+  const char* const end = text + size;
+
+  const auto decodeChar = [ this, &out ]( char c ) {
+    const int value = digitValue( c );
+    if( value < 0 )
+    {
+      if( isSpace( c ) )
+        return;
+      throw std::invalid_argument{ "illegal character" };
+    }
+
+    if( high < 0 )
+    {
+      high = value;
+    }
+    else
+    {
+      *out++ = static_cast<Byte>( high << 4 | value );
+      high = -1;
+    }
+  };
+
+  while( text != end )
+  {
+    // the kernel decodes pairs of digits, so only without a digit left over
+    Size scalarCount = 1;
+    if( high < 0 )
+    {
+      Size validPrefix;
+      const Size done = decodeBlocks( kernel, text, static_cast<Size>( end - text ), out,
+                                      validPrefix );
+      text += done;
+      out += done / 2;
+      scalarCount = validPrefix + 1;
+    }
+
+    for( ; text != end && ( scalarCount > 0 || high >= 0 ); ++text )
+    {
+      decodeChar( *text );
+      if( scalarCount > 0 )
+        --scalarCount;
+    }
+  }
+  return static_cast<Size>( out - begin );
+}
+
+void Hex::Decoder::finish()
+{
+  if( high >= 0 )
+  {
+    high = -1;
+    throw std::invalid_argument{ "odd number of hex digits" };
+  }
+}
+
+HexWriter::HexWriter( std::ostream& theSink ) : sink{ theSink }, input( inputSize )
+{
+  encoded.resize( Hex::encodedSize( inputSize ) );
+  lines.reserve( inputSize * 2 + inputSize * 2 / lineLength + 1 );
+  setp( input.data(), input.data() + input.size() );
+}
+
+void HexWriter::finish()
+{
+  encodeInput();
+  if( column > 0 )
+  {
+    sink.put( '\n' );
+    column = 0;
+  }
+  if( !sink )
+  {
+    throw std::runtime_error{ "can't write hex output" };
+  }
+}
+
+HexWriter::int_type HexWriter::overflow( int_type c )
+{
+  encodeInput();
+  if( !traits_type::eq_int_type( c, traits_type::eof() ) )
+  {
+    *pptr() = traits_type::to_char_type( c );
+    pbump( 1 );
+  }
+  return traits_type::not_eof( c );
+}
+
+int HexWriter::sync()
+{
+  encodeInput();
+  return sink ? 0 : -1;
+}
+
+void HexWriter::encodeInput()
+{
+  const Size size = static_cast<Size>( pptr() - pbase() );
+  Hex::encode( reinterpret_cast<const Byte*>( pbase() ), size, &encoded[ 0 ] );
+  setp( input.data(), input.data() + input.size() );
+
+  const char* chars = encoded.data();
+  Size left = size * 2;
+  while( left > 0 )
+  {
+    const Size piece = std::min( left, lineLength - column );
+    lines.append( chars, piece );
+    chars += piece;
+    left -= piece;
+    column += piece;
+    if( column == lineLength )
+    {
+      lines.push_back( '\n' );
+      column = 0;
+    }
+  }
+  sink.write( lines.data(), static_cast<std::streamsize>( lines.size() ) );
+  lines.clear();
+}
+
+HexReader::HexReader( std::streambuf* theSource ) :
+    source{ theSource }, text( chunkSize ), decoded( Hex::Decoder::maxDecodedSize( chunkSize ) )
+{
+}
+
+HexReader::int_type HexReader::underflow()
+{
+  for( ;; )
+  {
+    const std::streamsize length
+        = source->sgetn( text.data(), static_cast<std::streamsize>( text.size() ) );
+    if( length <= 0 )
+    {
+      decoder.finish();
+      return traits_type::eof();
+    }
+
+    const Size size
+        = decoder.update( text.data(), static_cast<Size>( length ), decoded.data() );
+    if( size > 0 )
+    {
+      char* begin = reinterpret_cast<char*>( decoded.data() );
+      setg( begin, begin, begin + size );
+      return traits_type::to_int_type( *begin );
+    }
+  }
+}
+} // namespace SshCrypt
@@ -0,0 +1,109 @@
+// SPDX-License-Identifier: MIT
+
+#pragma once
+
+#include "Data.h"
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+namespace SshCrypt
+{
+/*! \class Hex
+ *
+ * hex en- and decoding, like Base64 with a vectorized kernel that is chosen at runtime.
+ * The output is sized up front, no stream is involved. The Decoder keeps a digit
+ * between calls, so the text may be passed in pieces of any size.
+ */
+class Hex
+{
+public:
+  Hex() = delete;
+
+  enum class Kernel
+  {
+    Scalar,
+    Ssse3
+  };
+
+  //! the fastest kernel this cpu supports
+  static Kernel bestKernel();
+  static const char* kernelName( Kernel );
+
+  //! with \a separatorLength characters between two bytes
+  static Size encodedSize( Size size, Size separatorLength = 0 );
+
+  //! writes 2 * \a size lower case digits to \a out
+  static void encode( const Byte* data, Size size, char* out, Kernel kernel = bestKernel() );
+  //! writes encodedSize( size, strlen( separator ) ) characters to \a out
+  static void encode( const Byte* data, Size size, const char* separator, char* out );
+
+  //! skips whitespace, takes upper and lower case digits, throws std::invalid_argument
+  //! for anything else
+  class Decoder
+  {
+  public:
+    explicit Decoder( Kernel theKernel = bestKernel() );
+
+    //! writes the decoded bytes to \a out, at least maxDecodedSize( size ) large
+    Size update( const char* text, Size size, Byte* out );
+    //! throws std::invalid_argument if a single digit is left over
+    void finish();
+
+    static Size maxDecodedSize( Size size ) { return ( size + 1 ) / 2; }
+
+  private:
+    Kernel kernel;
+    int high = -1; // first digit of the next byte
+  };
+};
+
+//! stream buffer, that hex encodes everything put into it to \a sink, wrapped after
+//! 64 characters
+class HexWriter : public std::streambuf
+{
+public:
+  static constexpr Size lineLength = 64;
+
+  explicit HexWriter( std::ostream& theSink );
+
+  //! encodes what is left and ends the last line
+  void finish();
+
+protected:
+  int_type overflow( int_type c ) override;
+  int sync() override;
+
+private:
+  // 32 bytes make a full line
+  static constexpr Size inputSize = 32 * 1024;
+
+  std::ostream& sink;
+  std::vector<char> input;
+  std::string encoded;
+  std::string lines;
+  Size column = 0;
+
+  void encodeInput();
+};
+
+//! stream buffer, that returns the decoded hex text read from \a source, an illegal
+//! character or an odd number of digits throws std::invalid_argument
+class HexReader : public std::streambuf
+{
+public:
+  explicit HexReader( std::streambuf* theSource );
+
+protected:
+  int_type underflow() override;
+
+private:
+  static constexpr Size chunkSize = 64 * 1024;
+
+  std::streambuf* source;
+  Hex::Decoder decoder;
+  std::vector<char> text;
+  Data decoded;
+};
+} // namespace SshCrypt
@@ -0,0 +1,302 @@
+// SPDX-License-Identifier: MIT
+
+#include "MockAgent.h"
+
+#include "AgentMessage.h"
+#include "AgentMessageTypes.h"
+#include "Debug.h"
+#include "ShaHash.h"
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <openssl/evp.h>
+#include <stdexcept>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace SshCrypt
+{
+namespace
+{
+const char keyType[] = "ssh-ed25519";
+constexpr Size maxMessageSize = 256 * 1024;
+
+//! false if the peer is gone
+bool receiveAll( int fd, Byte* buffer, Size size )
+{
+  while( size > 0 )
+  {
+    const ssize_t rl = recv( fd, buffer, size, 0 );
+    if( rl < 0 && errno == EINTR )
+      continue;
+    if( rl <= 0 )
+      return false;
+    buffer += rl;
+    size -= static_cast<Size>( rl );
+  }
+  return true;
+}
+
+Data wireString( const Data& data )
+{
+  Data result = Decoder::int2net( data.size() );
+  result.insert( result.end(), data.begin(), data.end() );
+  return result;
+}
+} // namespace
+
+MockAgent::MockAgent( const Options& options ) :
+    latencyMs{ options.latency.count() },
+    failEvery{ options.failEvery },
+    disconnectEvery{ options.disconnectEvery }
+{
+  // derived from a fixed seed, so the keys are the same on every run
+  for( unsigned i = 0; i < options.keys; ++i )
+  {
+    const Data seed = ShaHash::check( fromString( "mock key " + std::to_string( i ) ) );
+    EVP_PKEY* key
+        = EVP_PKEY_new_raw_private_key( EVP_PKEY_ED25519, nullptr, seed.data(), seed.size() );
+    if( !key )
+    {
+      throw std::runtime_error{ "EVP_PKEY_new_raw_private_key() failed" };
+    }
+    keys.push_back( key );
+
+    Data raw( 32 );
+    size_t rawSize = raw.size();
+    EVP_PKEY_get_raw_public_key( key, raw.data(), &rawSize );
+    Data publicKey = wireString( fromString( keyType ) );
+    const Data rawString = wireString( raw );
+    publicKey.insert( publicKey.end(), rawString.begin(), rawString.end() );
+    publicKeys.push_back( publicKey );
+  }
+
+  char dirName[] = "/tmp/sshcrypt-mock-XXXXXX";
+  if( !mkdtemp( dirName ) )
+  {
+    throw std::runtime_error{ "can't create socket directory" };
+  }
+  directory = dirName;
+  socket = directory + "/agent.sock";
+
+  listenFd = ::socket( PF_UNIX, SOCK_STREAM, 0 );
+  struct sockaddr_un addr;
+  memset( &addr, 0, sizeof addr );
+  addr.sun_family = AF_UNIX;
+  strncpy( addr.sun_path, socket.c_str(), sizeof addr.sun_path - 1 );
+  if( listenFd == -1
+      || bind( listenFd, reinterpret_cast<struct sockaddr*>( &addr ), sizeof addr ) == -1
+      || listen( listenFd, 128 ) == -1 )
+  {
+    if( listenFd != -1 )
+      close( listenFd );
+    rmdir( directory.c_str() );
+    for( EVP_PKEY* key : keys )
+    {
+      EVP_PKEY_free( key );
+    }
+    throw std::runtime_error{ "can't listen on " + socket };
+  }
+
+  acceptThread = std::thread{ [ this ]() { acceptClients(); } };
+}
+
+MockAgent::~MockAgent()
+{
+  stopping = true;
+  shutdown( listenFd, SHUT_RDWR ); // wakes up accept()
+  acceptThread.join();
+  {
+    std::lock_guard<std::mutex> lock{ mutex };
+    for( int fd : clients )
+    {
+      shutdown( fd, SHUT_RDWR );
+    }
+  }
+  for( auto& thread : threads )
+  {
+    thread.join();
+  }
+  for( int fd : clients )
+  {
+    close( fd );
+  }
+  close( listenFd );
+  unlink( socket.c_str() );
+  rmdir( directory.c_str() );
+
+  for( EVP_PKEY* key : keys )
+  {
+    EVP_PKEY_free( key );
+  }
+
+  if( exported )
+  {
+    if( oldAuthSock.empty() )
+      unsetenv( "SSH_AUTH_SOCK" );
+    else
+      setenv( "SSH_AUTH_SOCK", oldAuthSock.c_str(), 1 );
+    if( !oldDaemonSock.empty() )
+      setenv( "SSHCRYPT_AGENT_SOCK", oldDaemonSock.c_str(), 1 );
+  }
+}
+
+std::vector<std::string> MockAgent::fingerprints() const
+{
+  std::vector<std::string> result;
+  for( const auto& publicKey : publicKeys )
+  {
+    result.push_back( toBase64( ShaHash::check( publicKey ), false ) );
+  }
+  return result;
+}
+
+void MockAgent::exportSocket()
+{
+  if( !exported )
+  {
+    const char* authSock = getenv( "SSH_AUTH_SOCK" );
+    const char* daemonSock = getenv( "SSHCRYPT_AGENT_SOCK" );
+    oldAuthSock = authSock ? authSock : "";
+    oldDaemonSock = daemonSock ? daemonSock : "";
+    exported = true;
+  }
+  setenv( "SSH_AUTH_SOCK", socket.c_str(), 1 );
+  unsetenv( "SSHCRYPT_AGENT_SOCK" );
+}
+
+void MockAgent::acceptClients()
+{
+  while( !stopping )
+  {
+    const int fd = accept( listenFd, nullptr, nullptr );
+    if( fd == -1 )
+    {
+      if( errno == EINTR )
+        continue;
+      return;
+    }
+
+    std::lock_guard<std::mutex> lock{ mutex };
+    if( stopping )
+    {
+      close( fd );
+      return;
+    }
+    clients.push_back( fd );
+    threads.emplace_back( [ this, fd ]() { serve( fd ); } );
+  }
+}
+
+void MockAgent::serve( int fd )
+{
+  for( ;; )
+  {
+    Byte sizeBuffer[ 4 ];
+    if( !receiveAll( fd, sizeBuffer, sizeof sizeBuffer ) )
+      break;
+    const Size size = Decoder::net2int( sizeBuffer );
+    if( size == 0 || size > maxMessageSize )
+      break;
+    Data request( size );
+    if( !receiveAll( fd, request.data(), request.size() ) )
+      break;
+
+    const Size count = ++requestCount;
+    if( disconnectEvery && count % disconnectEvery == 0 )
+      break;
+
+    const Size current = ++inFlight;
+    Size peak = maxInFlightCount;
+    while( current > peak && !maxInFlightCount.compare_exchange_weak( peak, current ) )
+    {
+    }
+
+    const Data response = answer( request );
+    if( latencyMs > 0 )
+      std::this_thread::sleep_for( std::chrono::milliseconds{ latencyMs } );
+    // before the client can have the answer and send the next request
+    --inFlight;
+    const ssize_t sent = send( fd, response.data(), response.size(), MSG_NOSIGNAL );
+    if( sent != static_cast<ssize_t>( response.size() ) )
+      break;
+  }
+
+  // the descriptor stays in clients until destruction, so it is never reused meanwhile
+  shutdown( fd, SHUT_RDWR );
+}
+
+//! \a request is the message without its size
+Data MockAgent::answer( const Data& request )
+{
+  try
+  {
+    Decoder decoder{ request.data() + 1, request.size() - 1 };
+    switch( request[ 0 ] )
+    {
+    case SSH_AGENTC_REQUEST_IDENTITIES:
+    {
+      AgentMessage response{ SSH_AGENT_IDENTITIES_ANSWER };
+      response.addInt( publicKeys.size() );
+      for( Size i = 0; i < publicKeys.size(); ++i )
+      {
+        response.addBlob( publicKeys[ i ] );
+        response.addBlob( fromString( "mock key " + std::to_string( i ) ) );
+      }
+      response.adjustMessageSize();
+      return response.getData();
+    }
+
+    case SSH_AGENTC_SIGN_REQUEST:
+    {
+      const DataView publicKey = decoder.getBlob();
+      const DataView data = decoder.getBlob();
+      const Size count = ++signCount;
+      if( failEvery && count % failEvery == 0 )
+        break;
+
+      for( Size i = 0; i < publicKeys.size(); ++i )
+      {
+        if( publicKeys[ i ] == publicKey )
+        {
+          AgentMessage response{ SSH_AGENT_SIGN_RESPONSE };
+          response.addBlob( sign( i, data ) );
+          response.adjustMessageSize();
+          return response.getData();
+        }
+      }
+      break;
+    }
+    }
+  }
+  catch( const std::exception& ex )
+  {
+    LOG_DEBUG( "mock agent: " << ex.what() );
+  }
+  return AgentMessage{ SSH_AGENT_FAILURE }.getData();
+}
+
+//! signature in ssh wire format, like ssh-agent sends it
+Data MockAgent::sign( Size key, DataView data ) const
+{
+  Data signature( 64 );
+  size_t signatureSize = signature.size();
+  EVP_MD_CTX* ctx = EVP_MD_CTX_new();
+  const bool ok = ctx && EVP_DigestSignInit( ctx, nullptr, nullptr, nullptr, keys[ key ] ) == 1
+                  && EVP_DigestSign( ctx, signature.data(), &signatureSize, data.data(),
+                                     data.size() )
+                         == 1;
+  EVP_MD_CTX_free( ctx );
+  if( !ok )
+  {
+    throw std::runtime_error{ "EVP_DigestSign() failed" };
+  }
+
+  Data result = wireString( fromString( keyType ) );
+  const Data signatureString = wireString( signature );
+  result.insert( result.end(), signatureString.begin(), signatureString.end() );
+  return result;
+}
+} // namespace SshCrypt
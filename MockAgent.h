@@ -0,0 +1,88 @@
+// SPDX-License-Identifier: MIT
+
+#pragma once
+
+#include "Data.h"
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+typedef struct evp_pkey_st EVP_PKEY;
+
+namespace SshCrypt
+{
+struct MockAgentOptions
+{
+  unsigned keys = 1;                      // ed25519 keys, the same ones on every run
+  std::chrono::milliseconds latency{ 0 }; // before every answer
+  unsigned failEvery = 0;                 // every n-th sign request fails, 0 never
+  unsigned disconnectEvery = 0;           // every n-th request closes the connection
+};
+
+/*! \class MockAgent
+ *
+ * ssh-agent stand-in for tests and benchmarks, answers SSH_AGENTC_REQUEST_IDENTITIES and
+ * SSH_AGENTC_SIGN_REQUEST on a unix domain socket in a temporary directory, every
+ * connection is served by its own thread. Everything else is answered with
+ * SSH_AGENT_FAILURE.
+ */
+class MockAgent
+{
+public:
+  using Options = MockAgentOptions;
+
+  explicit MockAgent( const Options& options = Options{} );
+  ~MockAgent();
+  MockAgent( const MockAgent& ) = delete;
+  MockAgent& operator=( const MockAgent& ) = delete;
+
+  const std::string& socketName() const { return socket; }
+  //! the ids sshcrypt uses for the keys (base64 of the sha256 of the public key)
+  std::vector<std::string> fingerprints() const;
+
+  //! points SSH_AUTH_SOCK to this agent and hides sshcrypt-agent until destruction
+  void exportSocket();
+
+  void setLatency( std::chrono::milliseconds latency ) { latencyMs = latency.count(); }
+  void setFailEvery( unsigned every ) { failEvery = every; }
+
+  Size requests() const { return requestCount; }
+  Size signRequests() const { return signCount; }
+  //! the most requests answered at the same time, by different connections
+  Size maxInFlight() const { return maxInFlightCount; }
+
+private:
+  std::vector<EVP_PKEY*> keys;
+  std::vector<Data> publicKeys; // ssh wire format
+  std::string directory;
+  std::string socket;
+  int listenFd = -1;
+
+  std::atomic<long long> latencyMs;
+  std::atomic<unsigned> failEvery;
+  const unsigned disconnectEvery;
+  std::atomic<Size> requestCount{ 0 };
+  std::atomic<Size> signCount{ 0 };
+  std::atomic<Size> inFlight{ 0 };
+  std::atomic<Size> maxInFlightCount{ 0 };
+  std::atomic<bool> stopping{ false };
+
+  std::mutex mutex;
+  std::vector<int> clients;
+  std::vector<std::thread> threads;
+  std::thread acceptThread;
+
+  bool exported = false;
+  std::string oldAuthSock;
+  std::string oldDaemonSock;
+
+  void acceptClients();
+  void serve( int fd );
+  Data answer( const Data& request );
+  Data sign( Size key, DataView data ) const;
+};
+} // namespace SshCrypt
@@ -0,0 +1,174 @@
+// SPDX-License-Identifier: MIT
+
+#include "SecureMemory.h"
+
+#include "Debug.h"
+
+#include <map>
+#include <mutex>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <vector>
+
+namespace SshCrypt
+{
+namespace
+{
+constexpr std::size_t minBlockSize = 64;
+constexpr std::size_t maxSmallSize = 16 * 1024;
+constexpr std::size_t smallClasses = 9; // 64 bytes to 16 KiB
+constexpr std::size_t chunkSize = 256 * 1024;
+// freed large blocks beyond this are unmapped, a file's segments fit easily
+constexpr std::size_t maxCachedSize = 64 * 1024 * 1024;
+
+class Arena
+{
+public:
+  void* allocate( std::size_t size )
+  {
+    if( size <= maxSmallSize )
+    {
+      const std::size_t index = smallClass( size );
+      const std::size_t blockSize = minBlockSize << index;
+      std::lock_guard<std::mutex> lock{ mutex };
+      auto& free = smallFree[ index ];
+      if( !free.empty() )
+      {
+        void* block = free.back();
+        free.pop_back();
+        return block;
+      }
+      if( chunkLeft < blockSize )
+      {
+        chunk = static_cast<char*>( map( chunkSize ) );
+        chunkLeft = chunkSize;
+      }
+      void* block = chunk;
+      chunk += blockSize;
+      chunkLeft -= blockSize;
+      return block;
+    }
+
+    const std::size_t blockSize = pageRounded( size );
+    std::lock_guard<std::mutex> lock{ mutex };
+    auto found = largeFree.find( blockSize );
+    if( found != largeFree.end() && !found->second.empty() )
+    {
+      void* block = found->second.back();
+      found->second.pop_back();
+      cachedSize -= blockSize;
+      return block;
+    }
+    return map( blockSize );
+  }
+
+  void deallocate( void* block, std::size_t size ) noexcept
+  {
+    if( !block )
+      return;
+    // blocks are handed out zeroed, only the requested bytes may have been written.
+    // explicit_bzero is a plain memset the compiler can't drop, OPENSSL_cleanse is slower.
+    explicit_bzero( block, size );
+
+    std::lock_guard<std::mutex> lock{ mutex };
+    const std::size_t blockSize = size <= maxSmallSize ? 0 : pageRounded( size );
+    try
+    {
+      if( size <= maxSmallSize )
+      {
+        smallFree[ smallClass( size ) ].push_back( block );
+        return;
+      }
+      if( cachedSize + blockSize <= maxCachedSize )
+      {
+        largeFree[ blockSize ].push_back( block );
+        cachedSize += blockSize;
+        return;
+      }
+    }
+    catch( const std::bad_alloc& )
+    {
+      // a small block is lost then, it is wiped at least
+      if( size <= maxSmallSize )
+        return;
+    }
+    munmap( block, blockSize ); // unlocks it as well
+  }
+
+  std::size_t locked()
+  {
+    std::lock_guard<std::mutex> lock{ mutex };
+    return lockedSize;
+  }
+
+private:
+  std::mutex mutex;
+  std::vector<void*> smallFree[ smallClasses ];
+  char* chunk = nullptr;
+  std::size_t chunkLeft = 0;
+  std::map<std::size_t, std::vector<void*>> largeFree;
+  std::size_t cachedSize = 0;
+  std::size_t lockedSize = 0;
+  bool lockFailed = false;
+
+  static std::size_t smallClass( std::size_t size )
+  {
+    std::size_t index = 0;
+    while( ( minBlockSize << index ) < size )
+      ++index;
+    return index;
+  }
+
+  static std::size_t pageRounded( std::size_t size )
+  {
+    static const std::size_t pageSize = static_cast<std::size_t>( sysconf( _SC_PAGESIZE ) );
+    return ( size + pageSize - 1 ) / pageSize * pageSize;
+  }
+
+  //! called with the mutex locked
+  void* map( std::size_t size )
+  {
+    void* block
+        = mmap( nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+    if( block == MAP_FAILED )
+    {
+      throw std::bad_alloc{};
+    }
+    madvise( block, size, MADV_DONTDUMP );
+    if( mlock( block, size ) == 0 )
+    {
+      lockedSize += size;
+    }
+    else if( !lockFailed )
+    {
+      lockFailed = true;
+      LOG_DEBUG( "mlock failed, secure memory may be swapped out" );
+    }
+    return block;
+  }
+};
+
+//! never destroyed, static containers may free their secrets after main()
+Arena& arena()
+{
+  static Arena* instance = new Arena;
+  return *instance;
+}
+} // namespace
+
+void* SecureArena::allocate( std::size_t size ) // static
+{
+  return arena().allocate( size );
+}
+
+void SecureArena::deallocate( void* block, std::size_t size ) noexcept // static
+{
+  arena().deallocate( block, size );
+}
+
+std::size_t SecureArena::lockedBytes() // static
+{
+  return arena().locked();
+}
+} // namespace SshCrypt
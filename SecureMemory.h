@@ -0,0 +1,69 @@
+// SPDX-License-Identifier: MIT
+
+#pragma once
+
+#include <cstddef>
+#include <new>
+
+namespace SshCrypt
+{
+/*! \class SecureArena
+ *
+ * memory for keys and plain data. It is mapped in chunks, locked into ram with mlock and
+ * left out of core dumps. A freed block is wiped and kept for the next request of its
+ * size, so the buffers of consecutive chunks, segments and files are reused instead of
+ * mapped again. Small blocks are carved from shared chunks by powers of two, large ones
+ * are mapped on their own, rounded up to whole pages. When the memlock limit is reached
+ * the memory stays unlocked, but it is still wiped.
+ */
+class SecureArena
+{
+public:
+  SecureArena() = delete;
+
+  //! throws std::bad_alloc
+  static void* allocate( std::size_t size );
+  //! \a size is the one passed to allocate()
+  static void deallocate( void* block, std::size_t size ) noexcept;
+
+  //! bytes mapped and locked so far, for tests and benchmarks
+  static std::size_t lockedBytes();
+};
+
+//! allocator for containers holding secrets, see SecureArena
+template <class T>
+class SecureAllocator
+{
+public:
+  using value_type = T;
+
+  SecureAllocator() = default;
+  template <class U>
+  SecureAllocator( const SecureAllocator<U>& )
+  {
+  }
+
+  T* allocate( std::size_t count )
+  {
+    if( count > static_cast<std::size_t>( -1 ) / sizeof( T ) )
+      throw std::bad_alloc{};
+    return static_cast<T*>( SecureArena::allocate( count * sizeof( T ) ) );
+  }
+
+  void deallocate( T* block, std::size_t count ) noexcept
+  {
+    SecureArena::deallocate( block, count * sizeof( T ) );
+  }
+
+  template <class U>
+  bool operator==( const SecureAllocator<U>& ) const
+  {
+    return true;
+  }
+  template <class U>
+  bool operator!=( const SecureAllocator<U>& ) const
+  {
+    return false;
+  }
+};
+} // namespace SshCrypt
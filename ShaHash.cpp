@@ -4,46 +4,140 @@
 
 #include "Debug.h"
 
+#include <openssl/core_names.h>
 #include <openssl/evp.h>
+#include <openssl/kdf.h>
 #include <stdexcept>
 
 namespace SshCrypt
 {
-Data ShaHash::check( const Data& data )
+namespace
 {
-  auto sha256 = EVP_get_digestbyname( "sha256" );
-  if( !sha256 )
+const EVP_MD* sha256()
+{
+  static const EVP_MD* md = EVP_MD_fetch( nullptr, "SHA256", nullptr );
+  if( !md )
   {
     LOG_DEBUG( "no sha256" );
     throw std::runtime_error( "no sha256" );
   }
-  EVP_MD_CTX* ctx = EVP_MD_CTX_new();
+  return md;
+}
+} // namespace
+
+ShaHash::ShaHash() : ctx{ EVP_MD_CTX_new() }
+{
   if( !ctx )
   {
     LOG_DEBUG( "no ctx" );
     throw std::runtime_error( "no ctx" );
   }
-  if( EVP_DigestInit_ex2( ctx, sha256, nullptr ) != 1 )
+  try
+  {
+    reset();
+  }
+  catch( ... )
+  {
+    EVP_MD_CTX_free( ctx );
+    throw;
+  }
+}
+
+ShaHash::~ShaHash()
+{
+  EVP_MD_CTX_free( ctx );
+}
+
+void ShaHash::reset()
+{
+  if( EVP_DigestInit_ex2( ctx, sha256(), nullptr ) != 1 )
   {
     LOG_DEBUG( "no init" );
     throw std::runtime_error( "no init" );
   }
-  if( EVP_DigestUpdate( ctx, data.data(), data.size() ) != 1 )
+}
+
+ShaHash& ShaHash::update( DataView data )
+{
+  if( !data.empty() && EVP_DigestUpdate( ctx, data.data(), data.size() ) != 1 )
   {
     LOG_DEBUG( "no update" );
     throw std::runtime_error( "no update" );
   }
-  Data sum;
-  sum.resize( EVP_MAX_MD_SIZE );
+  return *this;
+}
+
+//! \a digest takes digestSize bytes
+void ShaHash::final( Byte* digest )
+{
   unsigned int len = 0;
-  if( EVP_DigestFinal_ex( ctx, sum.data(), &len ) != 1 )
+  if( EVP_DigestFinal_ex( ctx, digest, &len ) != 1 || len != digestSize )
   {
     LOG_DEBUG( "no final" );
     throw std::runtime_error( "no final" );
   }
-  EVP_MD_CTX_free( ctx );
-  sum.resize( len );
+  reset();
+}
+
+Data ShaHash::final()
+{
+  Data sum( digestSize );
+  final( sum.data() );
   return sum;
 }
 
+Data ShaHash::check( DataView data ) // static
+{
+  thread_local ShaHash hash;
+  try
+  {
+    return hash.update( data ).final();
+  }
+  catch( ... )
+  {
+    hash.reset();
+    throw;
+  }
+}
+
+//! HKDF (RFC 5869) with SHA-256, derive \a length bytes from \a secret
+SecureData ShaHash::hkdf( DataView secret, DataView salt, const std::string& info, Size length )
+{
+  EVP_KDF* kdf = EVP_KDF_fetch( nullptr, "HKDF", nullptr );
+  if( !kdf )
+  {
+    LOG_DEBUG( "no hkdf" );
+    throw std::runtime_error( "no hkdf" );
+  }
+  EVP_KDF_CTX* ctx = EVP_KDF_CTX_new( kdf );
+  EVP_KDF_free( kdf );
+  if( !ctx )
+  {
+    LOG_DEBUG( "no kdf ctx" );
+    throw std::runtime_error( "no kdf ctx" );
+  }
+
+  char digest[] = "SHA256";
+  OSSL_PARAM params[] = {
+    OSSL_PARAM_construct_utf8_string( OSSL_KDF_PARAM_DIGEST, digest, 0 ),
+    OSSL_PARAM_construct_octet_string(
+        OSSL_KDF_PARAM_KEY, const_cast<Byte*>( secret.data() ), secret.size() ),
+    OSSL_PARAM_construct_octet_string(
+        OSSL_KDF_PARAM_SALT, const_cast<Byte*>( salt.data() ), salt.size() ),
+    OSSL_PARAM_construct_octet_string(
+        OSSL_KDF_PARAM_INFO, const_cast<char*>( info.data() ), info.size() ),
+    OSSL_PARAM_construct_end()
+  };
+
+  SecureData result( length );
+  const int rc = EVP_KDF_derive( ctx, result.data(), result.size(), params );
+  EVP_KDF_CTX_free( ctx );
+  if( rc != 1 )
+  {
+    LOG_DEBUG( "no derive" );
+    throw std::runtime_error( "no derive" );
+  }
+  return result;
+}
+
 } // namespace SshCrypt
@@ -4,11 +4,39 @@
 
 #include "Data.h"
 
+#include <string>
+
+typedef struct evp_md_ctx_st EVP_MD_CTX;
+
 namespace SshCrypt
 {
+/*! \class ShaHash
+ *
+ * sha256 of data passed in pieces of any size, the digest is looked up once per process
+ * and the context is reused after final() or reset()
+ */
 class ShaHash
 {
 public:
-  static Data check( const Data& );
+  static constexpr Size digestSize = 32;
+
+  ShaHash();
+  ~ShaHash();
+  ShaHash( const ShaHash& ) = delete;
+  ShaHash& operator=( const ShaHash& ) = delete;
+
+  ShaHash& update( DataView data );
+  //! the digest of everything since the last final() or reset()
+  Data final();
+  void final( Byte* digest );
+  void reset();
+
+  //! sha256 of \a data with a context per thread
+  static Data check( DataView data );
+  static SecureData
+  hkdf( DataView secret, DataView salt, const std::string& info, Size length );
+
+private:
+  EVP_MD_CTX* ctx = nullptr;
 };
 } // namespace SshCrypt
@@ -1,24 +1,67 @@
 // SPDX-License-Identifier: MIT
 
+#include "Base64.h"
+#include "Container.h"
 #include "Cryptor.h"
 #include "Debug.h"
+#include "Hex.h"
+#include "ShaHash.h"
+#include "ThreadPool.h"
 
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <cstring>
 #include <exception>
+#include <fcntl.h>
+#include <filesystem>
+#include <functional>
+#include <fstream>
 #include <getopt.h>
 #include <iostream>
+#include <limits>
+#include <map>
+#include <memory>
 #include <sstream>
 #include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
 
 static void usage( const char* programName )
 {
   std::cout
-      << "usage: " << programName << " <operation> [-b] [-k key] [inputfile [outputfile]]\n"
+      << "usage: " << programName
+      << " <operation> [-b|-x] [-1|-z] [-j threads] [-m method] [-k key]"
+      << " [-R key]... [-D key]... [inputfile [outputfile]]\n"
+      << "       " << programName
+      << " -B <-e|-d> [-b|-x] [-z] [-j threads] [-s suffix] [-k key] [file|directory|-]...\n"
       << "  -d,  --decrypt     decrypt input to output\n"
       << "  -e,  --encrypt     encrypt input to ouput\n"
       << "  -v,  --edit        decrypt, edit, encrypt\n"
+      << "  -w,  --rewrap      add (-R) and drop (-D) recipients, the content is copied\n"
       << "  -b,  --binary      encrypt as binary, base64 encoded otherweise\n"
+      << "  -x,  --hex         encrypt hex encoded\n"
+      << "  -1,  --version1    encrypt in file format version 1 (readable by older versions)\n"
+      << "  -j,  --threads=N   use N threads, one per core otherweise\n"
+      << "  -m,  --method=M    encrypt with aes256gcm (default), chacha20poly1305 or\n"
+      << "                     aes256cbc\n"
+      << "  -z,  --compress    compress before encrypting (zlib), beware: the size of the\n"
+      << "                     output tells about the content\n"
+      << "  -r,  --range=O[:L] decrypt L bytes (all up to the end) from offset O of a binary\n"
+      << "                     file, only the segments holding them are read\n"
       << "  -k,  --key=SHA256  use key with SHA256 checksum, first one found otherweise\n"
+      << "  -R,  --recipient=SHA256\n"
+      << "                     encrypt for every key given, each one can decrypt the file\n"
+      << "  -D,  --drop=SHA256 rewrap: remove the recipient\n"
       << "  -l,  --listkeys    list available keys\n"
+      << "  -B,  --batch       en- or decrypt many files, directories are searched\n"
+      << "                     recursively, - reads file names from stdin, one per line\n"
+      << "  -s,  --suffix=S    batch: encrypted files are named file + S, default .sshcrypt\n"
+      << "  -T,  --timeout=N   give up if the agent doesn't answer within N seconds\n"
       << "\n"
       << "If outputfile is omitted, the result is written to stdout.\n"
       << "If inputfile is omitted, the input is read from stdin.\n"
@@ -27,41 +70,441 @@ static void usage( const char* programName )
       << std::endl;
 }
 
-static SshCrypt::Data magicWord{ 'S', 's', 'H', 'c', 'R', 'y', 'P', 't' };
+// a century, deadlines this far off don't overflow the clock
+constexpr unsigned long long maxSeconds = 100ULL * 365 * 24 * 3600;
 
+//! a bad argument on the command line, reported with the usage
+class UsageError : public std::runtime_error
+{
+public:
+  using std::runtime_error::runtime_error;
+};
+
+//! \a text of option \a name as a number from \a min to \a max, throws UsageError otherwise
+static unsigned long long parseNumber( const char* name,
+                                       const std::string& text,
+                                       unsigned long long min,
+                                       unsigned long long max )
+{
+  // strtoull() negates a leading minus, so only digits are taken
+  char* end = nullptr;
+  errno = 0;
+  const unsigned long long value
+      = !text.empty() && isdigit( static_cast<unsigned char>( text[ 0 ] ) )
+            ? strtoull( text.c_str(), &end, 10 )
+            : 0;
+  if( !end || *end || errno || value < min || value > max )
+  {
+    throw UsageError{ std::string{ name } + " must be a number from " + std::to_string( min )
+                      + " to " + std::to_string( max ) + ", not '" + text + "'" };
+  }
+  return value;
+}
+
+// the input, regular files are mapped into memory, pipes and stdin are read through a stream
+class InputFile
+{
+public:
+  InputFile( const char* filename )
+  {
+    if( filename && SshCrypt::MappedFile::isRegular( filename ) )
+    {
+      mapped.reset( new SshCrypt::MappedFile{ filename } );
+      mappedStream.reset( new std::istream{ mapped->rdbuf() } );
+    }
+    else if( filename )
+    {
+      file.open( filename, std::ios::binary );
+      if( !file )
+        throw std::runtime_error{ "can't open input file" };
+    }
+  }
+
+  std::istream& stream()
+  {
+    if( mappedStream )
+      return *mappedStream;
+    return file.is_open() ? file : std::cin;
+  }
+
+private:
+  std::unique_ptr<SshCrypt::MappedFile> mapped;
+  std::unique_ptr<std::istream> mappedStream;
+  std::ifstream file;
+};
+
+// RAII class for the output, a temporary file next to the target replaces the target on
+// commit, so a failed operation never leaves a partial file and input and output may be the
+// same file
+class OutputFile
+{
+public:
+  OutputFile( const char* filename )
+  {
+    if( !filename )
+      return;
+
+    char resolved[ PATH_MAX ];
+    target = realpath( filename, resolved ) ? resolved : filename;
+    tempFilename = target + ".XXXXXX";
+    int fd = mkstemp( &tempFilename[ 0 ] );
+    if( fd == -1 )
+    {
+      throw std::runtime_error{ "can't create output file" };
+    }
+    struct stat targetStat;
+    if( stat( target.c_str(), &targetStat ) == 0 )
+    {
+      fchmod( fd, targetStat.st_mode & 07777 );
+    }
+    close( fd );
+    // segments are written in one piece, bypassing the buffer when larger
+    buffer.resize( bufferSize );
+    file.rdbuf()->pubsetbuf( buffer.data(), static_cast<std::streamsize>( buffer.size() ) );
+    file.open( tempFilename, std::ios::binary | std::ios::trunc );
+  }
+
+  ~OutputFile()
+  {
+    if( !tempFilename.empty() )
+      remove( tempFilename.c_str() );
+  }
+
+  std::ostream& stream() { return target.empty() ? std::cout : file; }
+
+  void commit()
+  {
+    if( target.empty() )
+      return;
+
+    file.close();
+    if( !file || rename( tempFilename.c_str(), target.c_str() ) != 0 )
+    {
+      throw std::runtime_error{ "can't write output file" };
+    }
+    tempFilename.clear();
+  }
+
+private:
+  static constexpr SshCrypt::Size bufferSize = 1024 * 1024;
+
+  std::string target;
+  std::string tempFilename;
+  std::vector<char> buffer;
+  std::ofstream file;
+};
+
+//! \a encrypt writes the binary file, it is stored encoded by \a writeMode
+static void writeEncrypted( const char* outputFilename,
+                            SshCrypt::WriteMode writeMode,
+                            const std::function<void( std::ostream& )>& encrypt )
+{
+  OutputFile output{ outputFilename };
+  if( writeMode == SshCrypt::WriteMode::Raw )
+  {
+    encrypt( output.stream() );
+  }
+  else if( writeMode == SshCrypt::WriteMode::Hex )
+  {
+    SshCrypt::HexWriter hex{ output.stream() };
+    std::ostream encoded{ &hex };
+    encrypt( encoded );
+    hex.finish();
+  }
+  else
+  {
+    SshCrypt::ArmorWriter armor{ output.stream() };
+    std::ostream armored{ &armor };
+    encrypt( armored );
+    armor.finish();
+  }
+  output.commit();
+}
+
+//! with \a session the salt and session key of a decrypted file are used again
 static void encryptFile( const char* inputFilename,
                          const char* outputFilename,
                          const char* forceKey,
-                         SshCrypt::WriteMode writeMode )
+                         SshCrypt::WriteMode writeMode,
+                         const SshCrypt::Cryptor::Options& options,
+                         const SshCrypt::Cryptor::Session* session = nullptr )
 {
-  auto plainData = SshCrypt::loadFile( inputFilename, SshCrypt::ReadMode::Raw );
-  // append magic word, so we can check it on decrypt
-  plainData.insert( plainData.end(), magicWord.begin(), magicWord.end() );
-  auto cryptedData = SshCrypt::Cryptor::encrypt( plainData, forceKey );
-  SshCrypt::saveFile( cryptedData, outputFilename, writeMode );
+  InputFile inputFile{ inputFilename };
+  std::istream& input = inputFile.stream();
+  writeEncrypted( outputFilename, writeMode, [ & ]( std::ostream& out ) {
+    if( session )
+      SshCrypt::Cryptor::encrypt( input, out, *session, forceKey, options );
+    else
+      SshCrypt::Cryptor::encrypt( input, out, forceKey, options );
+  } );
 }
 
+// encrypted input, raw, base64 or hex, which is told by the beginning of the data
+class EncryptedInput
+{
+public:
+  EncryptedInput( const char* filename ) : file{ filename }
+  {
+    std::istream& input = file.stream();
+    SshCrypt::Data head( 256 );
+    input.read( reinterpret_cast<char*>( head.data() ),
+                static_cast<std::streamsize>( head.size() ) );
+    head.resize( static_cast<SshCrypt::Size>( input.gcount() ) );
+    const auto readMode = SshCrypt::detectReadMode( head );
+    replay = std::make_unique<SshCrypt::ReplayBuffer>( std::move( head ), input.rdbuf() );
+    if( readMode == SshCrypt::ReadMode::Raw )
+    {
+      decoded = std::make_unique<std::istream>( replay.get() );
+    }
+    else
+    {
+      if( readMode == SshCrypt::ReadMode::Hex )
+        armor = std::make_unique<SshCrypt::HexReader>( replay.get() );
+      else
+        armor = std::make_unique<SshCrypt::ArmorReader>( replay.get() );
+      // let an illegal character through instead of ending the stream
+      decoded = std::make_unique<std::istream>( armor.get() );
+      decoded->exceptions( std::ios::badbit );
+    }
+  }
+
+  std::istream& stream() { return *decoded; }
+
+private:
+  InputFile file;
+  std::unique_ptr<SshCrypt::ReplayBuffer> replay;
+  std::unique_ptr<std::streambuf> armor;
+  std::unique_ptr<std::istream> decoded;
+};
+
 static void decryptFile( const char* inputFilename,
                          const char* outputFilename,
                          const char* forceKey,
-                         SshCrypt::WriteMode )
+                         SshCrypt::WriteMode,
+                         const SshCrypt::Cryptor::Options& options )
+{
+  EncryptedInput input{ inputFilename };
+  OutputFile output{ outputFilename };
+  SshCrypt::Cryptor::decrypt( input.stream(), output.stream(), forceKey, options );
+  output.commit();
+}
+
+//! the plain bytes [ offset, offset + length ) of a binary file, stdin is not seekable
+static void decryptRange( const char* inputFilename,
+                          const char* outputFilename,
+                          const char* forceKey,
+                          SshCrypt::Size offset,
+                          SshCrypt::Size length,
+                          const SshCrypt::Cryptor::Options& options )
+{
+  if( !inputFilename )
+    throw std::runtime_error{ "range needs inputfile" };
+  InputFile input{ inputFilename };
+  OutputFile output{ outputFilename };
+  SshCrypt::Cryptor::decryptRange( input.stream(), output.stream(), offset, length, forceKey,
+                                   options );
+  output.commit();
+}
+
+//! a file of a batch, one that couldn't even be listed carries its error
+struct BatchFile
+{
+  std::string name;
+  std::string error;
+};
+
+//! ask the agent for the session keys of all files at once, before they are decrypted one
+//! by one, errors are left to the decryption
+static void prefetchSessionKeys( const std::vector<BatchFile>& files, const char* forceKey )
+{
+  // by the key decrypt will use, the one named in the header without forceKey
+  // of files with recipients the first one, that is forceKey or a key of the agent
+  std::map<std::string, std::vector<SshCrypt::Data>> saltsByKey;
+  std::vector<std::string> agentKeys;
+  if( forceKey )
+    agentKeys.push_back( forceKey );
+  for( const auto& file : files )
+  {
+    if( !file.error.empty() )
+      continue;
+    try
+    {
+      EncryptedInput input{ file.name.c_str() };
+      const auto header = SshCrypt::Container::readHeader( input.stream() );
+      if( header.recipients.empty() )
+      {
+        saltsByKey[ forceKey ? forceKey : header.fingerprint ].push_back( header.salt );
+        continue;
+      }
+
+      if( agentKeys.empty() )
+      {
+        for( const auto& key : SshCrypt::Cryptor::getAvailableKeys() )
+        {
+          agentKeys.push_back( key.sha256 );
+        }
+      }
+      for( const auto& recipient : header.recipients )
+      {
+        if( std::find( agentKeys.begin(), agentKeys.end(), recipient.fingerprint )
+            != agentKeys.end() )
+        {
+          saltsByKey[ recipient.fingerprint ].push_back( recipient.salt );
+          break;
+        }
+      }
+    }
+    catch( const std::exception& )
+    {
+    }
+  }
+
+  for( auto& [ key, salts ] : saltsByKey )
+  {
+    std::sort( salts.begin(), salts.end() );
+    salts.erase( std::unique( salts.begin(), salts.end() ), salts.end() );
+    try
+    {
+      SshCrypt::Cryptor::getSessionKeys( salts, key.empty() ? nullptr : key.c_str() );
+    }
+    catch( const std::exception& ex )
+    {
+      LOG_DEBUG( "prefetch failed: " << ex.what() );
+    }
+  }
+}
+
+//! en- or decrypt every file on a pool of threads, one agent connection and session key
+static int batchFiles( bool encrypt,
+                       const std::vector<BatchFile>& files,
+                       const std::string& suffix,
+                       const char* forceKey,
+                       SshCrypt::WriteMode writeMode,
+                       SshCrypt::Cryptor::Options options )
 {
-  auto cryptedData = SshCrypt::loadFile( inputFilename, SshCrypt::ReadMode::Auto );
-  auto plainData = SshCrypt::Cryptor::decrypt( cryptedData, forceKey );
-  if( plainData.size() < magicWord.size() )
+  const unsigned threads
+      = options.threads ? options.threads : SshCrypt::ThreadPool::defaultThreads();
+  options.threads = 1; // parallel files instead of segments
+
+  SshCrypt::Cryptor::setCacheTimeout( std::chrono::hours{ 1 } );
+  if( !encrypt )
+    prefetchSessionKeys( files, forceKey );
+  SshCrypt::Cryptor::Batch batch;
+  std::vector<std::string> errors( files.size() );
+  {
+    SshCrypt::ThreadPool pool{ threads };
+    std::vector<std::future<void>> results;
+    for( SshCrypt::Size i = 0; i < files.size(); ++i )
+    {
+      errors[ i ] = files[ i ].error;
+      if( !errors[ i ].empty() )
+        continue;
+      results.push_back( pool.submit( [ &, i ]() {
+        try
+        {
+          const std::string& input = files[ i ].name;
+          if( encrypt )
+          {
+            encryptFile(
+                input.c_str(), ( input + suffix ).c_str(), forceKey, writeMode, options );
+          }
+          else
+          {
+            if( input.size() <= suffix.size()
+                || input.compare( input.size() - suffix.size(), suffix.size(), suffix ) != 0 )
+            {
+              throw std::runtime_error{ "name does not end with " + suffix };
+            }
+            const std::string output = input.substr( 0, input.size() - suffix.size() );
+            decryptFile( input.c_str(), output.c_str(), forceKey, writeMode, options );
+          }
+        }
+        catch( const std::exception& ex )
+        {
+          errors[ i ] = ex.what();
+        }
+      } ) );
+    }
+    for( auto& result : results )
+    {
+      result.get();
+    }
+  }
+
+  SshCrypt::Size failed = 0;
+  for( SshCrypt::Size i = 0; i < files.size(); ++i )
   {
-    throw std::runtime_error{ "invalid input (too short)" };
+    if( errors[ i ].empty() )
+    {
+      std::cout << "ok      " << files[ i ].name << "\n";
+    }
+    else
+    {
+      std::cout << "failed  " << files[ i ].name << ": " << errors[ i ] << "\n";
+      ++failed;
+    }
   }
-  const auto magicTest = SshCrypt::Data{ plainData.end() - magicWord.size(), plainData.end() };
-  if( magicTest != magicWord )
+  std::cout << files.size() << " files, " << failed << " failed" << std::endl;
+  return failed ? 1 : 0;
+}
+
+//! file names from arguments, directories (recursive) and stdin for "-". A directory, that
+//! can't be read, is a failed entry of the batch, the others are still searched.
+static std::vector<BatchFile>
+collectFiles( char** args, int count, bool encrypt, const std::string& suffix )
+{
+  namespace fs = std::filesystem;
+  auto isEncrypted = [ &suffix ]( const std::string& name ) {
+    return name.size() > suffix.size()
+           && name.compare( name.size() - suffix.size(), suffix.size(), suffix ) == 0;
+  };
+
+  std::vector<BatchFile> files;
+  for( int i = 0; i < count; ++i )
   {
-    throw std::runtime_error{ "invalid input (bad magic)" };
+    const std::string arg = args[ i ];
+    std::error_code error;
+    if( arg == "-" )
+    {
+      std::string line;
+      while( std::getline( std::cin, line ) )
+      {
+        if( !line.empty() )
+          files.push_back( { line, {} } );
+      }
+    }
+    else if( fs::is_directory( arg, error ) )
+    {
+      fs::recursive_directory_iterator iter{ arg, fs::directory_options::skip_permission_denied,
+                                             error };
+      for( ; !error && iter != fs::recursive_directory_iterator{}; iter.increment( error ) )
+      {
+        const std::string name = iter->path().string();
+        std::error_code typeError;
+        if( iter->is_directory( typeError ) && access( name.c_str(), R_OK | X_OK ) != 0 )
+        {
+          // skip_permission_denied would leave it out without a word
+          const std::string reason = strerror( errno );
+          files.push_back( { name, "can't read directory: " + reason } );
+          iter.disable_recursion_pending();
+        }
+        else if( iter->is_regular_file( typeError ) && isEncrypted( name ) != encrypt )
+        {
+          files.push_back( { name, {} } );
+        }
+      }
+      if( error ) // the iterator ends at the first error
+        files.push_back( { arg, "can't search directory: " + error.message() } );
+    }
+    else
+    {
+      files.push_back( { arg, {} } );
+    }
   }
-  plainData.erase( plainData.end() - magicWord.size(), plainData.end() );
-  SshCrypt::saveFile( plainData, outputFilename, SshCrypt::WriteMode::Raw );
+  return files;
 }
 
-static bool editFile( const char* filename )
+static bool runEditor( const char* filename )
 {
   const char* editor = getenv( "EDITOR" );
   if( !editor )
@@ -73,31 +516,89 @@ static bool editFile( const char* filename )
   return rc == 0;
 }
 
-// RAII class for temporary files
-class TemporaryFile
+// RAII class for the plain text while it is edited, it never has a name on disk: a memfd,
+// or an unlinked file on /dev/shm without memfd_create(), the editor opens it through /proc
+class MemoryFile
 {
 public:
-  TemporaryFile()
+  MemoryFile()
   {
-    int fd = mkstemp( tempFilename );
+    fd = memfd_create( "sshcrypt-edit", MFD_CLOEXEC );
     if( fd == -1 )
     {
-      throw std::runtime_error{ "can't create temporary file" };
+      char tempFilename[] = "/dev/shm/.sshcrypt-XXXXXX";
+      fd = mkostemp( tempFilename, O_CLOEXEC );
+      if( fd != -1 )
+        unlink( tempFilename );
     }
+    if( fd == -1 )
+    {
+      throw std::runtime_error{ "can't create in-memory file" };
+    }
+    path = "/proc/" + std::to_string( getpid() ) + "/fd/" + std::to_string( fd );
   }
 
-  ~TemporaryFile()
-  {
-    // always remove the file
-    remove( tempFilename );
-  }
+  ~MemoryFile() { close( fd ); }
+  MemoryFile( const MemoryFile& ) = delete;
+  MemoryFile& operator=( const MemoryFile& ) = delete;
 
-  const char* name() const { return tempFilename; }
+  const char* name() const { return path.c_str(); }
 
 private:
-  char tempFilename[ 256 ] = "/tmp/.secretXXXXXX";
+  int fd = -1;
+  std::string path;
 };
 
+static SshCrypt::Data hashFile( const char* filename )
+{
+  SshCrypt::MappedFile file{ filename };
+  return SshCrypt::ShaHash::check( SshCrypt::DataView{ file.data(), file.size() } );
+}
+
+//! decrypt, edit, encrypt: nothing is written if the text is unchanged, otherwise it is
+//! encrypted with the salt and session key of the decryption, so the agent is asked once
+static void editFile( const char* inputFilename,
+                      const char* outputFilename,
+                      const char* forceKey,
+                      SshCrypt::WriteMode writeMode,
+                      const SshCrypt::Cryptor::Options& options )
+{
+  MemoryFile plain;
+  SshCrypt::Cryptor::Session session;
+  {
+    EncryptedInput input{ inputFilename };
+    std::ofstream output{ plain.name(), std::ios::binary | std::ios::trunc };
+    SshCrypt::Cryptor::decrypt( input.stream(), output, session, forceKey, options );
+    output.close();
+    if( !output )
+      throw std::runtime_error{ "can't write decrypted file" };
+  }
+
+  const SshCrypt::Data before = hashFile( plain.name() );
+  if( !runEditor( plain.name() ) )
+    return;
+  if( hashFile( plain.name() ) == before && strcmp( inputFilename, outputFilename ) == 0 )
+  {
+    LOG_DEBUG( "unchanged, not encrypted again" );
+    return;
+  }
+  encryptFile( plain.name(), outputFilename, forceKey, writeMode, options, &session );
+}
+
+//! adds and removes recipients, the segments are copied without decrypting them
+static void rewrapFile( const char* inputFilename,
+                        const char* outputFilename,
+                        const char* forceKey,
+                        SshCrypt::WriteMode writeMode,
+                        const std::vector<std::string>& add,
+                        const std::vector<std::string>& remove )
+{
+  EncryptedInput input{ inputFilename };
+  writeEncrypted( outputFilename, writeMode, [ & ]( std::ostream& out ) {
+    SshCrypt::Cryptor::rewrap( input.stream(), out, add, remove, forceKey );
+  } );
+}
+
 int main( int argc, char** argv )
 {
   try
@@ -109,44 +610,108 @@ int main( int argc, char** argv )
       Encrypt,
       Decrypt,
       Editor,
+      Rewrap,
     };
     Operation operation = Operation::Usage;
     SshCrypt::WriteMode writeMode = SshCrypt::WriteMode::Base64;
     const char* forceKey = getenv( "SSHCRYPT_KEY" );
+    SshCrypt::Cryptor::Options options;
+    bool batch = false;
+    bool range = false;
+    SshCrypt::Size rangeOffset = 0;
+    SshCrypt::Size rangeLength = std::numeric_limits<SshCrypt::Size>::max();
+    std::string suffix = ".sshcrypt";
+    std::vector<std::string> removeRecipients;
 
-    static struct option sshCryptOptions[] = { { "binary", no_argument, nullptr, 'b' },
+    static struct option sshCryptOptions[] = { { "batch", no_argument, nullptr, 'B' },
+                                               { "binary", no_argument, nullptr, 'b' },
                                                { "decrypt", no_argument, nullptr, 'd' },
                                                { "encrypt", no_argument, nullptr, 'e' },
                                                { "edit", no_argument, nullptr, 'v' },
+                                               { "hex", no_argument, nullptr, 'x' },
                                                { "key", required_argument, nullptr, 'k' },
                                                { "listkeys", no_argument, nullptr, 'l' },
+                                               { "threads", required_argument, nullptr, 'j' },
+                                               { "method", required_argument, nullptr, 'm' },
+                                               { "range", required_argument, nullptr, 'r' },
+                                               { "suffix", required_argument, nullptr, 's' },
+                                               { "timeout", required_argument, nullptr, 'T' },
+                                               { "version1", no_argument, nullptr, '1' },
+                                               { "compress", no_argument, nullptr, 'z' },
+                                               { "recipient", required_argument, nullptr, 'R' },
+                                               { "drop", required_argument, nullptr, 'D' },
+                                               { "rewrap", no_argument, nullptr, 'w' },
                                                { nullptr, 0, nullptr, 0 } };
     int optionIndex = 0;
 
+    const char* shortOptions = "1BbD:edj:k:lm:R:r:s:T:vwxz";
     int opt;
-    while( ( opt = getopt_long( argc, argv, "bedk:lv", sshCryptOptions, &optionIndex ) ) != -1 )
+    while( ( opt = getopt_long( argc, argv, shortOptions, sshCryptOptions, &optionIndex ) )
+           != -1 )
     {
       switch( opt )
       {
+      case 'B': batch = true; break;
       case 'b': writeMode = SshCrypt::WriteMode::Raw; break;
+      case 'x': writeMode = SshCrypt::WriteMode::Hex; break;
       case 'd': operation = Operation::Decrypt; break;
       case 'e': operation = Operation::Encrypt; break;
       case 'v': operation = Operation::Editor; break;
+      case 'w': operation = Operation::Rewrap; break;
       case 'l': operation = Operation::ListKeys; break;
       case 'k': forceKey = optarg; break;
+      case 'j':
+        options.threads = static_cast<unsigned>(
+            parseNumber( "threads", optarg, 1, SshCrypt::ThreadPool::maxThreads() ) );
+        break;
+      case '1': options.version = 1; break;
+      case 'm': options.method = SshCrypt::SymCrypt::methodByName( optarg ); break;
+      case 'r':
+      {
+        range = true;
+        const std::string value = optarg;
+        const auto colon = value.find( ':' );
+        const auto maxSize = std::numeric_limits<SshCrypt::Size>::max();
+        rangeOffset = parseNumber( "range offset", value.substr( 0, colon ), 0, maxSize );
+        if( colon != std::string::npos )
+          rangeLength = parseNumber( "range length", value.substr( colon + 1 ), 0, maxSize );
+      }
+      break;
+      case 's': suffix = optarg; break;
+      case 'z': options.compression = SshCrypt::Container::Compression::Zlib; break;
+      case 'R': options.recipients.push_back( optarg ); break;
+      case 'D': removeRecipients.push_back( optarg ); break;
+      case 'T':
+        SshCrypt::Cryptor::setAgentTimeout(
+            std::chrono::seconds{ parseNumber( "timeout", optarg, 0, maxSeconds ) } );
+        break;
       default: usage( argv[ 0 ] ); exit( 2 );
       }
     }
 
+    if( range && ( operation != Operation::Decrypt || batch ) )
+      throw UsageError{ "range needs decrypt of a single file" };
+
+    if( batch )
+    {
+      if( operation != Operation::Encrypt && operation != Operation::Decrypt )
+        throw std::runtime_error{ "batch needs encrypt or decrypt" };
+      if( suffix.empty() )
+        throw std::runtime_error{ "batch needs a suffix" };
+      const bool encrypt = operation == Operation::Encrypt;
+      const auto files = collectFiles( argv + optind, argc - optind, encrypt, suffix );
+      return batchFiles( encrypt, files, suffix, forceKey, writeMode, options );
+    }
+
     const char* inputFilename = optind < argc ? argv[ optind++ ] : nullptr;
     const char* outputFilename = optind < argc ? argv[ optind++ ] : nullptr;
     if( optind != argc )
       throw std::runtime_error{ "too many arguments" };
 
-    if( operation == Operation::Editor )
+    if( operation == Operation::Editor || operation == Operation::Rewrap )
     {
       if( !inputFilename )
-        throw std::runtime_error{ "edit needs inputfile" };
+        throw std::runtime_error{ "edit and rewrap need inputfile" };
       if( !outputFilename )
         outputFilename = inputFilename;
     }
@@ -164,25 +729,33 @@ int main( int argc, char** argv )
     }
     break;
     case Operation::Encrypt:
-      encryptFile( inputFilename, outputFilename, forceKey, writeMode );
+      encryptFile( inputFilename, outputFilename, forceKey, writeMode, options );
       break;
     case Operation::Decrypt:
-      decryptFile( inputFilename, outputFilename, forceKey, writeMode );
+      if( range )
+        decryptRange(
+            inputFilename, outputFilename, forceKey, rangeOffset, rangeLength, options );
+      else
+        decryptFile( inputFilename, outputFilename, forceKey, writeMode, options );
       break;
     case Operation::Editor:
-    {
-      TemporaryFile tempFile;
-      decryptFile( inputFilename, tempFile.name(), forceKey, writeMode );
-      if( editFile( tempFile.name() ) )
-      {
-        encryptFile( tempFile.name(), outputFilename, forceKey, writeMode );
-      }
-    }
-    break;
+      editFile( inputFilename, outputFilename, forceKey, writeMode, options );
+      break;
+    case Operation::Rewrap:
+      rewrapFile( inputFilename, outputFilename, forceKey, writeMode, options.recipients,
+                  removeRecipients );
+      break;
     }
   }
+  catch( const UsageError& ex )
+  {
+    std::cerr << ex.what() << std::endl;
+    usage( argv[ 0 ] );
+    return 2;
+  }
   catch( const std::exception& ex )
   {
     std::cerr << "exception: " << ex.what() << std::endl;
+    return 1;
   }
 }
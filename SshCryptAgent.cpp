@@ -0,0 +1,548 @@
+// SPDX-License-Identifier: MIT
+
+// sshcrypt-agent keeps session keys derived by ssh-agent for a limited time and serves
+// them to sshcrypt over a unix domain socket, see SSHCRYPT_EXTENSION_DERIVE_KEY
+
+#include "AgentMessage.h"
+#include "AgentMessageTypes.h"
+#include "AgentComm.h"
+#include "Debug.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <csignal>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <getopt.h>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <openssl/crypto.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string>
+#include <sys/prctl.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <vector>
+
+static void usage( const char* programName )
+{
+  std::cout << "usage: " << programName << " [-f] [-s socket] [-t seconds] [-T seconds]\n"
+            << "  -f,  --foreground  stay in foreground\n"
+            << "  -s,  --socket=PATH bind to PATH, $XDG_RUNTIME_DIR/sshcrypt-agent.sock "
+               "otherweise\n"
+            << "  -t,  --lifetime=N  forget session keys after N seconds (default 600)\n"
+            << "  -T,  --timeout=N   give up if ssh-agent doesn't answer within N seconds\n"
+            << "                     (default 120)\n"
+            << "\n"
+            << "Prints the shell commands to set SSHCRYPT_AGENT_SOCK, sshcrypt uses it to\n"
+            << "ask this agent instead of ssh-agent.\n"
+            << std::endl;
+}
+
+// a century, deadlines this far off don't overflow the clock
+constexpr long maxSeconds = 100L * 365 * 24 * 3600;
+
+//! \a text of option \a name as seconds from \a min to maxSeconds, exits with the usage
+//! otherwise
+static long
+parseSeconds( const char* programName, const char* name, const char* text, long min )
+{
+  char* end = nullptr;
+  errno = 0;
+  const long value = strtol( text, &end, 10 );
+  if( end == text || *end || errno || value < min || value > maxSeconds )
+  {
+    std::cerr << name << " must be a number of seconds from " << min << " to " << maxSeconds
+              << ", not '" << text << "'" << std::endl;
+    usage( programName );
+    exit( 2 );
+  }
+  return value;
+}
+
+static volatile std::sig_atomic_t stopRequested = 0;
+
+static void stopHandler( int )
+{
+  stopRequested = 1;
+}
+
+// session keys in secure memory (see SecureArena), wiped when they expire
+class KeyStore
+{
+public:
+  using Clock = std::chrono::steady_clock;
+
+  KeyStore( std::chrono::seconds theLifetime ) : lifetime{ theLifetime } {}
+  ~KeyStore() { clear(); }
+
+  const SshCrypt::SecureData* find( const std::string& id, const SshCrypt::Data& salt )
+  {
+    expire();
+    auto found = entries.find( std::make_pair( id, salt ) );
+    return found == entries.end() ? nullptr : &found->second.sessionKey;
+  }
+
+  void insert( const std::string& id, const SshCrypt::Data& salt, SshCrypt::Data sessionKey )
+  {
+    if( entries.size() >= maxEntries )
+    {
+      clear();
+    }
+    auto& entry = entries[ std::make_pair( id, salt ) ];
+    entry.sessionKey.assign( sessionKey.begin(), sessionKey.end() );
+    entry.expires = Clock::now() + lifetime;
+    OPENSSL_cleanse( sessionKey.data(), sessionKey.size() );
+  }
+
+  void expire()
+  {
+    const auto now = Clock::now();
+    for( auto iter = entries.begin(); iter != entries.end(); )
+    {
+      if( iter->second.expires <= now )
+      {
+        iter = entries.erase( iter );
+      }
+      else
+      {
+        ++iter;
+      }
+    }
+  }
+
+  void clear() { entries.clear(); }
+
+private:
+  static constexpr SshCrypt::Size maxEntries = 100000;
+
+  struct Entry
+  {
+    SshCrypt::SecureData sessionKey;
+    Clock::time_point expires;
+  };
+
+  const std::chrono::seconds lifetime;
+  std::map<std::pair<std::string, SshCrypt::Data>, Entry> entries;
+};
+
+// the response to one request, a client gets its responses in the order of its requests,
+// even if some have to wait for ssh-agent
+struct Reply
+{
+  bool ready = false;
+  SshCrypt::AgentMessage message;
+
+  void set( SshCrypt::AgentMessage theMessage )
+  {
+    message = std::move( theMessage );
+    ready = true;
+  }
+};
+
+static SshCrypt::AgentMessage sessionKeyResponse( SshCrypt::DataView sessionKey,
+                                                  const std::string& fingerprint )
+{
+  SshCrypt::AgentMessage response{ SSH_AGENT_SUCCESS,
+                                   13 + sessionKey.size() + fingerprint.size() };
+  response.addBlob( sessionKey );
+  response.addBlob( reinterpret_cast<const SshCrypt::Byte*>( fingerprint.data() ),
+                    fingerprint.size() );
+  response.adjustMessageSize();
+  return response;
+}
+
+static void deriveFailed( Reply& reply, const std::exception_ptr& error )
+{
+  try
+  {
+    std::rethrow_exception( error );
+  }
+  catch( const std::exception& ex )
+  {
+    LOG_ERROR( "derive key failed: " << ex.what() );
+  }
+  reply.set( SshCrypt::AgentMessage{ SSH_AGENT_EXTENSION_FAILURE } );
+}
+
+// ssh-agent is connected on the first request and again after a failure, its identities
+// are kept until an unknown id is asked for or a signature fails
+struct Upstream
+{
+  std::unique_ptr<SshCrypt::AsyncAgentComm> agent;
+  std::chrono::milliseconds timeout;
+  std::shared_ptr<const SshCrypt::IdentityTable> identities;
+
+  SshCrypt::AsyncAgentComm& get()
+  {
+    if( !agent )
+    {
+      agent = std::make_unique<SshCrypt::AsyncAgentComm>();
+      agent->setTimeout( timeout );
+    }
+    return *agent;
+  }
+
+  bool busy() const { return agent && agent->busy(); }
+};
+
+// asks ssh-agent for the signature without waiting for it, \a reply is set by the
+// callback, which runs in the poll loop. The key is stored under its fingerprint.
+static void sign( Upstream& upstream,
+                  KeyStore& keyStore,
+                  const SshCrypt::IdentityTable::Entry& entry,
+                  const SshCrypt::Data& salt,
+                  const std::shared_ptr<Reply>& reply )
+{
+  const std::string& fingerprint = entry.fingerprint;
+  const auto done = [ &upstream, &keyStore, fingerprint, salt, reply ](
+                        SshCrypt::Data sessionKey, std::exception_ptr error ) {
+    if( error )
+    {
+      upstream.identities.reset(); // the key may be gone
+      deriveFailed( *reply, error );
+      return;
+    }
+    reply->set( sessionKeyResponse( sessionKey, fingerprint ) );
+    keyStore.insert( fingerprint, salt, std::move( sessionKey ) );
+  };
+  upstream.get().requestSignature( entry.identity.pubkey, salt, done );
+}
+
+static void deriveKey( Upstream& upstream,
+                       KeyStore& keyStore,
+                       const std::string& id,
+                       const SshCrypt::Data& salt,
+                       const std::shared_ptr<Reply>& reply )
+{
+  LOG_DEBUG( "asking ssh-agent" );
+  const char* idOrFirst = id.empty() ? nullptr : id.c_str();
+  const SshCrypt::IdentityTable::Entry* known
+      = upstream.identities ? upstream.identities->find( idOrFirst ) : nullptr;
+  if( known )
+  {
+    sign( upstream, keyStore, *known, salt, reply );
+    return;
+  }
+
+  upstream.get().requestIdentities( [ &upstream, &keyStore, id, salt, reply ](
+                                        std::vector<SshCrypt::AgentComm::Identity> identities,
+                                        std::exception_ptr error ) {
+    try
+    {
+      if( error )
+        std::rethrow_exception( error );
+      upstream.identities = std::make_shared<const SshCrypt::IdentityTable>(
+          std::move( identities ), upstream.identities.get() );
+      const auto& entry = upstream.identities->get( id.empty() ? nullptr : id.c_str() );
+      sign( upstream, keyStore, entry, salt, reply );
+    }
+    catch( const std::exception& )
+    {
+      deriveFailed( *reply, std::current_exception() );
+    }
+  } );
+}
+
+static std::shared_ptr<Reply> handleRequest( const SshCrypt::AgentMessage& request,
+                                             KeyStore& keyStore,
+                                             Upstream& upstream )
+{
+  auto reply = std::make_shared<Reply>();
+  if( request.type() != SSH_AGENTC_EXTENSION )
+  {
+    reply->set( SshCrypt::AgentMessage{ SSH_AGENT_FAILURE } );
+    return reply;
+  }
+
+  try
+  {
+    SshCrypt::Decoder decoder = request.decoder();
+    if( SshCrypt::toString( decoder.getBlob() ) != SSHCRYPT_EXTENSION_DERIVE_KEY )
+    {
+      reply->set( SshCrypt::AgentMessage{ SSH_AGENT_FAILURE } );
+      return reply;
+    }
+    const std::string id = SshCrypt::toString( decoder.getBlob() );
+    const SshCrypt::Data salt = decoder.getBlobData();
+
+    // without an id the first key, once the identities are known
+    const SshCrypt::IdentityTable::Entry* known
+        = upstream.identities ? upstream.identities->find( id.empty() ? nullptr : id.c_str() )
+                              : nullptr;
+    const std::string& fingerprint = known ? known->fingerprint : id;
+    const SshCrypt::SecureData* sessionKey = keyStore.find( fingerprint, salt );
+    if( sessionKey )
+      reply->set( sessionKeyResponse( *sessionKey, fingerprint ) );
+    else
+      deriveKey( upstream, keyStore, id, salt, reply );
+  }
+  catch( const std::exception& )
+  {
+    deriveFailed( *reply, std::current_exception() );
+  }
+  return reply;
+}
+
+// a connected sshcrypt, requests are read and replies are sent without blocking the other
+// clients
+struct Client
+{
+  static constexpr SshCrypt::Size maxMessageSize = 256 * 1024;
+  // a client, that doesn't read its replies, isn't read from either beyond this
+  static constexpr SshCrypt::Size maxReplies = 64;
+
+  explicit Client( int theFd ) : fd{ theFd } {}
+
+  int fd = -1;
+  SshCrypt::MessageReader requests{ maxMessageSize };
+  std::deque<std::shared_ptr<Reply>> replies;
+  SshCrypt::Size sent = 0; // of the first reply
+
+  //! the events to poll for
+  short events() const
+  {
+    short result = 0;
+    if( replies.size() < maxReplies )
+      result |= POLLIN;
+    if( !replies.empty() && replies.front()->ready )
+      result |= POLLOUT;
+    return result;
+  }
+
+  //! false if the client is gone or misbehaves
+  bool receive( KeyStore& keyStore, Upstream& upstream )
+  {
+    const SshCrypt::Size room = requests.prepare( 4096 );
+    ssize_t rl = recv( fd, requests.tail(), room, MSG_DONTWAIT );
+    if( rl < 0 && ( errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ) )
+      return true;
+    if( rl <= 0 )
+      return false;
+
+    requests.commit( static_cast<SshCrypt::Size>( rl ) );
+    try
+    {
+      SshCrypt::AgentMessage message;
+      while( requests.next( message ) )
+      {
+        replies.push_back( handleRequest( message, keyStore, upstream ) );
+      }
+    }
+    catch( const std::exception& )
+    {
+      return false;
+    }
+    return true;
+  }
+
+  //! sends the replies, that are ready, as far as the socket takes them, false if the
+  //! client is gone
+  bool flush()
+  {
+    while( !replies.empty() && replies.front()->ready )
+    {
+      const auto& out = replies.front()->message.getData();
+      const ssize_t sl
+          = send( fd, out.data() + sent, out.size() - sent, MSG_DONTWAIT | MSG_NOSIGNAL );
+      if( sl < 0 && ( errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ) )
+        return true; // the rest goes out on POLLOUT
+      if( sl <= 0 )
+        return false;
+      sent += static_cast<SshCrypt::Size>( sl );
+      if( sent < out.size() )
+        return true;
+      sent = 0;
+      replies.pop_front();
+    }
+    return true;
+  }
+};
+
+static std::string defaultSocketName()
+{
+  const char* runtimeDir = getenv( "XDG_RUNTIME_DIR" );
+  if( runtimeDir && *runtimeDir )
+  {
+    return std::string{ runtimeDir } + "/sshcrypt-agent.sock";
+  }
+
+  char dirName[] = "/tmp/sshcrypt-XXXXXX";
+  if( !mkdtemp( dirName ) )
+  {
+    throw std::runtime_error{ "can't create socket directory" };
+  }
+  return std::string{ dirName } + "/agent." + std::to_string( getpid() );
+}
+
+static int listenSocket( const std::string& socketName )
+{
+  if( socketName.size() >= sizeof( sockaddr_un::sun_path ) )
+  {
+    throw std::runtime_error{ "unix domain socket path to long" };
+  }
+
+  int sock = socket( PF_UNIX, SOCK_STREAM, 0 );
+  if( sock == -1 )
+  {
+    throw std::runtime_error{ "can't create unix-domain socket" };
+  }
+
+  struct sockaddr_un addr;
+  memset( &addr, 0, sizeof addr );
+  addr.sun_family = AF_UNIX;
+  strncpy( addr.sun_path, socketName.c_str(), sizeof addr.sun_path - 1 );
+
+  // only the owner may connect
+  const mode_t oldMask = umask( 0177 );
+  const int rc = bind( sock, reinterpret_cast<struct sockaddr*>( &addr ), sizeof addr );
+  umask( oldMask );
+  if( rc == -1 || listen( sock, 128 ) == -1 )
+  {
+    close( sock );
+    throw std::runtime_error{ "can't bind " + socketName + ": " + strerror( errno ) };
+  }
+  return sock;
+}
+
+static bool sameUser( int fd )
+{
+  struct ucred cred;
+  socklen_t length = sizeof cred;
+  return getsockopt( fd, SOL_SOCKET, SO_PEERCRED, &cred, &length ) == 0 && cred.uid == getuid();
+}
+
+int main( int argc, char** argv )
+{
+  std::string socketName;
+  bool bound = false;
+  try
+  {
+    bool foreground = false;
+    long lifetime = 600;
+    long timeout = 120;
+
+    static struct option agentOptions[] = { { "foreground", no_argument, nullptr, 'f' },
+                                            { "socket", required_argument, nullptr, 's' },
+                                            { "lifetime", required_argument, nullptr, 't' },
+                                            { "timeout", required_argument, nullptr, 'T' },
+                                            { "help", no_argument, nullptr, 'h' },
+                                            { nullptr, 0, nullptr, 0 } };
+    int optionIndex = 0;
+
+    int opt;
+    while( ( opt = getopt_long( argc, argv, "fhs:t:T:", agentOptions, &optionIndex ) ) != -1 )
+    {
+      switch( opt )
+      {
+      case 'f': foreground = true; break;
+      case 's': socketName = optarg; break;
+      case 't': lifetime = parseSeconds( argv[ 0 ], "lifetime", optarg, 1 ); break;
+      case 'T': timeout = parseSeconds( argv[ 0 ], "timeout", optarg, 0 ); break;
+      case 'h': usage( argv[ 0 ] ); exit( 0 );
+      default: usage( argv[ 0 ] ); exit( 2 );
+      }
+    }
+    if( optind != argc )
+      throw std::runtime_error{ "too many arguments" };
+
+    // never ask ourself and keep the keys out of core dumps
+    unsetenv( "SSHCRYPT_AGENT_SOCK" );
+    prctl( PR_SET_DUMPABLE, 0 );
+    struct rlimit noCore = { 0, 0 };
+    setrlimit( RLIMIT_CORE, &noCore );
+
+    if( socketName.empty() )
+      socketName = defaultSocketName();
+    const int listenFd = listenSocket( socketName );
+    bound = true;
+
+    std::cout << "SSHCRYPT_AGENT_SOCK=" << socketName << "; export SSHCRYPT_AGENT_SOCK;"
+              << std::endl;
+    if( !foreground && daemon( 0, 0 ) == -1 )
+    {
+      throw std::runtime_error{ "can't run in background" };
+    }
+
+    struct sigaction action;
+    memset( &action, 0, sizeof action );
+    action.sa_handler = stopHandler;
+    sigaction( SIGINT, &action, nullptr );
+    sigaction( SIGTERM, &action, nullptr );
+    signal( SIGPIPE, SIG_IGN );
+
+    KeyStore keyStore{ std::chrono::seconds{ lifetime } };
+    Upstream upstream{ nullptr, std::chrono::seconds{ timeout }, nullptr };
+    std::vector<Client> clients;
+
+    // ssh-agent is polled together with the clients, a slow answer (e.g. a security key,
+    // that waits for a touch) doesn't hold up the others
+    while( !stopRequested )
+    {
+      const bool upstreamBusy = upstream.busy();
+      std::vector<pollfd> fds;
+      fds.push_back( pollfd{ listenFd, POLLIN, 0 } );
+      fds.push_back( upstreamBusy
+                         ? pollfd{ upstream.agent->fd(), upstream.agent->events(), 0 }
+                         : pollfd{ -1, 0, 0 } );
+      for( const auto& client : clients )
+      {
+        fds.push_back( pollfd{ client.fd, client.events(), 0 } );
+      }
+
+      int pollTimeout = 1000;
+      if( upstreamBusy && upstream.agent->pollTimeout() >= 0 )
+        pollTimeout = std::min( pollTimeout, upstream.agent->pollTimeout() );
+      if( poll( fds.data(), fds.size(), pollTimeout ) < 0 )
+      {
+        if( errno == EINTR )
+          continue;
+        throw std::runtime_error{ "poll failed" };
+      }
+      keyStore.expire();
+      if( upstreamBusy )
+        upstream.agent->handleEvents( fds[ 1 ].revents );
+
+      for( SshCrypt::Size i = fds.size(); i-- > 2; )
+      {
+        auto& client = clients[ i - 2 ];
+        const bool readable = fds[ i ].revents & ( POLLIN | POLLHUP | POLLERR );
+        if( ( readable && !client.receive( keyStore, upstream ) ) || !client.flush() )
+        {
+          close( client.fd );
+          clients.erase( clients.begin() + static_cast<std::ptrdiff_t>( i - 2 ) );
+        }
+      }
+
+      if( fds[ 0 ].revents & POLLIN )
+      {
+        int fd = accept( listenFd, nullptr, nullptr );
+        if( fd != -1 && sameUser( fd ) )
+          clients.emplace_back( fd );
+        else if( fd != -1 )
+          close( fd );
+      }
+    }
+
+    for( const auto& client : clients )
+    {
+      close( client.fd );
+    }
+    close( listenFd );
+    unlink( socketName.c_str() );
+  }
+  catch( const std::exception& ex )
+  {
+    std::cerr << "exception: " << ex.what() << std::endl;
+    if( bound )
+      unlink( socketName.c_str() );
+    return 1;
+  }
+}
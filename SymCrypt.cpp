@@ -2,37 +2,83 @@
 
 #include "SymCrypt.h"
 
+#include "AgentMessage.h"
 #include "Debug.h"
 
+#include <algorithm>
 #include <openssl/evp.h>
 #include <stdexcept>
 
 namespace SshCrypt
 {
-SymCrypt::SymCrypt( const Data& theKey, const Data& theIv, Method theMethod ) :
-    method{ theMethod }, key{ theKey }, iv{ theIv }, ctx{ EVP_CIPHER_CTX_new() }
+SymCrypt::Method SymCrypt::methodByName( const std::string& name ) // static
 {
-  privateInit();
+  for( Method method : { AES256CBC, AES256GCM, CHACHA20POLY1305 } )
+  {
+    if( name == methodName( method ) )
+      return method;
+  }
+  throw std::runtime_error{ "unknown method " + name };
+}
+
+const char* SymCrypt::methodName( Method method ) // static
+{
+  switch( method )
+  {
+  case SymCrypt::Method::AES256CBC: return "aes256cbc";
+  case SymCrypt::Method::AES256GCM: return "aes256gcm";
+  case SymCrypt::Method::CHACHA20POLY1305: return "chacha20poly1305";
+  }
+  return "unknown";
+}
+
+bool SymCrypt::isAead( Method method ) // static
+{
+  return method == Method::AES256GCM || method == Method::CHACHA20POLY1305;
+}
+
+Size SymCrypt::ivSize( Method method ) // static
+{
+  return isAead( method ) ? 12 : 16;
+}
+
+SymCrypt::SymCrypt( DataView theKey, DataView theIv, Method theMethod ) :
+    method{ theMethod },
+    iv( theIv.begin(), theIv.end() ),
+    encryptCtx{ EVP_CIPHER_CTX_new() },
+    decryptCtx{ EVP_CIPHER_CTX_new() }
+{
+  try
+  {
+    privateInit( theKey );
+  }
+  catch( ... )
+  {
+    EVP_CIPHER_CTX_free( encryptCtx );
+    EVP_CIPHER_CTX_free( decryptCtx );
+    throw;
+  }
 }
 
 SymCrypt::~SymCrypt()
 {
-  EVP_CIPHER_CTX_free( ctx );
+  EVP_CIPHER_CTX_free( encryptCtx );
+  EVP_CIPHER_CTX_free( decryptCtx );
 }
 
-void SymCrypt::privateInit()
+void SymCrypt::privateInit( DataView key )
 {
-  if( !ctx )
+  if( !encryptCtx || !decryptCtx )
   {
     throw std::runtime_error{ "EVP_CIPHER_CTX_new() failed" };
   }
 
   switch( method )
   {
-  case SymCrypt::Method::AES256CBC:
-    cipher = EVP_aes_256_cbc();
-    break;
-    // default: throw std::runtime_error{ "unknown cipher" };
+  case SymCrypt::Method::AES256CBC: cipher = EVP_aes_256_cbc(); break;
+  case SymCrypt::Method::AES256GCM: cipher = EVP_aes_256_gcm(); break;
+  case SymCrypt::Method::CHACHA20POLY1305: cipher = EVP_chacha20_poly1305(); break;
+  default: throw std::runtime_error{ "unknown cipher" };
   }
 
   if( static_cast<int>( key.size() ) != EVP_CIPHER_key_length( cipher ) )
@@ -48,77 +94,259 @@ void SymCrypt::privateInit()
                                 << EVP_CIPHER_iv_length( cipher ) );
     throw std::runtime_error{ "bad iv size" };
   }
+
+  // expand the key once for each direction, begin only sets the iv
+  if( !EVP_EncryptInit_ex( encryptCtx, cipher, nullptr, key.data(), nullptr ) )
+  {
+    throw std::runtime_error{ "EVP_EncryptInit_ex() failed" };
+  }
+  if( !EVP_DecryptInit_ex( decryptCtx, cipher, nullptr, key.data(), nullptr ) )
+  {
+    throw std::runtime_error{ "EVP_DecryptInit_ex() failed" };
+  }
 }
 
-Data SymCrypt::encrypt( const Data& plainData ) const
+void SymCrypt::setIv( DataView newIv )
 {
-  const int blockSize = EVP_CIPHER_block_size( cipher );
-  const int resultLength
-      = static_cast<int>( plainData.size() )
-        + ( blockSize - ( static_cast<int>( plainData.size() ) % blockSize ) );
-  Data encryptedData;
-  encryptedData.resize( static_cast<Size>( resultLength ), 0 );
+  if( newIv.size() != iv.size() )
+  {
+    throw std::runtime_error{ "bad iv size" };
+  }
+  std::copy( newIv.begin(), newIv.end(), iv.begin() );
+}
 
-  if( !EVP_EncryptInit_ex( ctx, cipher, nullptr, key.data(), iv.data() ) )
+/*
+ * packed records: for each record the iv and the encrypted record as blobs
+ * (4 bytes size in network byte order, data)
+ */
+Data SymCrypt::encryptPacked( const std::vector<Data>& records ) const
+{
+  const Size ivLength = iv.size();
+  const Data ivs = makeRandom( ivLength * records.size() );
+
+  Size packedSize = 0;
+  for( const auto& record : records )
   {
-    throw std::runtime_error{ "EVP_EncryptInit_ex() failed" };
+    packedSize += 4 + ivLength + 4 + record.size() + blockSize() + tagSize;
   }
 
-  int encryptLength = 0;
-  if( !EVP_EncryptUpdate( ctx,
-                          encryptedData.data(),
-                          &encryptLength,
-                          plainData.data(),
-                          static_cast<int>( plainData.size() ) ) )
+  Data packed;
+  packed.reserve( packedSize );
+  Data encrypted;
+  for( Size i = 0; i < records.size(); ++i )
   {
-    throw std::runtime_error{ "EVP_EncryptUpdate() failed" };
+    const DataView recordIv{ ivs.data() + i * ivLength, ivLength };
+    encrypted.clear();
+    privateBegin( encryptCtx, recordIv.data() );
+    update( records[ i ].data(), records[ i ].size(), encrypted );
+    finish( encrypted );
+
+    for( DataView blob : { recordIv, DataView{ encrypted } } )
+    {
+      const Size pos = packed.size();
+      packed.resize( pos + 4 );
+      Decoder::int2net( blob.size(), packed.data() + pos );
+      packed.insert( packed.end(), blob.begin(), blob.end() );
+    }
   }
+  return packed;
+}
 
-  int paddingLength = 0;
-  if( !EVP_EncryptFinal_ex( ctx, encryptedData.data() + encryptLength, &paddingLength ) )
+std::vector<Data> SymCrypt::decryptPacked( const Data& packed ) const
+{
+  std::vector<Data> records;
+  Decoder decoder{ packed };
+  while( decoder.bytesLeft() )
   {
-    throw std::runtime_error{ "EVP_EncryptFinal_ex() failed" };
+    const DataView recordIv = decoder.getBlob();
+    if( recordIv.size() != iv.size() )
+    {
+      throw std::runtime_error{ "bad iv size" };
+    }
+    records.emplace_back();
+    privateDecrypt( decoder.getBlob(), DataView{}, records.back(), recordIv.data() );
   }
+  return records;
+}
 
-  const int totalLength = encryptLength + paddingLength;
-  if( totalLength != resultLength )
-    abort();
+Data SymCrypt::encrypt( DataView plainData, DataView aad ) const
+{
+  Data encryptedData;
+  encryptedData.reserve( plainData.size() + blockSize() + tagSize );
 
+  beginEncrypt();
+  updateAad( aad.data(), aad.size() );
+  update( plainData.data(), plainData.size(), encryptedData );
+  finish( encryptedData );
   return encryptedData;
 }
 
-Data SymCrypt::decrypt( const Data& encryptedData ) const
+Data SymCrypt::decrypt( DataView encryptedData, DataView aad ) const
 {
   Data decryptedData;
-  decryptedData.resize( encryptedData.size(), 0 );
+  privateDecrypt( encryptedData, aad, decryptedData, iv.data() );
+  return decryptedData;
+}
+
+void SymCrypt::decrypt( DataView encryptedData, DataView aad, SecureData& plainData ) const
+{
+  privateDecrypt( encryptedData, aad, plainData, iv.data() );
+}
 
-  if( !EVP_DecryptInit_ex( ctx, cipher, nullptr, key.data(), iv.data() ) )
+template <class Buffer>
+void SymCrypt::privateDecrypt( DataView encryptedData,
+                               DataView aad,
+                               Buffer& decryptedData,
+                               const Byte* theIv ) const
+{
+  Size encryptedSize = encryptedData.size();
+  if( isAead( method ) )
   {
-    throw std::runtime_error{ "EVP_DecryptInit_ex() failed" };
+    if( encryptedSize < tagSize )
+    {
+      throw std::runtime_error{ "encrypted data too short" };
+    }
+    encryptedSize -= tagSize;
+  }
+
+  decryptedData.clear();
+  decryptedData.reserve( encryptedSize + blockSize() );
+
+  privateBegin( decryptCtx, theIv );
+  updateAad( aad.data(), aad.size() );
+  privateUpdate( encryptedData.data(), encryptedSize, decryptedData );
+  if( isAead( method ) )
+  {
+    setTag( encryptedData.data() + encryptedSize );
+  }
+  privateFinish( decryptedData );
+}
+
+Size SymCrypt::blockSize() const
+{
+  return static_cast<Size>( EVP_CIPHER_block_size( cipher ) );
+}
+
+void SymCrypt::beginEncrypt() const
+{
+  privateBegin( encryptCtx, iv.data() );
+}
+
+void SymCrypt::beginDecrypt() const
+{
+  privateBegin( decryptCtx, iv.data() );
+}
+
+//! starts a message with \a theIv on the key schedule of \a theCtx
+void SymCrypt::privateBegin( EVP_CIPHER_CTX* theCtx, const Byte* theIv ) const
+{
+  ctx = theCtx;
+  if( !EVP_CipherInit_ex( ctx, nullptr, nullptr, nullptr, theIv, -1 ) )
+  {
+    throw std::runtime_error{ "EVP_CipherInit_ex() failed" };
   }
+}
 
-  int decryptLength = 0;
-  if( !EVP_DecryptUpdate( ctx,
-                          decryptedData.data(),
-                          &decryptLength,
-                          encryptedData.data(),
-                          static_cast<int>( encryptedData.size() ) ) )
+//! additional authenticated data for aead methods, must be set before update()
+void SymCrypt::updateAad( const Byte* aad, Size aadSize ) const
+{
+  if( aadSize == 0 )
+    return;
+
+  if( !isAead( method ) )
   {
-    throw std::runtime_error{ "EVP_DecryptUpdate() failed" };
+    throw std::runtime_error{ "additional data needs an aead method" };
   }
 
-  int paddingLength = 0;
-  if( !EVP_DecryptFinal_ex( ctx, decryptedData.data() + decryptLength, &paddingLength ) )
+  int length = 0;
+  if( !EVP_CipherUpdate( ctx, nullptr, &length, aad, static_cast<int>( aadSize ) ) )
   {
-    throw std::runtime_error{ "EVP_DecryptFinal_ex() failed" };
+    throw std::runtime_error{ "EVP_CipherUpdate() failed" };
   }
+}
 
-  const int totalLength = decryptLength + paddingLength;
-  if( totalLength > static_cast<int>( encryptedData.size() ) )
-    abort();
+//! set the expected tag of \a tagSize bytes before finish() of an aead decryption
+void SymCrypt::setTag( const Byte* tag ) const
+{
+  if( !EVP_CIPHER_CTX_ctrl(
+          ctx, EVP_CTRL_AEAD_SET_TAG, static_cast<int>( tagSize ), const_cast<Byte*>( tag ) ) )
+  {
+    throw std::runtime_error{ "EVP_CTRL_AEAD_SET_TAG failed" };
+  }
+}
 
-  decryptedData.resize( static_cast<Size>( totalLength ) );
-  return decryptedData;
+//! append the result of en- or decrypting \a input to \a output
+void SymCrypt::update( const Byte* input, Size inputSize, Data& output ) const
+{
+  privateUpdate( input, inputSize, output );
+}
+
+void SymCrypt::update( const Byte* input, Size inputSize, SecureData& output ) const
+{
+  privateUpdate( input, inputSize, output );
+}
+
+template <class Buffer>
+void SymCrypt::privateUpdate( const Byte* input, Size inputSize, Buffer& output ) const
+{
+  // EVP_CipherUpdate() takes an int, so feed huge buffers in pieces
+  constexpr Size maxPiece = 1u << 30;
+
+  while( inputSize > 0 )
+  {
+    const Size piece = std::min( inputSize, maxPiece );
+    const Size offset = output.size();
+    output.resize( offset + piece + blockSize() );
+
+    int length = 0;
+    if( !EVP_CipherUpdate(
+            ctx, output.data() + offset, &length, input, static_cast<int>( piece ) ) )
+    {
+      throw std::runtime_error{ "EVP_CipherUpdate() failed" };
+    }
+    output.resize( offset + static_cast<Size>( length ) );
+    input += piece;
+    inputSize -= piece;
+  }
+}
+
+//! append the final block (with padding when encrypting, or the tag for aead) to \a output
+void SymCrypt::finish( Data& output ) const
+{
+  privateFinish( output );
+}
+
+void SymCrypt::finish( SecureData& output ) const
+{
+  privateFinish( output );
+}
+
+template <class Buffer>
+void SymCrypt::privateFinish( Buffer& output ) const
+{
+  const Size offset = output.size();
+  output.resize( offset + blockSize() );
+
+  int length = 0;
+  if( !EVP_CipherFinal_ex( ctx, output.data() + offset, &length ) )
+  {
+    if( isAead( method ) )
+      throw std::runtime_error{ "authentication failed" };
+    throw std::runtime_error{ "EVP_CipherFinal_ex() failed" };
+  }
+  output.resize( offset + static_cast<Size>( length ) );
+
+  if( isAead( method ) && EVP_CIPHER_CTX_is_encrypting( ctx ) )
+  {
+    output.resize( output.size() + tagSize );
+    if( !EVP_CIPHER_CTX_ctrl( ctx,
+                              EVP_CTRL_AEAD_GET_TAG,
+                              static_cast<int>( tagSize ),
+                              output.data() + output.size() - tagSize ) )
+    {
+      throw std::runtime_error{ "EVP_CTRL_AEAD_GET_TAG failed" };
+    }
+  }
 }
 
 } // namespace SshCrypt
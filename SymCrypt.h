@@ -4,6 +4,8 @@
 
 #include "Data.h"
 
+#include <string>
+
 // aus <openssl/ossl_typ.h>
 typedef struct evp_cipher_ctx_st EVP_CIPHER_CTX;
 typedef struct evp_cipher_st EVP_CIPHER;
@@ -15,23 +17,69 @@ class SymCrypt
 public:
   enum Method
   {
-    AES256CBC
+    AES256CBC,
+    AES256GCM,        // aead
+    CHACHA20POLY1305, // aead
   };
 
-  SymCrypt( const Data& key, const Data& iv, Method method = Method::AES256CBC );
+  static constexpr Size tagSize = 16; // appended by aead methods
+
+  static Method methodByName( const std::string& name );
+  static const char* methodName( Method );
+  static bool isAead( Method );
+  static Size ivSize( Method );
+
+  SymCrypt( DataView key, DataView iv, Method method = Method::AES256CBC );
   ~SymCrypt();
+  SymCrypt( const SymCrypt& ) = delete;
+  SymCrypt& operator=( const SymCrypt& ) = delete;
+
+  // the key schedule is set up once, only the iv changes between messages
+  void setIv( DataView newIv );
+
+  // for aead methods the tag is appended to the encrypted data
+  Data encrypt( DataView plainData, DataView aad = DataView{} ) const;
+  Data decrypt( DataView encryptedData, DataView aad = DataView{} ) const;
+  //! decrypts into \a plainData, which keeps its capacity for the next one
+  void decrypt( DataView encryptedData, DataView aad, SecureData& plainData ) const;
+
+  // many small records with the same key, each gets a random iv, packed into one buffer.
+  // the iv of the object is left alone
+  Data encryptPacked( const std::vector<Data>& records ) const;
+  std::vector<Data> decryptPacked( const Data& packed ) const;
 
-  Data encrypt( const Data& plainData ) const;
-  Data decrypt( const Data& encryptedData ) const;
+  // incremental interface: begin, update for each chunk, finish
+  // for aead methods finish() appends the tag when encrypting, when decrypting the tag
+  // must be set with setTag() before finish()
+  void beginEncrypt() const;
+  void beginDecrypt() const;
+  void updateAad( const Byte* aad, Size aadSize ) const;
+  void update( const Byte* input, Size inputSize, Data& output ) const;
+  void update( const Byte* input, Size inputSize, SecureData& output ) const;
+  void setTag( const Byte* tag ) const;
+  void finish( Data& output ) const;
+  void finish( SecureData& output ) const;
+  Size blockSize() const;
 
 private:
   const Method method = Method::AES256CBC;
-  const Data key;
-  const Data iv;
+  SecureData iv;
   const EVP_CIPHER* cipher = nullptr;
-  EVP_CIPHER_CTX* ctx = nullptr;
+  EVP_CIPHER_CTX* encryptCtx = nullptr; // with key schedule for encryption
+  EVP_CIPHER_CTX* decryptCtx = nullptr; // with key schedule for decryption
+  mutable EVP_CIPHER_CTX* ctx = nullptr; // the one in use
 
-  void privateInit();
+  void privateInit( DataView key );
+  void privateBegin( EVP_CIPHER_CTX* theCtx, const Byte* theIv ) const;
+  template <class Buffer>
+  void privateUpdate( const Byte* input, Size inputSize, Buffer& output ) const;
+  template <class Buffer>
+  void privateFinish( Buffer& output ) const;
+  template <class Buffer>
+  void privateDecrypt( DataView encryptedData,
+                       DataView aad,
+                       Buffer& plainData,
+                       const Byte* theIv ) const;
 };
 
 } // namespace SshCrypt
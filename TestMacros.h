@@ -25,6 +25,10 @@ inline std::string debugString( const SshCrypt::Data& value )
 {
   return SshCrypt::toString( value );
 }
+inline std::string debugString( const SshCrypt::SecureData& value )
+{
+  return SshCrypt::toString( value );
+}
 
 #define TEST_VERIFY( condition )                                                               \
   do                                                                                           \
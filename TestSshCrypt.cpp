@@ -1,20 +1,169 @@
 // SPDX-License-Identifier: MIT
 
 #include "AgentMessage.h"
-// #include "Cryptor.h"
+#include "AgentMessageTypes.h"
+#include "Base64.h"
+#include "Container.h"
+#include "AgentComm.h"
+#include "Cryptor.h"
 #include "Debug.h"
+#include "Hex.h"
+#include "MockAgent.h"
 #include "ShaHash.h"
 #include "SymCrypt.h"
 #include "TestMacros.h"
 
+#include <algorithm>
+#include <cctype>
+#include <csignal>
+#include <fcntl.h>
+#include <filesystem>
+#include <fstream>
+#include <future>
+#include <poll.h>
+#include <openssl/evp.h>
+#include <sstream>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <thread>
+#include <unistd.h>
+
 namespace SshCrypt
 {
+std::string programDirectory; // of this program, sshcrypt and sshcrypt-agent are built there
+
+//! \a program of programDirectory started with \a args, its output goes to /dev/null. It is
+//! stopped at the latest when this goes out of scope, so a failed test leaves nothing behind.
+class Process
+{
+public:
+  Process( const std::string& program, const std::vector<std::string>& args )
+  {
+    const std::string path = programDirectory + program;
+    std::vector<char*> argv{ const_cast<char*>( path.c_str() ) };
+    for( const auto& arg : args )
+    {
+      argv.push_back( const_cast<char*>( arg.c_str() ) );
+    }
+    argv.push_back( nullptr );
+
+    pid = fork();
+    if( pid == 0 )
+    {
+      const int devNull = open( "/dev/null", O_RDWR );
+      dup2( devNull, STDOUT_FILENO );
+      dup2( devNull, STDERR_FILENO );
+      execv( argv[ 0 ], argv.data() );
+      _exit( 127 );
+    }
+  }
+  ~Process() { stop(); }
+  Process( const Process& ) = delete;
+  Process& operator=( const Process& ) = delete;
+
+  //! the exit code, -1 if it didn't exit normally
+  int wait()
+  {
+    int status = 0;
+    if( pid <= 0 || waitpid( pid, &status, 0 ) != pid )
+      return -1;
+    pid = -1;
+    return WIFEXITED( status ) ? WEXITSTATUS( status ) : -1;
+  }
+
+  int stop()
+  {
+    if( pid > 0 )
+      kill( pid, SIGTERM );
+    return wait();
+  }
+
+private:
+  pid_t pid = -1;
+};
+
 void test_Data()
 {
   const char testdata[] = "dideldadeldum";
   const auto* a = &testdata[ 0 ];
   const auto* b = &testdata[ sizeof testdata ];
   Data data{ a, b };
+
+  // small requests come from the buffered block, large ones directly from the CSPRNG
+  for( Size size : { 0, 1, 12, 32, 4095, 4096, 100000 } )
+  {
+    TEST_COMPARE( makeRandom( size ).size(), size );
+  }
+  TEST_VERIFY( makeRandom( 32 ) != makeRandom( 32 ) );
+  TEST_VERIFY( makeRandom( 100000 ) != makeRandom( 100000 ) );
+
+  const Data digits = makeRandom( 10000, '0', '9' );
+  TEST_VERIFY( std::all_of( digits.begin(), digits.end(),
+                            []( Byte c ) { return c >= '0' && c <= '9'; } ) );
+  for( Byte digit = '0'; digit <= '9'; ++digit )
+  {
+    TEST_VERIFY( std::count( digits.begin(), digits.end(), digit ) > 0 );
+  }
+  const Data fixed = makeRandom( 100, 7, 7 );
+  TEST_VERIFY( std::all_of( fixed.begin(), fixed.end(), []( Byte c ) { return c == 7; } ) );
+
+  // every thread has its own block, they must not hand out the same bytes
+  Data other;
+  std::thread thread{ [ &other ]() { other = makeRandom( 64 ); } };
+  thread.join();
+  TEST_VERIFY( other != makeRandom( 64 ) );
+}
+
+void test_SecureData()
+{
+  // a freed block is wiped and handed out again for the same size
+  for( Size size : { 1, 64, 65, 5000, 16384, 16385, 1024 * 1024 } )
+  {
+    Byte* block = static_cast<Byte*>( SecureArena::allocate( size ) );
+    std::fill( block, block + size, 0xa5 );
+    SecureArena::deallocate( block, size );
+    Byte* again = static_cast<Byte*>( SecureArena::allocate( size ) );
+    TEST_VERIFY( again == block );
+    TEST_VERIFY( std::all_of( again, again + size, []( Byte c ) { return c == 0; } ) );
+    SecureArena::deallocate( again, size );
+  }
+
+  SecureData secret( 100, 'x' );
+  secret.resize( 100000, 'y' ); // moved to a large block
+  TEST_VERIFY( std::count( secret.begin(), secret.end(), 'y' ) == 100000 - 100 );
+  TEST_VERIFY( DataView{ secret } == DataView{ SecureData( secret ) } );
+
+  // decrypting into a buffer keeps it
+  const Data key = makeRandom( 32 );
+  const Data iv = makeRandom( 12 );
+  const SymCrypt aes{ key, iv, SymCrypt::Method::AES256GCM };
+  const Data plain = makeRandom( 50000 );
+  SecureData decrypted;
+  aes.decrypt( aes.encrypt( plain ), {}, decrypted );
+  TEST_COMPARE( decrypted, plain );
+  const Byte* buffer = decrypted.data();
+  aes.decrypt( aes.encrypt( Data( plain.begin(), plain.begin() + 1000 ) ), {}, decrypted );
+  TEST_COMPARE( decrypted, Data( plain.begin(), plain.begin() + 1000 ) );
+  TEST_VERIFY( decrypted.data() == buffer );
+
+  // shared by the threads of a pipeline
+  std::vector<std::thread> threads;
+  for( int i = 0; i < 4; ++i )
+  {
+    threads.emplace_back( []() {
+      for( int round = 0; round < 1000; ++round )
+      {
+        SecureData data( static_cast<Size>( 32 << ( round % 12 ) ), 1 );
+        data.push_back( 2 );
+      }
+    } );
+  }
+  for( auto& thread : threads )
+  {
+    thread.join();
+  }
 }
 
 void test_Hex()
@@ -24,6 +173,81 @@ void test_Hex()
   TEST_COMPARE( toHex( data ), "4142434445464748494a4b4c4d4e4f50" );
   LOG_DEBUG( "separated: " << toHex( data, "," ) );
   TEST_COMPARE( toHex( data, "," ), "41,42,43,44,45,46,47,48,49,4a,4b,4c,4d,4e,4f,50" );
+  TEST_COMPARE( toHex( data, ", " ).size(), Hex::encodedSize( data.size(), 2 ) );
+  TEST_COMPARE( toHex( Data{}, "," ), "" );
+  TEST_COMPARE( toHex( Data{ 0x00, 0xff } ), "00ff" );
+
+  TEST_COMPARE( fromHex( "4142434445464748494a4b4c4d4e4f50" ), data );
+  TEST_COMPARE( fromHex( " 41 42\n4A4b\r\n" ), fromString( "ABJK" ) );
+  TEST_COMPARE( fromHex( "" ), Data{} );
+  for( const char* bad : { "4", "41 4", "4g", "41:42", "0123456789abcdef0123456789abcdeX" } )
+  {
+    bool thrown = false;
+    try
+    {
+      fromHex( bad );
+    }
+    catch( const std::invalid_argument& )
+    {
+      thrown = true;
+    }
+    TEST_VERIFY( thrown );
+  }
+
+  // every kernel against the scalar one, long enough for the vector loops, in pieces
+  std::vector<Hex::Kernel> kernels{ Hex::Kernel::Scalar };
+  if( Hex::bestKernel() != Hex::Kernel::Scalar )
+    kernels.push_back( Hex::bestKernel() );
+  const Data random = makeRandom( 1000 );
+  for( Hex::Kernel kernel : kernels )
+  {
+    LOG_DEBUG( "kernel: " << Hex::kernelName( kernel ) );
+    for( Size size : { 0, 1, 15, 16, 17, 31, 32, 33, 1000 } )
+    {
+      std::string hex( Hex::encodedSize( size ), '\0' );
+      Hex::encode( random.data(), size, &hex[ 0 ], kernel );
+      TEST_COMPARE( hex, toHex( DataView{ random.data(), size }, "" ) );
+      std::string upper = hex;
+      std::transform( upper.begin(), upper.end(), upper.begin(), ::toupper );
+
+      for( Size piece : { 1, 3, 16, 33, 5000 } )
+      {
+        Hex::Decoder decoder{ kernel };
+        Data decoded( Hex::Decoder::maxDecodedSize( upper.size() ) );
+        Size length = 0;
+        for( Size pos = 0; pos < upper.size(); pos += piece )
+        {
+          const Size count = std::min( piece, upper.size() - pos );
+          length += decoder.update( upper.data() + pos, count, decoded.data() + length );
+        }
+        decoder.finish();
+        decoded.resize( length );
+        TEST_COMPARE( decoded, Data( random.begin(), random.begin() + size ) );
+      }
+    }
+  }
+
+  // lines of 64 digits written through an ostream and read back
+  const std::string hex = toHex( random );
+  std::string expected;
+  for( Size pos = 0; pos < hex.size(); pos += HexWriter::lineLength )
+  {
+    expected += hex.substr( pos, HexWriter::lineLength ) + "\n";
+  }
+  std::ostringstream out;
+  writeData( random, out, WriteMode::Hex );
+  TEST_COMPARE( out.str(), expected );
+  TEST_VERIFY( detectReadMode( fromString( expected ) ) == ReadMode::Hex );
+
+  std::istringstream in{ expected };
+  HexReader reader{ in.rdbuf() };
+  std::istream decoded{ &reader };
+  TEST_COMPARE( readData( decoded, ReadMode::Raw ), random );
+  std::istringstream text{ expected };
+  TEST_COMPARE( readData( text, ReadMode::Auto ), random );
+  // text, that only looks like hex, e.g. an odd number of digits, is taken as it is
+  std::istringstream oddText{ "cafe1\n" };
+  TEST_COMPARE( readData( oddText, ReadMode::Auto ), fromString( "cafe1\n" ) );
 }
 
 void test_Base64()
@@ -39,6 +263,8 @@ void test_Base64()
 
   TEST_COMPARE( toBase64( fromString( "1234" ), true ), "MTIzNA==" );
   TEST_COMPARE( toBase64( fromString( "1234" ), false ), "MTIzNA" );
+  // nothing is written behind the last character
+  TEST_COMPARE( std::string{ toBase64( fromString( "1234" ), false ).c_str() }, "MTIzNA" );
 
   TEST_COMPARE( toBase64( fromString( "12345" ), true ), "MTIzNDU=" );
   TEST_COMPARE( toBase64( fromString( "12345" ), false ), "MTIzNDU" );
@@ -63,6 +289,138 @@ void test_Base64()
   TEST_COMPARE( toHex( dummy ), "fbf00c65ac73d39f" );
 }
 
+void test_Base64Kernels()
+{
+  const Data data = makeRandom( 5000 );
+  std::vector<Base64::Kernel> kernels{ Base64::Kernel::Scalar };
+  if( Base64::bestKernel() != Base64::Kernel::Scalar )
+    kernels.push_back( Base64::Kernel::Ssse3 );
+  if( Base64::bestKernel() == Base64::Kernel::Avx2 )
+    kernels.push_back( Base64::Kernel::Avx2 );
+
+  for( Base64::Kernel kernel : kernels )
+  {
+    LOG_DEBUG( "kernel: " << Base64::kernelName( kernel ) );
+    for( Size size : { 0, 1, 2, 3, 15, 16, 27, 28, 29, 100, 4999 } )
+    {
+      // compare with openssl, pass the data in pieces of a varying size
+      std::string expected( 4 * ( ( size + 2 ) / 3 ) + 1, 0 );
+      expected.resize( static_cast<Size>(
+          EVP_EncodeBlock( reinterpret_cast<unsigned char*>( &expected[ 0 ] ), data.data(),
+                           static_cast<int>( size ) ) ) );
+
+      std::string encoded( Base64::encodedSize( size ), 0 );
+      Base64::Encoder encoder{ kernel };
+      Size length = 0;
+      for( Size pos = 0, piece = 1; pos < size; pos += piece, piece = piece * 2 + 1 )
+      {
+        piece = std::min( piece, size - pos );
+        length += encoder.update( data.data() + pos, piece, &encoded[ length ] );
+      }
+      length += encoder.finish( &encoded[ length ] );
+      TEST_COMPARE( length, encoded.size() );
+      TEST_COMPARE( encoded, expected );
+
+      // wrapped lines, padding and whitespace in between are skipped
+      std::string wrapped;
+      for( Size pos = 0; pos < encoded.size(); pos += 72 )
+      {
+        wrapped += encoded.substr( pos, 72 ) + ( pos % 144 ? "\r\n" : "\n" );
+      }
+      wrapped.insert( wrapped.size() / 2, " \t" );
+      for( const std::string& text : { encoded, wrapped } )
+      {
+        Data decoded( Base64::maxDecodedSize( text.size() ) );
+        Base64::Decoder decoder{ kernel };
+        Size decodedLength = 0;
+        for( Size pos = 0, piece = 5; pos < text.size(); pos += piece, piece = piece * 3 + 1 )
+        {
+          piece = std::min( piece, text.size() - pos );
+          decodedLength += decoder.update( &text[ pos ], piece, &decoded[ decodedLength ] );
+        }
+        decoded.resize( decodedLength );
+        TEST_VERIFY( std::equal( decoded.begin(), decoded.end(), data.begin() ) );
+        TEST_COMPARE( decoded.size(), size );
+      }
+    }
+
+    // every character outside of the alphabet, at every position of a vector
+    for( int c = 0; c < 256; ++c )
+    {
+      const bool digit = std::isalnum( c ) || c == '+' || c == '/';
+      const bool skipped = c == '=' || c == ' ' || ( c >= '\t' && c <= '\r' );
+      if( digit )
+        continue;
+      for( Size pos : { 0, 7, 15, 31, 40 } )
+      {
+        std::string text = toBase64( Data( 45, 0x5a ) );
+        text[ pos ] = static_cast<char>( c );
+        Data decoded( Base64::maxDecodedSize( text.size() ) );
+        Base64::Decoder decoder{ kernel };
+        bool thrown = false;
+        try
+        {
+          decoded.resize( decoder.update( text.data(), text.size(), decoded.data() ) );
+        }
+        catch( const std::invalid_argument& )
+        {
+          thrown = true;
+        }
+        TEST_COMPARE( thrown, !skipped );
+        if( skipped )
+          TEST_COMPARE( decoded.size(), 44 );
+      }
+    }
+  }
+}
+
+void test_Armor()
+{
+  const Data data = makeRandom( 200000 );
+  for( Size size : { 0, 1, 53, 54, 55, 108, 1000, 200000 } )
+  {
+    const std::string base64 = toBase64( Data( data.begin(), data.begin() + size ) );
+    std::string expected;
+    for( Size pos = 0; pos < base64.size(); pos += ArmorWriter::lineLength )
+    {
+      expected += base64.substr( pos, ArmorWriter::lineLength ) + "\n";
+    }
+
+    // written in small pieces through an ostream
+    std::ostringstream out;
+    ArmorWriter writer{ out };
+    std::ostream armored{ &writer };
+    for( Size pos = 0; pos < size; pos += 777 )
+    {
+      armored.write( reinterpret_cast<const char*>( data.data() + pos ),
+                     static_cast<std::streamsize>( std::min<Size>( 777, size - pos ) ) );
+    }
+    writer.finish();
+    TEST_COMPARE( out.str(), expected );
+
+    std::istringstream in{ expected };
+    ArmorReader reader{ in.rdbuf() };
+    std::istream decoded{ &reader };
+    TEST_COMPARE( readData( decoded, ReadMode::Raw ),
+                  Data( data.begin(), data.begin() + size ) );
+  }
+
+  std::istringstream in{ "QUJD\nRE*=\n" };
+  ArmorReader reader{ in.rdbuf() };
+  std::istream decoded{ &reader };
+  decoded.exceptions( std::ios::badbit );
+  bool thrown = false;
+  try
+  {
+    readData( decoded, ReadMode::Raw );
+  }
+  catch( const std::invalid_argument& )
+  {
+    thrown = true;
+  }
+  TEST_VERIFY( thrown );
+}
+
 void test_SaveLoad()
 {
   const char testFilename[] = "/tmp/test-ssh-crypt.dat";
@@ -82,6 +440,31 @@ void test_SaveLoad()
   // read base64 as raw does not give the same result
   Data load2raw = loadFile( testFilename, ReadMode::Raw );
   TEST_VERIFY( testData != load2raw );
+
+  saveFile( testData, testFilename, WriteMode::Hex );
+  TEST_COMPARE( testData, loadFile( testFilename, ReadMode::Hex ) );
+  TEST_COMPARE( testData, loadFile( testFilename, ReadMode::Auto ) );
+
+  // larger than one read block, through the mapping and through a stream
+  Data bigData = makeRandom( 3 * 1024 * 1024 + 17 );
+  saveFile( bigData, testFilename, WriteMode::Raw );
+  TEST_COMPARE( bigData, loadFile( testFilename, ReadMode::Raw ) );
+  {
+    MappedFile mapped{ testFilename };
+    TEST_COMPARE( mapped.size(), bigData.size() );
+    TEST_VERIFY( std::equal( bigData.begin(), bigData.end(), mapped.data() ) );
+    std::istream in{ mapped.rdbuf() };
+    Data head( 100 );
+    in.read( reinterpret_cast<char*>( head.data() ), 100 );
+    TEST_VERIFY( std::equal( head.begin(), head.end(), bigData.begin() ) );
+  }
+  std::ifstream in{ testFilename, std::ios::binary };
+  TEST_COMPARE( bigData, readData( in, ReadMode::Raw ) );
+
+  saveFile( Data{}, testFilename, WriteMode::Raw );
+  MappedFile empty{ testFilename };
+  TEST_COMPARE( empty.size(), 0 );
+  TEST_VERIFY( loadFile( testFilename ).empty() );
 }
 
 void test_AgentMessage()
@@ -97,6 +480,80 @@ void test_AgentMessage()
   ba1.adjustMessageSize();
   TEST_COMPARE( ba1.getData().size(), 9 );
   TEST_COMPARE( ba1.getMessageSize(), 5 );
+  TEST_COMPARE( toHex( ba1.getData() ), "000000050100001267" );
+
+  // the fields are written in place, the reserved storage is not reallocated
+  const Data blob = fromString( "blob" );
+  AgentMessage ba2{ 0x02, 5 + 4 + 4 + blob.size() + 4 };
+  const Byte* storage = ba2.getData().data();
+  ba2.addInt( 0x01020304 );
+  ba2.addBlob( blob );
+  ba2.addBlob( nullptr, 0 );
+  ba2.adjustMessageSize();
+  TEST_VERIFY( ba2.getData().data() == storage );
+  TEST_COMPARE( toHex( ba2.getData() ), "00000011020102030400000004626c6f6200000000" );
+  Decoder decoder = ba2.decoder();
+  TEST_COMPARE( decoder.getInt(), 0x01020304 );
+  TEST_COMPARE( decoder.getBlobData(), blob );
+  TEST_COMPARE( decoder.getBlobData(), Data{} );
+
+  // views point into the message
+  decoder = ba2.decoder();
+  decoder.getInt();
+  const DataView view = decoder.getBlob();
+  TEST_VERIFY( view.data() == ba2.getData().data() + 13 );
+  TEST_VERIFY( view == blob );
+  TEST_VERIFY( ( view != DataView{ blob.data(), 3 } ) );
+  TEST_COMPARE( toString( view ), "blob" );
+  TEST_VERIFY( decoder.getBlob().empty() );
+
+  // a stream of messages, received in pieces of any size
+  Data stream = ba1.getData();
+  stream.insert( stream.end(), ba2.getData().begin(), ba2.getData().end() );
+  AgentMessage big{ 0x03 };
+  big.addBlob( makeRandom( 100000 ) );
+  big.adjustMessageSize();
+  stream.insert( stream.end(), big.getData().begin(), big.getData().end() );
+  for( Size piece : { 1, 3, 7, 4096 } )
+  {
+    MessageReader reader{ 256 * 1024 };
+    std::vector<Data> messages;
+    AgentMessage message;
+    for( Size pos = 0; pos < stream.size(); )
+    {
+      const Size room = reader.prepare( piece );
+      TEST_VERIFY( room >= piece );
+      const Size size = std::min( { piece, room, stream.size() - pos } );
+      std::copy( stream.begin() + pos, stream.begin() + pos + size, reader.tail() );
+      reader.commit( size );
+      pos += size;
+      while( reader.next( message ) )
+      {
+        messages.push_back( message.getData() );
+      }
+    }
+    TEST_VERIFY( reader.empty() );
+    TEST_COMPARE( messages.size(), 3 );
+    TEST_COMPARE( messages[ 1 ], ba2.getData() );
+    TEST_COMPARE( messages[ 2 ], big.getData() );
+  }
+
+  // a size beyond the limit is detected with the size field
+  MessageReader tooSmall{ 1000 };
+  tooSmall.prepare( 4 );
+  std::copy( big.getData().begin(), big.getData().begin() + 4, tooSmall.tail() );
+  tooSmall.commit( 4 );
+  AgentMessage message;
+  bool thrown = false;
+  try
+  {
+    tooSmall.next( message );
+  }
+  catch( const std::runtime_error& )
+  {
+    thrown = true;
+  }
+  TEST_VERIFY( thrown );
 }
 
 void test_SymCrypt()
@@ -121,23 +578,1092 @@ void test_SymCrypt()
   LOG_DEBUG( "plain: " << plain );
 }
 
+void test_SymCryptStream()
+{
+  Data key = fromString( "ABCDEFGHIJKLMNOPQRSTUVWXYZ012345" );
+  Data iv = fromString( "ABCDEFGHIJKLMNOP" );
+  SymCrypt crypt{ key, iv };
+
+  Data original = makeRandom( 1000 );
+  Data crypted;
+  crypt.beginEncrypt();
+  for( Size pos = 0; pos < original.size(); pos += 77 )
+  {
+    crypt.update( original.data() + pos, std::min<Size>( 77, original.size() - pos ), crypted );
+  }
+  crypt.finish( crypted );
+  TEST_COMPARE( toHex( crypted ), toHex( crypt.encrypt( original ) ) );
+
+  Data plain;
+  crypt.beginDecrypt();
+  crypt.update( crypted.data(), 500, plain );
+  crypt.update( crypted.data() + 500, crypted.size() - 500, plain );
+  crypt.finish( plain );
+  TEST_COMPARE( original, plain );
+}
+
+void test_SymCryptAead()
+{
+  // gcm test case 14 from the original specification
+  const Data key( 32, 0 );
+  const Data iv( 12, 0 );
+  SymCrypt gcm{ key, iv, SymCrypt::AES256GCM };
+  const Data crypted = gcm.encrypt( Data( 16, 0 ) );
+  TEST_COMPARE( toHex( crypted ),
+                "cea7403d4d606b6e074ec5d3baf39d18d0d1c8a799996bf0265b98b5d48ab919" );
+  TEST_COMPARE( gcm.decrypt( crypted ), Data( 16, 0 ) );
+
+  SymCrypt chacha{ key, iv, SymCrypt::CHACHA20POLY1305 };
+  const Data original = fromString( "Dideldadeldum" );
+  const Data aad = fromString( "header" );
+  Data sealed = chacha.encrypt( original, aad );
+  TEST_COMPARE( sealed.size(), original.size() + SymCrypt::tagSize );
+  TEST_COMPARE( chacha.decrypt( sealed, aad ), original );
+
+  bool failed = false;
+  try
+  {
+    chacha.decrypt( sealed, fromString( "other" ) );
+  }
+  catch( const std::runtime_error& )
+  {
+    failed = true;
+  }
+  TEST_VERIFY( failed );
+
+  TEST_VERIFY( SymCrypt::methodByName( "chacha20poly1305" ) == SymCrypt::CHACHA20POLY1305 );
+}
+
+void test_SymCryptReuse()
+{
+  const Data key = makeRandom( 32 );
+  for( auto method : { SymCrypt::AES256CBC, SymCrypt::AES256GCM } )
+  {
+    const Size ivSize = SymCrypt::ivSize( method );
+    SymCrypt crypt{ key, Data( ivSize, 0 ), method };
+    const Data original = fromString( "Dideldadeldum" );
+    crypt.encrypt( original );
+
+    // a new iv on the same object gives the same as a new object
+    const Data iv = makeRandom( ivSize );
+    crypt.setIv( iv );
+    const Data crypted = crypt.encrypt( original );
+    SymCrypt fresh{ key, iv, method };
+    TEST_COMPARE( toHex( crypted ), toHex( fresh.encrypt( original ) ) );
+    TEST_COMPARE( crypt.decrypt( crypted ), original );
+
+    std::vector<Data> records;
+    for( Size i = 0; i < 100; ++i )
+    {
+      records.push_back( makeRandom( i * 7 ) );
+    }
+    const Data packed = crypt.encryptPacked( records );
+    const auto unpacked = fresh.decryptPacked( packed );
+    TEST_COMPARE( unpacked.size(), records.size() );
+    TEST_VERIFY( unpacked == records );
+
+    // the records' ivs are not left behind in the object
+    TEST_COMPARE( toHex( crypt.encrypt( original ) ), toHex( crypted ) );
+    TEST_COMPARE( toHex( fresh.encrypt( original ) ), toHex( crypted ) );
+  }
+}
+
+void test_ReplayBuffer()
+{
+  TEST_VERIFY( detectReadMode( fromString( "TBQpM/Q9YRhw\n7AY/fBdMiw==\n" ) )
+               == ReadMode::Base64 );
+  TEST_VERIFY( detectReadMode( fromString( "TBQpM\x01" ) ) == ReadMode::Raw );
+  TEST_VERIFY( detectReadMode( Data{} ) == ReadMode::Raw );
+
+  std::istringstream source{ "dideldadeldum" };
+  Data head( 6 );
+  source.read( reinterpret_cast<char*>( head.data() ), 6 );
+  ReplayBuffer replay{ head, source.rdbuf() };
+  std::istream in{ &replay };
+  TEST_COMPARE( readData( in, ReadMode::Raw ), fromString( "dideldadeldum" ) );
+}
+
+void test_Container()
+{
+  const Data sessionKey = makeRandom( 83 );
+  const Data original = makeRandom( 10000 );
+
+  for( auto method :
+       { SymCrypt::AES256CBC, SymCrypt::AES256GCM, SymCrypt::CHACHA20POLY1305 } )
+  {
+    for( unsigned threads : { 1u, 4u } )
+    {
+      const int version = method == SymCrypt::AES256CBC && threads == 1 ? 1 : 2;
+      auto header = Container::makeHeader( version, 1000, method );
+      std::stringstream crypted;
+      std::istringstream in{ toString( original ) };
+      Container::encrypt( in, crypted, header, sessionKey, threads );
+
+      auto readBack = Container::readHeader( crypted );
+      TEST_COMPARE( readBack.version, version );
+      TEST_VERIFY( readBack.method == method );
+      TEST_COMPARE( readBack.salt, header.salt );
+      std::ostringstream plain;
+      Container::decrypt( crypted, plain, readBack, sessionKey, threads );
+      TEST_COMPARE( fromString( plain.str() ), original );
+    }
+  }
+
+  // segments are authenticated, a modified or missing one is detected
+  auto header = Container::makeHeader( 2, 1000 );
+  std::istringstream in{ toString( original ) };
+  std::ostringstream crypted;
+  Container::encrypt( in, crypted, header, sessionKey, 2 );
+  // behind the end mark: the index, its size and the index magic
+  const auto indexSize = []( const std::string& file ) {
+    return Decoder::net2int( reinterpret_cast<const Byte*>( file.data() + file.size() - 12 ) );
+  };
+  const auto stripIndex = [ &indexSize ]( const std::string& file ) {
+    return file.substr( 0, file.size() - 12 - indexSize( file ) );
+  };
+  const std::string indexed = crypted.str();
+  TEST_COMPARE( indexed.substr( indexed.size() - 8 ), "sshcindx" );
+  const std::string good = stripIndex( indexed );
+
+  std::string modified = good;
+  modified[ modified.size() - 1000 ] ^= 0x01;
+  // cut the last segment (size and tag of the empty rest) and keep the end mark
+  std::string truncated = good.substr( 0, good.size() - 4 - 4 - SymCrypt::tagSize )
+                          + good.substr( good.size() - 4 );
+
+  for( const auto& corrupted : { modified, truncated } )
+  {
+    std::istringstream corruptedIn{ corrupted };
+    std::ostringstream plain;
+    bool failed = false;
+    try
+    {
+      Container::decrypt(
+          corruptedIn, plain, Container::readHeader( corruptedIn ), sessionKey, 2 );
+    }
+    catch( const std::runtime_error& ex )
+    {
+      TEST_COMPARE( std::string{ ex.what() }, "authentication failed" );
+      failed = true;
+    }
+    TEST_VERIFY( failed );
+  }
+
+  // empty plain data is one empty segment, without it only the end mark is left
+  std::istringstream emptyIn;
+  std::stringstream emptyCrypted;
+  Container::encrypt( emptyIn, emptyCrypted, header, sessionKey, 2 );
+  std::ostringstream emptyPlain;
+  Container::decrypt(
+      emptyCrypted, emptyPlain, Container::readHeader( emptyCrypted ), sessionKey, 2 );
+  TEST_VERIFY( emptyPlain.str().empty() );
+  std::istringstream headerIn{ good };
+  Container::readHeader( headerIn );
+  const std::string headerOnly
+      = good.substr( 0, static_cast<Size>( headerIn.tellg() ) ) + std::string( 4, '\0' );
+  for( bool range : { false, true } )
+  {
+    std::istringstream cutIn{ headerOnly };
+    const auto cutHeader = Container::readHeader( cutIn );
+    std::ostringstream plain;
+    bool failed = false;
+    try
+    {
+      if( range )
+        Container::decryptRange( cutIn, plain, cutHeader, sessionKey, 0, 10 );
+      else
+        Container::decrypt( cutIn, plain, cutHeader, sessionKey, 2 );
+    }
+    catch( const std::runtime_error& ex )
+    {
+      TEST_COMPARE( std::string{ ex.what() }, "invalid input (truncated)" );
+      failed = true;
+    }
+    TEST_VERIFY( failed );
+  }
+
+  // so is the header, fields that take no part in the key are checked as well
+  auto otherSize = header;
+  otherSize.segmentSize = 2000;
+  auto otherFingerprint = header;
+  otherFingerprint.fingerprint = "someone else";
+  for( const auto& tampered : { otherSize, otherFingerprint } )
+  {
+    std::istringstream goodIn{ good };
+    Container::readHeader( goodIn );
+    std::ostringstream plain;
+    bool failed = false;
+    try
+    {
+      Container::decrypt( goodIn, plain, tampered, sessionKey, 2 );
+    }
+    catch( const std::runtime_error& ex )
+    {
+      TEST_COMPARE( std::string{ ex.what() }, "authentication failed" );
+      failed = true;
+    }
+    TEST_VERIFY( failed );
+  }
+
+  // ranges through the index and by scanning a file without one, the key is in the header
+  for( auto method :
+       { SymCrypt::AES256CBC, SymCrypt::AES256GCM, SymCrypt::CHACHA20POLY1305 } )
+  {
+    auto rangeHeader = Container::makeHeader( 2, 1000, method );
+    rangeHeader.fingerprint = "fingerprint";
+    std::istringstream rangeIn{ toString( original ) };
+    std::ostringstream rangeCrypted;
+    Container::encrypt( rangeIn, rangeCrypted, rangeHeader, sessionKey, 2 );
+    const std::string withIndex = rangeCrypted.str();
+
+    const std::string withoutIndex = stripIndex( withIndex );
+    for( const auto& file : { withIndex, withoutIndex } )
+    {
+      const std::vector<std::pair<Size, Size>> ranges{
+        { 0, 10000 }, { 0, 1 },       { 999, 2 },   { 1000, 1000 }, { 4321, 3000 },
+        { 9990, 100 }, { 10000, 10 }, { 20000, 1 }, { 500, 0 },     { 1, Size( -1 ) } };
+      for( const auto& [ offset, length ] : ranges )
+      {
+        std::istringstream fileIn{ file };
+        const auto readBack = Container::readHeader( fileIn );
+        TEST_COMPARE( readBack.fingerprint, "fingerprint" );
+        std::ostringstream plain;
+        Container::decryptRange( fileIn, plain, readBack, sessionKey, offset, length, 2 );
+        const Size begin = std::min( offset, original.size() );
+        const Size size = std::min( length, original.size() - begin );
+        TEST_COMPARE( fromString( plain.str() ),
+                      Data( original.begin() + begin, original.begin() + begin + size ) );
+      }
+    }
+  }
+
+  // compressed segments: text shrinks, random data is stored, ranges work the same
+  std::string text;
+  for( int line = 0; text.size() < 100000; ++line )
+  {
+    text += "line " + std::to_string( line ) + ": the quick brown fox\n";
+  }
+  for( auto method :
+       { SymCrypt::AES256CBC, SymCrypt::AES256GCM, SymCrypt::CHACHA20POLY1305 } )
+  {
+    for( const std::string& content : { text, toString( original ), std::string{} } )
+    {
+      auto zipHeader
+          = Container::makeHeader( 2, 4096, method, Container::Compression::Zlib );
+      TEST_COMPARE( zipHeader.version, 3 );
+      std::istringstream zipIn{ content };
+      std::stringstream zipped;
+      Container::encrypt( zipIn, zipped, zipHeader, sessionKey, 4 );
+      if( content == text )
+        TEST_VERIFY( zipped.str().size() < content.size() / 4 );
+      else
+        TEST_VERIFY( zipped.str().size() > content.size() );
+
+      const auto readBack = Container::readHeader( zipped );
+      TEST_COMPARE( readBack.version, 3 );
+      TEST_VERIFY( readBack.compression == Container::Compression::Zlib );
+      std::ostringstream plain;
+      Container::decrypt( zipped, plain, readBack, sessionKey, 4 );
+      TEST_COMPARE( plain.str(), content );
+
+      std::istringstream rangeIn{ zipped.str() };
+      std::ostringstream range;
+      Container::decryptRange(
+          rangeIn, range, Container::readHeader( rangeIn ), sessionKey, 5000, 9000, 2 );
+      TEST_COMPARE( range.str(),
+                    content.substr( std::min<Size>( 5000, content.size() ), 9000 ) );
+    }
+  }
+  bool thrown = false;
+  try
+  {
+    Container::makeHeader( 1, 4096, SymCrypt::AES256CBC, Container::Compression::Zlib );
+  }
+  catch( const std::runtime_error& )
+  {
+    thrown = true;
+  }
+  TEST_VERIFY( thrown );
+
+  // an index out of order is ignored, the segments are scanned instead
+  std::string swapped = indexed;
+  const Size offsetsBegin = indexed.size() - 12 - indexSize( indexed ) + 13;
+  std::swap_ranges( swapped.begin() + offsetsBegin, swapped.begin() + offsetsBegin + 8,
+                    swapped.begin() + offsetsBegin + 8 );
+  std::istringstream swappedIn{ swapped };
+  std::ostringstream swappedOut;
+  Container::decryptRange(
+      swappedIn, swappedOut, Container::readHeader( swappedIn ), sessionKey, 1500, 10, 1 );
+  TEST_COMPARE( fromString( swappedOut.str() ),
+                Data( original.begin() + 1500, original.begin() + 1510 ) );
+
+  // version 4: a random data key, wrapped for every recipient
+  const Data dataKey = makeRandom( Container::dataKeySize );
+  const Data recipientSalt = makeRandom( Container::saltSize );
+  const Data otherKey = makeRandom( 64 );
+  auto envelopeHeader = Container::makeHeader( Container::envelopeVersion, 1000 );
+  TEST_VERIFY( envelopeHeader.salt.empty() );
+  envelopeHeader.recipients.push_back(
+      Container::wrapKey( dataKey, "first", recipientSalt, sessionKey ) );
+  envelopeHeader.recipients.push_back(
+      Container::wrapKey( dataKey, "second", recipientSalt, otherKey ) );
+  TEST_VERIFY( envelopeHeader.recipients[ 0 ].nonce != envelopeHeader.recipients[ 1 ].nonce );
+  std::istringstream envelopeIn{ toString( original ) };
+  std::ostringstream envelope;
+  Container::encrypt( envelopeIn, envelope, envelopeHeader, dataKey, 2 );
+
+  std::istringstream envelopeReadIn{ envelope.str() };
+  const auto envelopeRead = Container::readHeader( envelopeReadIn );
+  TEST_COMPARE( envelopeRead.version, Container::envelopeVersion );
+  TEST_COMPARE( envelopeRead.recipients.size(), 2 );
+  TEST_COMPARE( envelopeRead.recipients[ 1 ].fingerprint, "second" );
+  TEST_COMPARE( Container::unwrapKey( envelopeRead.recipients[ 0 ], sessionKey ), dataKey );
+  TEST_COMPARE( Container::unwrapKey( envelopeRead.recipients[ 1 ], otherKey ), dataKey );
+  thrown = false;
+  try
+  {
+    Container::unwrapKey( envelopeRead.recipients[ 1 ], sessionKey );
+  }
+  catch( const std::runtime_error& )
+  {
+    thrown = true;
+  }
+  TEST_VERIFY( thrown );
+
+  // a new header in front of the copied segments, the index follows the new offsets
+  auto rewrapped = envelopeRead;
+  rewrapped.recipients.pop_back();
+  std::ostringstream replaced;
+  Container::replaceHeader( envelopeReadIn, replaced, rewrapped );
+  TEST_VERIFY( replaced.str().size() < envelope.str().size() );
+  std::istringstream replacedIn{ replaced.str() };
+  const auto replacedHeader = Container::readHeader( replacedIn );
+  TEST_COMPARE( replacedHeader.recipients.size(), 1 );
+  TEST_COMPARE( replacedHeader.nonce, envelopeHeader.nonce );
+  std::ostringstream replacedRange;
+  Container::decryptRange( replacedIn, replacedRange, replacedHeader, dataKey, 2500, 10, 1 );
+  TEST_COMPARE( fromString( replacedRange.str() ),
+                Data( original.begin() + 2500, original.begin() + 2510 ) );
+  std::istringstream replacedFullIn{ replaced.str() };
+  std::ostringstream replacedFull;
+  Container::decrypt(
+      replacedFullIn, replacedFull, Container::readHeader( replacedFullIn ), dataKey );
+  TEST_COMPARE( fromString( replacedFull.str() ), original );
+}
+
 void test_ShaHash()
 {
   Data data = fromString( "ABCDEFGHIJKLMNOP" );
   Data sha256sum = ShaHash::check( data );
   std::string hex = toHex( sha256sum );
   TEST_COMPARE( hex, "e7e8b89c2721d290cc5f55425491ecd6831355e91063f20b39c22f9ec6a71f91" );
+
+  // in pieces, and the context is reused after final() and reset()
+  ShaHash hash;
+  hash.update( DataView{ data.data(), 5 } ).update( DataView{} );
+  hash.update( DataView{ data.data() + 5, data.size() - 5 } );
+  TEST_COMPARE( hash.final(), sha256sum );
+  TEST_COMPARE( toHex( hash.final() ),
+                "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855" );
+  hash.update( fromString( "garbage" ) );
+  hash.reset();
+  const Data big = makeRandom( 3 * 1024 * 1024 + 17 );
+  for( Size pos = 0; pos < big.size(); pos += 65536 )
+  {
+    hash.update( DataView{ big.data() + pos, std::min<Size>( 65536, big.size() - pos ) } );
+  }
+  TEST_COMPARE( hash.final(), ShaHash::check( big ) );
+
+  // RFC 5869 test case 1
+  Data ikm( 22, 0x0b );
+  Data salt{ 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c };
+  std::string info{ "\xf0\xf1\xf2\xf3\xf4\xf5\xf6\xf7\xf8\xf9" };
+  TEST_COMPARE( toHex( ShaHash::hkdf( ikm, salt, info, 42 ) ),
+                "3cb25f25faacd57a90434f64d0362f2a2d2d0a90cf1a5a4c5d"
+                "b02d56ecc4c5bf34007208d5b887185865" );
+}
+
+void test_MockAgent()
+{
+  MockAgent::Options options;
+  options.keys = 3;
+  MockAgent mock{ options };
+  TEST_COMPARE( mock.fingerprints().size(), 3 );
+
+  AgentComm agent{ mock.socketName() };
+  const auto identities = agent.requestIdentities();
+  TEST_COMPARE( identities.size(), 3 );
+  TEST_COMPARE( toBase64( ShaHash::check( identities[ 1 ].pubkey ), false ),
+                mock.fingerprints()[ 1 ] );
+  TEST_COMPARE( toString( identities[ 2 ].comment ), "mock key 2" );
+  // all identities share the one answer, they stay valid without the list
+  TEST_VERIFY( identities[ 0 ].response == identities[ 2 ].response );
+  const IdentityTable table{ agent.requestIdentities() };
+  TEST_COMPARE( table.entries().size(), 3 );
+  const IdentityTable::Entry* found = table.find( mock.fingerprints()[ 1 ].c_str() );
+  TEST_VERIFY( found && found->identity.pubkey == identities[ 1 ].pubkey );
+  TEST_VERIFY( found->identity.pubkey.data() != identities[ 1 ].pubkey.data() );
+  TEST_VERIFY( table.find( nullptr ) == &table.entries().front() );
+  TEST_VERIFY( !table.find( "unknown" ) );
+  TEST_COMPARE( table.byComment( "mock key 2" ).size(), 1 );
+  TEST_COMPARE( table.byComment( "mock key 2" ).front()->fingerprint,
+                mock.fingerprints()[ 2 ] );
+  TEST_COMPARE( table.byKeyType( "ssh-ed25519" ).size(), 3 );
+  TEST_VERIFY( table.byKeyType( "ssh-rsa" ).empty() );
+  // an unchanged answer takes the fingerprints over
+  const IdentityTable again{ agent.requestIdentities(), &table };
+  TEST_COMPARE( again.get( nullptr ).fingerprint, mock.fingerprints()[ 0 ] );
+  TEST_COMPARE( again.get( mock.fingerprints()[ 2 ].c_str() ).keyType, "ssh-ed25519" );
+
+  // ed25519 signatures are deterministic
+  const Data salt = makeRandom( 32 );
+  const Data signature = agent.requestSignature( identities[ 2 ].pubkey, salt );
+  TEST_COMPARE( signature.size(), 4 + 11 + 4 + 64 );
+  TEST_COMPARE( agent.requestSignature( identities[ 2 ].pubkey, salt ), signature );
+  TEST_VERIFY( agent.requestSignature( identities[ 0 ].pubkey, salt ) != signature );
+  TEST_COMPARE( mock.signRequests(), 3 );
+
+  const auto fails = [ & ]( const std::function<void()>& function ) {
+    try
+    {
+      function();
+    }
+    catch( const std::runtime_error& )
+    {
+      return true;
+    }
+    return false;
+  };
+  mock.setFailEvery( 1 );
+  TEST_VERIFY( fails( [ & ]() { agent.requestSignature( identities[ 0 ].pubkey, salt ); } ) );
+  mock.setFailEvery( 0 );
+  TEST_VERIFY( fails( [ & ]() { agent.requestSignature( fromString( "unknown" ), salt ); } ) );
+
+  // pipelined on one connection and spread over a pool, in the order of the salts
+  std::vector<Data> salts;
+  for( int i = 0; i < 40; ++i )
+  {
+    salts.push_back( makeRandom( 32 ) );
+  }
+  const auto pipelined = agent.requestSignatures( identities[ 1 ].pubkey, salts );
+  TEST_COMPARE( pipelined.size(), salts.size() );
+  TEST_COMPARE( pipelined[ 17 ],
+                agent.requestSignature( identities[ 1 ].pubkey, salts[ 17 ] ) );
+
+  // the mock answers the connections in parallel, the pool keeps several of them busy at
+  // once, one connection never has more than one request answered at a time
+  TEST_COMPARE( mock.maxInFlight(), 1 );
+  mock.setLatency( std::chrono::milliseconds{ 50 } );
+  AgentPool pool{ 4, mock.socketName() };
+  const auto pooled = pool.requestSignatures(
+      identities[ 1 ].pubkey, std::vector<Data>( salts.begin(), salts.begin() + 8 ) );
+  TEST_VERIFY( mock.maxInFlight() > 1 );
+  TEST_VERIFY( mock.maxInFlight() <= 4 );
+  TEST_VERIFY( std::equal( pooled.begin(), pooled.end(), pipelined.begin() ) );
+  mock.setLatency( std::chrono::milliseconds{ 0 } );
+  TEST_VERIFY( pool.requestSignatures( identities[ 1 ].pubkey, salts ) == pipelined );
+
+  options.disconnectEvery = 2;
+  MockAgent dropping{ options };
+  AgentComm droppedAgent{ dropping.socketName() };
+  droppedAgent.requestIdentities();
+  TEST_VERIFY( fails( [ & ]() { droppedAgent.requestIdentities(); } ) );
+}
+
+void test_AsyncAgent()
+{
+  MockAgent::Options options;
+  options.keys = 2;
+  MockAgent mock{ options };
+  AgentComm agent{ mock.socketName() };
+  const auto identities = agent.requestIdentities();
+  const Data salt = makeRandom( 32 );
+  const Data signature = agent.requestSignature( identities[ 1 ].pubkey, salt );
+
+  // futures, completed by run()
+  AsyncAgentComm async{ mock.socketName() };
+  auto asyncIdentities = async.requestIdentities();
+  auto asyncSignature = async.requestSignature( identities[ 1 ].pubkey, salt );
+  TEST_VERIFY( async.busy() );
+  async.run();
+  TEST_VERIFY( !async.busy() );
+  TEST_COMPARE( asyncIdentities.get().size(), 2 );
+  TEST_COMPARE( asyncSignature.get(), signature );
+
+  // callbacks, driven by an own poll loop, a callback may send the next request
+  std::vector<Data> signatures;
+  async.requestIdentities(
+      [ & ]( std::vector<AgentComm::Identity> result, std::exception_ptr error ) {
+        TEST_VERIFY( !error );
+        async.requestSignature( result[ 1 ].pubkey, salt,
+                                [ & ]( Data signature, std::exception_ptr ) {
+                                  signatures.push_back( signature );
+                                } );
+      } );
+  while( async.busy() )
+  {
+    pollfd fds{ async.fd(), async.events(), 0 };
+    TEST_VERIFY( poll( &fds, 1, async.pollTimeout() ) >= 0 );
+    async.handleEvents( fds.revents );
+  }
+  TEST_COMPARE( signatures.size(), 1 );
+  TEST_COMPARE( signatures.front(), signature );
+
+  const auto timedOut = []( auto& future ) {
+    try
+    {
+      future.get();
+    }
+    catch( const std::runtime_error& ex )
+    {
+      return std::string{ ex.what() } == "agent timed out";
+    }
+    return false;
+  };
+
+  // a stalled agent fails the requests after their deadline, not after its answer
+  mock.setLatency( std::chrono::milliseconds{ 1000 } );
+  async.setTimeout( std::chrono::milliseconds{ 50 } );
+  auto first = async.requestSignature( identities[ 0 ].pubkey, salt );
+  auto second = async.requestSignature( identities[ 1 ].pubkey, salt );
+  async.run();
+  TEST_VERIFY( timedOut( first ) );
+  TEST_VERIFY( timedOut( second ) );
+  TEST_COMPARE( async.fd(), -1 );
+
+  // blocking connections and the pool time out as well
+  agent.setTimeout( std::chrono::milliseconds{ 50 } );
+  std::future<Data> blocking = std::async( std::launch::deferred, [ & ]() {
+    return agent.requestSignature( identities[ 1 ].pubkey, salt );
+  } );
+  TEST_VERIFY( timedOut( blocking ) );
+  AgentPool pool{ 2, mock.socketName() };
+  pool.setTimeout( std::chrono::milliseconds{ 50 } );
+  std::future<std::vector<Data>> pooled = std::async( std::launch::deferred, [ & ]() {
+    return pool.requestSignatures( identities[ 1 ].pubkey, { salt, salt, salt } );
+  } );
+  TEST_VERIFY( timedOut( pooled ) );
+
+  // the next request connects again
+  mock.setLatency( std::chrono::milliseconds{ 0 } );
+  auto again = async.requestSignature( identities[ 1 ].pubkey, salt );
+  async.run();
+  TEST_COMPARE( again.get(), signature );
 }
 
+void test_Cryptor()
+{
+  MockAgent::Options options;
+  options.keys = 2;
+  MockAgent mock{ options };
+  mock.exportSocket();
+  const auto fingerprints = mock.fingerprints();
+
+  const auto keys = Cryptor::getAvailableKeys();
+  TEST_COMPARE( keys.size(), 2 );
+  TEST_COMPARE( keys[ 1 ].sha256, fingerprints[ 1 ] );
+
+  // in memory (version 1) and streaming, with the first and with a chosen key
+  const Data plain = makeRandom( 100000 );
+  TEST_COMPARE( Cryptor::decrypt( Cryptor::encrypt( plain ) ), plain );
+  const std::string id = fingerprints[ 1 ];
+  TEST_COMPARE( Cryptor::decrypt( Cryptor::encrypt( plain, id.c_str() ), id.c_str() ), plain );
+
+  std::istringstream in{ toString( plain ) };
+  std::ostringstream encrypted;
+  Cryptor::encrypt( in, encrypted, id.c_str() );
+  std::istringstream encryptedIn{ encrypted.str() };
+  std::ostringstream decrypted;
+  Cryptor::decrypt( encryptedIn, decrypted, id.c_str() );
+  TEST_COMPARE( fromString( decrypted.str() ), plain );
+
+  // encrypted again with the session of the decryption: same salt, new nonce, no agent
+  {
+    std::istringstream sessionIn{ encrypted.str() };
+    std::ostringstream sessionOut;
+    Cryptor::Session session;
+    Cryptor::decrypt( sessionIn, sessionOut, session, id.c_str() );
+    TEST_COMPARE( fromString( sessionOut.str() ), plain );
+
+    const Size before = mock.signRequests();
+    std::istringstream plainIn{ sessionOut.str() };
+    std::ostringstream reencrypted;
+    Cryptor::encrypt( plainIn, reencrypted, session, id.c_str() );
+    TEST_COMPARE( mock.signRequests(), before );
+
+    std::istringstream headerIn{ reencrypted.str() };
+    const auto header = Container::readHeader( headerIn );
+    TEST_COMPARE( header.salt, session.header.salt );
+    TEST_VERIFY( header.nonce != session.header.nonce );
+    std::istringstream reencryptedIn{ reencrypted.str() };
+    std::ostringstream redecrypted;
+    Cryptor::decrypt( reencryptedIn, redecrypted, id.c_str() );
+    TEST_COMPARE( fromString( redecrypted.str() ), plain );
+  }
+
+  // without an id the key named in the header is used, a part is decrypted alone
+  std::istringstream headerKeyIn{ encrypted.str() };
+  TEST_COMPARE( Container::readHeader( headerKeyIn ).fingerprint, id );
+  std::istringstream firstIn{ toString( plain ) };
+  std::ostringstream firstEncrypted;
+  Cryptor::encrypt( firstIn, firstEncrypted );
+  std::istringstream firstHeaderIn{ firstEncrypted.str() };
+  TEST_COMPARE( Container::readHeader( firstHeaderIn ).fingerprint, fingerprints[ 0 ] );
+  std::istringstream rangeIn{ encrypted.str() };
+  std::ostringstream range;
+  Cryptor::decryptRange( rangeIn, range, 50000, 20 );
+  TEST_COMPARE( fromString( range.str() ),
+                Data( plain.begin() + 50000, plain.begin() + 50020 ) );
+  // version 1 and input, that can't seek, are refused before the agent is asked
+  std::istringstream versionOneIn{ toString( Cryptor::encrypt( plain ) ) };
+  std::istringstream streamIn{ encrypted.str() };
+  ReplayBuffer unseekable{ Data{}, streamIn.rdbuf() };
+  std::istream unseekableIn{ &unseekable };
+  const Size beforeRange = mock.signRequests();
+  for( std::istream* rangeSource : std::vector<std::istream*>{ &versionOneIn, &unseekableIn } )
+  {
+    std::ostringstream refused;
+    bool refusedThrown = false;
+    try
+    {
+      Cryptor::decryptRange( *rangeSource, refused, 0, 20, id.c_str() );
+    }
+    catch( const std::runtime_error& )
+    {
+      refusedThrown = true;
+    }
+    TEST_VERIFY( refusedThrown );
+  }
+  TEST_COMPARE( mock.signRequests(), beforeRange );
+
+  // the other key gives another session key
+  std::istringstream wrongIn{ encrypted.str() };
+  std::ostringstream wrongOut;
+  bool thrown = false;
+  try
+  {
+    Cryptor::decrypt( wrongIn, wrongOut, fingerprints[ 0 ].c_str() );
+  }
+  catch( const std::runtime_error& )
+  {
+    thrown = true;
+  }
+  TEST_VERIFY( thrown );
+
+  // for many recipients, one signature each, every one of them decrypts
+  {
+    Cryptor::Options envelopeOptions;
+    envelopeOptions.recipients = fingerprints;
+    const Size beforeEnvelope = mock.signRequests();
+    std::istringstream envelopeIn{ toString( plain ) };
+    std::ostringstream envelope;
+    Cryptor::encrypt( envelopeIn, envelope, nullptr, envelopeOptions );
+    TEST_COMPARE( mock.signRequests(), beforeEnvelope + 2 );
+
+    const auto decryptWith = []( const std::string& file, const char* key ) {
+      std::istringstream fileIn{ file };
+      std::ostringstream fileOut;
+      Cryptor::decrypt( fileIn, fileOut, key );
+      return fromString( fileOut.str() );
+    };
+    TEST_COMPARE( decryptWith( envelope.str(), fingerprints[ 0 ].c_str() ), plain );
+    TEST_COMPARE( decryptWith( envelope.str(), fingerprints[ 1 ].c_str() ), plain );
+    TEST_COMPARE( decryptWith( envelope.str(), nullptr ), plain );
+
+    // the session is the data key, the recipients are kept
+    std::istringstream sessionIn{ envelope.str() };
+    std::ostringstream sessionOut;
+    Cryptor::Session session;
+    Cryptor::decrypt( sessionIn, sessionOut, session );
+    const Size beforeSession = mock.signRequests();
+    std::istringstream plainIn{ sessionOut.str() };
+    std::ostringstream reencrypted;
+    Cryptor::encrypt( plainIn, reencrypted, session );
+    TEST_COMPARE( mock.signRequests(), beforeSession );
+    TEST_COMPARE( decryptWith( reencrypted.str(), fingerprints[ 1 ].c_str() ), plain );
+
+    // removing a recipient needs no agent, adding one needs the data key and its key
+    const auto rewrap = []( const std::string& file,
+                            const std::vector<std::string>& add,
+                            const std::vector<std::string>& remove ) {
+      std::istringstream fileIn{ file };
+      std::ostringstream fileOut;
+      Cryptor::rewrap( fileIn, fileOut, add, remove );
+      return fileOut.str();
+    };
+    const Size beforeRemove = mock.signRequests();
+    const std::string removed = rewrap( envelope.str(), {}, { fingerprints[ 1 ] } );
+    TEST_COMPARE( mock.signRequests(), beforeRemove );
+    TEST_COMPARE( decryptWith( removed, fingerprints[ 0 ].c_str() ), plain );
+    thrown = false;
+    try
+    {
+      decryptWith( removed, fingerprints[ 1 ].c_str() );
+    }
+    catch( const std::runtime_error& )
+    {
+      thrown = true;
+    }
+    TEST_VERIFY( thrown );
+
+    const Size beforeAdd = mock.signRequests();
+    const std::string added = rewrap( removed, { fingerprints[ 1 ] }, {} );
+    TEST_COMPARE( mock.signRequests(), beforeAdd + 2 );
+    TEST_COMPARE( decryptWith( added, fingerprints[ 1 ].c_str() ), plain );
+    TEST_COMPARE( added.size(), envelope.str().size() );
+
+    // the last recipient, an unknown one and files without recipients can't be removed
+    for( const auto& [ file, remove ] :
+         std::vector<std::pair<std::string, std::string>>{ { removed, fingerprints[ 0 ] },
+                                                           { removed, fingerprints[ 1 ] },
+                                                           { encrypted.str(), id } } )
+    {
+      thrown = false;
+      try
+      {
+        rewrap( file, {}, { remove } );
+      }
+      catch( const std::runtime_error& )
+      {
+        thrown = true;
+      }
+      TEST_VERIFY( thrown );
+    }
+  }
+
+  // with the cache the agent is asked once, even by concurrent callers
+  const Data salt = makeRandom( 32 );
+  const Size before = mock.signRequests();
+  Cryptor::getSessionKey( salt, nullptr );
+  Cryptor::getSessionKey( salt, nullptr );
+  TEST_COMPARE( mock.signRequests(), before + 2 );
+
+  Cryptor::setCacheTimeout( std::chrono::seconds{ 60 } );
+  mock.setLatency( std::chrono::milliseconds{ 50 } );
+  std::vector<std::future<SecureData>> results;
+  for( int i = 0; i < 8; ++i )
+  {
+    results.push_back( std::async( std::launch::async, [ &salt ]() {
+      return Cryptor::getSessionKey( salt, nullptr );
+    } ) );
+  }
+  const SecureData sessionKey = results.front().get();
+  for( Size i = 1; i < results.size(); ++i )
+  {
+    TEST_COMPARE( results[ i ].get(), sessionKey );
+  }
+  TEST_COMPARE( mock.signRequests(), before + 3 );
+  mock.setLatency( std::chrono::milliseconds{ 0 } );
+
+  // a failed request is not cached
+  const Data otherSalt = makeRandom( 32 );
+  mock.setFailEvery( 1 );
+  thrown = false;
+  try
+  {
+    Cryptor::getSessionKey( otherSalt, nullptr );
+  }
+  catch( const std::runtime_error& )
+  {
+    thrown = true;
+  }
+  TEST_VERIFY( thrown );
+  mock.setFailEvery( 0 );
+  Cryptor::getSessionKey( otherSalt, nullptr );
+
+  // neither is one, that timed out
+  const Data slowSalt = makeRandom( 32 );
+  mock.setLatency( std::chrono::milliseconds{ 500 } );
+  Cryptor::setAgentTimeout( std::chrono::milliseconds{ 50 } );
+  thrown = false;
+  try
+  {
+    Cryptor::getSessionKey( slowSalt, nullptr );
+  }
+  catch( const std::runtime_error& )
+  {
+    thrown = true;
+  }
+  TEST_VERIFY( thrown );
+  Cryptor::setAgentTimeout( std::chrono::milliseconds{ 0 } );
+  mock.setLatency( std::chrono::milliseconds{ 0 } );
+  Cryptor::getSessionKey( slowSalt, nullptr );
+
+  // many salts at once, cached ones are not requested again
+  std::vector<Data> salts{ salt, makeRandom( 32 ), makeRandom( 32 ), otherSalt };
+  const Size beforeMany = mock.signRequests();
+  const auto sessionKeys = Cryptor::getSessionKeys( salts, nullptr );
+  TEST_COMPARE( sessionKeys.size(), 4 );
+  TEST_COMPARE( sessionKeys[ 0 ], sessionKey );
+  TEST_COMPARE( mock.signRequests(), beforeMany + 2 );
+  TEST_COMPARE( Cryptor::getSessionKey( salts[ 2 ], nullptr ), sessionKeys[ 2 ] );
+  TEST_COMPARE( mock.signRequests(), beforeMany + 2 );
+
+  // entries are filed by fingerprint, no id is the first key and its id alike
+  const Data idSalt = makeRandom( 32 );
+  const Size beforeId = mock.signRequests();
+  const SecureData firstKey = Cryptor::getSessionKey( idSalt, nullptr );
+  TEST_COMPARE( Cryptor::getSessionKey( idSalt, fingerprints[ 0 ].c_str() ), firstKey );
+  TEST_COMPARE( Cryptor::getSessionKey( idSalt, "" ), firstKey );
+  TEST_COMPARE( mock.signRequests(), beforeId + 1 );
+  const SecureData secondKey = Cryptor::getSessionKey( idSalt, fingerprints[ 1 ].c_str() );
+  TEST_VERIFY( secondKey != firstKey );
+  TEST_COMPARE( Cryptor::getSessionKey( idSalt, nullptr ), firstKey );
+  TEST_COMPARE( mock.signRequests(), beforeId + 2 );
+  const Data explicitSalt = makeRandom( 32 );
+  const SecureData explicitKey
+      = Cryptor::getSessionKey( explicitSalt, fingerprints[ 0 ].c_str() );
+  TEST_COMPARE( Cryptor::getSessionKey( explicitSalt, nullptr ), explicitKey );
+  TEST_COMPARE( mock.signRequests(), beforeId + 3 );
+  Cryptor::clearCache();
+  Cryptor::setCacheTimeout( std::chrono::seconds{ 0 } );
+
+  // a batch needs one signature for all files
+  {
+    const Size beforeBatch = mock.signRequests();
+    Cryptor::Batch batch;
+    std::vector<std::string> files;
+    for( int i = 0; i < 5; ++i )
+    {
+      std::istringstream fileIn{ "file " + std::to_string( i ) };
+      std::ostringstream fileOut;
+      Cryptor::encrypt( fileIn, fileOut );
+      files.push_back( fileOut.str() );
+    }
+    for( int i = 0; i < 5; ++i )
+    {
+      std::istringstream fileIn{ files[ i ] };
+      std::ostringstream fileOut;
+      Cryptor::decrypt( fileIn, fileOut );
+      TEST_COMPARE( fileOut.str(), "file " + std::to_string( i ) );
+    }
+    TEST_COMPARE( mock.signRequests(), beforeBatch + 1 );
+  }
+}
+
+void test_SshCryptAgent()
+{
+  MockAgent::Options options;
+  options.keys = 2;
+  MockAgent mock{ options };
+  mock.exportSocket();
+  const auto fingerprints = mock.fingerprints();
+
+  char directory[] = "/tmp/sshcrypt-test-XXXXXX";
+  TEST_VERIFY( mkdtemp( directory ) );
+  const std::string socketName = std::string{ directory } + "/agent.sock";
+
+  // a lifetime, that has run out before a key is stored, is a usage error, so is a
+  // negative timeout, which would fail every request at once (0 waits forever)
+  for( const auto& [ option, value ] : std::vector<std::pair<std::string, std::string>>{
+           { "-t", "0" }, { "-t", "-5" }, { "-t", "ten" }, { "-T", "-1" } } )
+  {
+    Process refused{ "sshcrypt-agent", { "-f", "-s", socketName, option, value } };
+    TEST_COMPARE( refused.wait(), 2 );
+  }
+
+  Process daemon{ "sshcrypt-agent", { "-f", "-s", socketName, "-t", "60" } };
+  std::unique_ptr<AgentComm> client;
+  for( int attempt = 0; !client && attempt < 1000; ++attempt )
+  {
+    try
+    {
+      client = std::make_unique<AgentComm>( socketName );
+    }
+    catch( const std::runtime_error& )
+    {
+      std::this_thread::sleep_for( std::chrono::milliseconds{ 10 } ); // not listening yet
+    }
+  }
+  TEST_VERIFY( client );
+
+  // the session key is the signature of ssh-agent
+  AgentComm agent{ mock.socketName() };
+  const auto identities = agent.requestIdentities();
+  const Data salt = makeRandom( 32 );
+  const Data signature = agent.requestSignature( identities[ 1 ].pubkey, salt );
+  const Size before = mock.signRequests();
+  TEST_COMPARE( client->requestDerivedKey( fingerprints[ 1 ], salt ), signature );
+  TEST_COMPARE( mock.signRequests(), before + 1 );
+
+  // kept for the lifetime, ssh-agent isn't asked again
+  TEST_COMPARE( client->requestDerivedKey( fingerprints[ 1 ], salt ), signature );
+  TEST_COMPARE( mock.signRequests(), before + 1 );
+
+  // without an id the first key, the answer names it, an unknown one fails and the
+  // daemon goes on
+  std::string signer;
+  TEST_COMPARE( client->requestDerivedKey( "", salt, &signer ),
+                agent.requestSignature( identities[ 0 ].pubkey, salt ) );
+  TEST_COMPARE( signer, fingerprints[ 0 ] );
+  bool thrown = false;
+  try
+  {
+    client->requestDerivedKey( "unknown", salt );
+  }
+  catch( const std::runtime_error& )
+  {
+    thrown = true;
+  }
+  TEST_VERIFY( thrown );
+  TEST_COMPARE( client->requestDerivedKey( fingerprints[ 1 ], salt ), signature );
+
+  // Cryptor finds it through SSHCRYPT_AGENT_SOCK
+  setenv( "SSHCRYPT_AGENT_SOCK", socketName.c_str(), 1 );
+  const Size beforeCryptor = mock.signRequests();
+  TEST_COMPARE( Cryptor::getSessionKey( salt, fingerprints[ 1 ].c_str() ),
+                SecureData( signature.begin(), signature.end() ) );
+  TEST_COMPARE( mock.signRequests(), beforeCryptor );
+
+  // encrypting without an id takes the name of the key from the daemon, ssh-agent only
+  // gets the sign request
+  const Size beforeEncrypt = mock.requests();
+  std::istringstream plainIn{ "plain" };
+  std::ostringstream encrypted;
+  Cryptor::encrypt( plainIn, encrypted );
+  TEST_COMPARE( mock.requests(), beforeEncrypt + 1 );
+  std::istringstream encryptedIn{ encrypted.str() };
+  TEST_COMPARE( Container::readHeader( encryptedIn ).fingerprint, fingerprints[ 0 ] );
+  unsetenv( "SSHCRYPT_AGENT_SOCK" );
+
+  // a client, that sends requests but doesn't read the replies, holds up no one else
+  const int stalled = AgentComm::connectSocket( socketName );
+  const std::string name = SSHCRYPT_EXTENSION_DERIVE_KEY;
+  AgentMessage request{ SSH_AGENTC_EXTENSION,
+                        5 + 4 + name.size() + 4 + fingerprints[ 1 ].size() + 4 + salt.size() };
+  request.addBlob( fromString( name ) );
+  request.addBlob( fromString( fingerprints[ 1 ] ) );
+  request.addBlob( salt );
+  request.adjustMessageSize();
+  const auto& requestData = request.getData();
+  // until its socket is full, or far beyond what the socket buffers take
+  Size requestsSent = 0;
+  Size pos = 0;
+  for( int full = 0; requestsSent < 20000 && full < 100; )
+  {
+    const ssize_t sl = send( stalled, requestData.data() + pos, requestData.size() - pos,
+                             MSG_DONTWAIT | MSG_NOSIGNAL );
+    if( sl <= 0 )
+    {
+      ++full;
+      std::this_thread::sleep_for( std::chrono::milliseconds{ 1 } );
+      continue;
+    }
+    full = 0;
+    pos += static_cast<Size>( sl );
+    if( pos == requestData.size() )
+    {
+      pos = 0;
+      ++requestsSent;
+    }
+  }
+  client->setTimeout( std::chrono::seconds{ 5 } );
+  TEST_COMPARE( client->requestDerivedKey( fingerprints[ 1 ], salt ), signature );
+  close( stalled );
+
+  // SIGTERM stops it, the socket is removed
+  client.reset();
+  TEST_COMPARE( daemon.stop(), 0 );
+  struct stat info;
+  TEST_VERIFY( stat( socketName.c_str(), &info ) != 0 );
+  rmdir( directory );
+}
+
+void test_Batch()
+{
+  MockAgent mock;
+  mock.exportSocket();
+
+  char directory[] = "/tmp/sshcrypt-test-XXXXXX";
+  TEST_VERIFY( mkdtemp( directory ) );
+  const std::string top = directory;
+  const auto readFile = []( const std::string& name ) {
+    std::ifstream in{ name, std::ios::binary };
+    std::ostringstream content;
+    content << in.rdbuf();
+    return content.str();
+  };
+
+  // a tree of files, one directory can't be read (unless we are root)
+  const std::vector<std::string> names{ "a", "sub/b", "sub/deeper/c", "locked/d" };
+  for( const auto& dir : { "/sub", "/sub/deeper", "/locked" } )
+  {
+    TEST_COMPARE( mkdir( ( top + dir ).c_str(), 0700 ), 0 );
+  }
+  for( const auto& name : names )
+  {
+    std::ofstream{ top + "/" + name } << "content of " << name;
+  }
+  // bad numbers are usage errors, before any file is touched
+  for( const auto& [ option, value ] : std::vector<std::pair<std::string, std::string>>{
+           { "-j", "-1" }, { "-j", "0" }, { "-T", "-1" }, { "-T", "1e3" } } )
+  {
+    Process refused{ "sshcrypt", { "-B", "-e", option, value, top } };
+    TEST_COMPARE( refused.wait(), 2 );
+  }
+  // so is a negative range and one for anything but decrypting a single file
+  for( const auto& args : std::vector<std::vector<std::string>>{ { "-d", "-r", "-1:5" },
+                                                                 { "-d", "-r", "0:-5" },
+                                                                 { "-e", "-r", "0" },
+                                                                 { "-B", "-d", "-r", "0" } } )
+  {
+    auto withFile = args;
+    withFile.push_back( top + "/a" );
+    Process refused{ "sshcrypt", withFile };
+    TEST_COMPARE( refused.wait(), 2 );
+  }
+  TEST_VERIFY( access( ( top + "/a.sshcrypt" ).c_str(), F_OK ) != 0 );
+
+  const std::string locked = top + "/locked";
+  chmod( locked.c_str(), 0 );
+  const bool denied = access( locked.c_str(), R_OK | X_OK ) != 0;
+  const int expected = denied ? 1 : 0;
+
+  // the others are en- and decrypted nevertheless, the failure is reported at the end
+  Process encrypt{ "sshcrypt", { "-B", "-e", top } };
+  TEST_COMPARE( encrypt.wait(), expected );
+  for( Size i = 0; i < 3; ++i )
+  {
+    const std::string name = top + "/" + names[ i ];
+    TEST_VERIFY( access( ( name + ".sshcrypt" ).c_str(), R_OK ) == 0 );
+    TEST_COMPARE( unlink( name.c_str() ), 0 );
+  }
+
+  Process decrypt{ "sshcrypt", { "-B", "-d", top } };
+  TEST_COMPARE( decrypt.wait(), expected );
+  for( Size i = 0; i < 3; ++i )
+  {
+    TEST_COMPARE( readFile( top + "/" + names[ i ] ), "content of " + names[ i ] );
+  }
+
+  chmod( locked.c_str(), 0700 );
+  std::filesystem::remove_all( top );
+}
 } // namespace SshCrypt
 
-int main( int, char** )
+int main( int, char** argv )
 {
+  const std::string self = argv[ 0 ];
+  SshCrypt::programDirectory = self.substr( 0, self.rfind( '/' ) + 1 );
+
   TEST_RUN( SshCrypt::test_Data );
+  TEST_RUN( SshCrypt::test_SecureData );
   TEST_RUN( SshCrypt::test_Hex );
   TEST_RUN( SshCrypt::test_Base64 );
+  TEST_RUN( SshCrypt::test_Base64Kernels );
+  TEST_RUN( SshCrypt::test_Armor );
   TEST_RUN( SshCrypt::test_SaveLoad );
   TEST_RUN( SshCrypt::test_AgentMessage );
   TEST_RUN( SshCrypt::test_SymCrypt );
+  TEST_RUN( SshCrypt::test_SymCryptStream );
+  TEST_RUN( SshCrypt::test_SymCryptAead );
+  TEST_RUN( SshCrypt::test_SymCryptReuse );
+  TEST_RUN( SshCrypt::test_ReplayBuffer );
+  TEST_RUN( SshCrypt::test_Container );
   TEST_RUN( SshCrypt::test_ShaHash );
+  TEST_RUN( SshCrypt::test_MockAgent );
+  TEST_RUN( SshCrypt::test_AsyncAgent );
+  TEST_RUN( SshCrypt::test_Cryptor );
+  TEST_RUN( SshCrypt::test_SshCryptAgent );
+  TEST_RUN( SshCrypt::test_Batch );
 }
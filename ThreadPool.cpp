@@ -0,0 +1,66 @@
+// SPDX-License-Identifier: MIT
+
+#include "ThreadPool.h"
+
+namespace SshCrypt
+{
+//! \a threads is 0 means one thread per core
+ThreadPool::ThreadPool( unsigned threads )
+{
+  if( threads == 0 )
+    threads = defaultThreads();
+
+  workers.reserve( threads );
+  for( unsigned i = 0; i < threads; ++i )
+  {
+    workers.emplace_back( [ this ]() { run(); } );
+  }
+}
+
+//! waits for all submitted tasks
+ThreadPool::~ThreadPool()
+{
+  {
+    std::lock_guard<std::mutex> lock{ mutex };
+    stopping = true;
+  }
+  condition.notify_all();
+  for( auto& worker : workers )
+  {
+    worker.join();
+  }
+}
+
+unsigned ThreadPool::defaultThreads() // static
+{
+  const unsigned cores = std::thread::hardware_concurrency();
+  return cores ? cores : 1;
+}
+
+void ThreadPool::push( std::function<void()> task )
+{
+  {
+    std::lock_guard<std::mutex> lock{ mutex };
+    tasks.push_back( std::move( task ) );
+  }
+  condition.notify_one();
+}
+
+void ThreadPool::run()
+{
+  for( ;; )
+  {
+    std::function<void()> task;
+    {
+      std::unique_lock<std::mutex> lock{ mutex };
+      condition.wait( lock, [ this ]() { return stopping || !tasks.empty(); } );
+      if( tasks.empty() )
+        return;
+
+      task = std::move( tasks.front() );
+      tasks.pop_front();
+    }
+    task();
+  }
+}
+} // namespace SshCrypt
@@ -0,0 +1,50 @@
+// SPDX-License-Identifier: MIT
+
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace SshCrypt
+{
+class ThreadPool
+{
+public:
+  explicit ThreadPool( unsigned threads = 0 );
+  ~ThreadPool();
+  ThreadPool( const ThreadPool& ) = delete;
+  ThreadPool& operator=( const ThreadPool& ) = delete;
+
+  static unsigned defaultThreads();
+  //! more threads than this only cost memory
+  static unsigned maxThreads() { return 4 * defaultThreads(); }
+  unsigned size() const { return static_cast<unsigned>( workers.size() ); }
+
+  //! run \a function on one of the worker threads
+  template <typename Function>
+  auto submit( Function function ) -> std::future<decltype( function() )>
+  {
+    using Result = decltype( function() );
+    auto task = std::make_shared<std::packaged_task<Result()>>( std::move( function ) );
+    auto result = task->get_future();
+    push( [ task ]() { ( *task )(); } );
+    return result;
+  }
+
+private:
+  std::mutex mutex;
+  std::condition_variable condition;
+  std::deque<std::function<void()>> tasks;
+  std::vector<std::thread> workers;
+  bool stopping = false;
+
+  void push( std::function<void()> task );
+  void run();
+};
+} // namespace SshCrypt